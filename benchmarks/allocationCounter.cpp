@@ -0,0 +1,27 @@
+#include "allocationCounter.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace {
+    std::atomic<std::size_t> allocations{0};
+
+    void* countedAllocate(std::size_t size) {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+        void* ptr = std::malloc(size ? size : 1);
+        if (!ptr) throw std::bad_alloc();
+        return ptr;
+    }
+}
+
+std::size_t bench::allocationCount() {
+    return allocations.load(std::memory_order_relaxed);
+}
+
+void* operator new(std::size_t size) { return countedAllocate(size); }
+void* operator new[](std::size_t size) { return countedAllocate(size); }
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete[](void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, std::size_t) noexcept { std::free(ptr); }
+void operator delete[](void* ptr, std::size_t) noexcept { std::free(ptr); }
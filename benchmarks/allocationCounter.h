@@ -0,0 +1,21 @@
+// allocationCounter.h : Counts heap allocations made through the global operator new.
+//
+// Link allocationCounter.cpp into a benchmark executable to enable the counting.
+
+#pragma once
+
+#include <cstddef>
+
+namespace bench {
+    // Number of calls to the global operator new since program start.
+    std::size_t allocationCount();
+
+    // Runs fn the given number of times and returns the average number of allocations per run.
+    template<typename F>
+    double measureAllocations(std::size_t iterations, F fn) {
+        fn(0);
+        std::size_t before = allocationCount();
+        for (std::size_t i = 0; i < iterations; i++) fn(i);
+        return static_cast<double>(allocationCount() - before) / iterations;
+    }
+}
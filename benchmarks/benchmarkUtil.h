@@ -0,0 +1,44 @@
+// benchmarkUtil.h : Small timing helpers shared by the benchmark executables.
+//
+// Every result is printed as one JSON object per line so runs can be collected and compared by scripts.
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <iostream>
+#include <string>
+
+namespace bench {
+    // Keeps the compiler from optimizing away the value computed by a benchmark. Takes scalar values only.
+    template<typename T>
+    inline void doNotOptimize(T value) {
+        static volatile T sink;
+        sink = value;
+    }
+
+    // Runs fn the given number of times and returns the average time of one run in nanoseconds.
+    template<typename F>
+    double measureNs(std::size_t iterations, F fn) {
+        // Warm up caches and lazily initialized tables first.
+        for (std::size_t i = 0; i < iterations / 10 + 1; i++) fn(i);
+
+        auto start = std::chrono::steady_clock::now();
+        for (std::size_t i = 0; i < iterations; i++) fn(i);
+        auto end = std::chrono::steady_clock::now();
+
+        return std::chrono::duration<double, std::nano>(end - start).count() / iterations;
+    }
+
+    // Prints one benchmark result as a JSON line.
+    inline void report(const std::string& name, std::size_t iterations, double nsPerOp) {
+        std::cout << "{\"benchmark\":\"" << name << "\",\"iterations\":" << iterations
+                  << ",\"ns_per_op\":" << nsPerOp << "}" << std::endl;
+    }
+
+    // Same, with the number of heap allocations per operation.
+    inline void report(const std::string& name, std::size_t iterations, double nsPerOp, double allocationsPerOp) {
+        std::cout << "{\"benchmark\":\"" << name << "\",\"iterations\":" << iterations
+                  << ",\"ns_per_op\":" << nsPerOp << ",\"allocations_per_op\":" << allocationsPerOp << "}" << std::endl;
+    }
+}
@@ -0,0 +1,65 @@
+// callbackBench.cpp : Measures what handing a received message to the user callback costs.
+//
+// Compares the former by-value callback (a copy of mhl::Messages including its per-instance
+// message map), the compatibility overload of Client::connect and the by-reference mhl::MessageEvent.
+
+#include "allocationCounter.h"
+#include "benchmarkUtil.h"
+#include "messageHandler.h"
+
+#include <functional>
+
+// mhl::Messages as it was before, with a populated message map in every instance.
+class LegacyMessages : public mhl::Messages {
+public:
+    mhl::MessageMap_t messageMap;
+
+    LegacyMessages() {
+        for (std::size_t i = 0; i < static_cast<std::size_t>(mhl::MessageTypes::Unknown); i++)
+            messageMap[static_cast<mhl::MessageTypes>(i)] = mhl::messageTypeNames[i].name;
+    }
+};
+
+static unsigned int legacyCallback(const LegacyMessages msg) { return msg.sensorReading.Data[0]; }
+static unsigned int compatCallback(const mhl::Messages msg) { return msg.sensorReading.Data[0]; }
+
+// Handler state after connecting to a server with a few devices and one sensor stream.
+template<typename T>
+static void fillState(T& handler) {
+    json deviceList = json::parse(R"({"DeviceList":{"Id":1,"Devices":[
+        {"DeviceName":"Vibrator","DeviceIndex":0,"DeviceMessages":{"ScalarCmd":[{"StepCount":20,"ActuatorType":"Vibrate","FeatureDescriptor":"Motor 1"},{"StepCount":20,"ActuatorType":"Vibrate","FeatureDescriptor":"Motor 2"}],"StopDeviceCmd":{}}},
+        {"DeviceName":"Stroker","DeviceIndex":1,"DeviceMessages":{"LinearCmd":[{"StepCount":100,"ActuatorType":"Position","FeatureDescriptor":"Stroke"}],"StopDeviceCmd":{}}},
+        {"DeviceName":"Rotator","DeviceIndex":2,"DeviceMessages":{"RotateCmd":[{"StepCount":10,"ActuatorType":"Rotate","FeatureDescriptor":"Spin"}],"StopDeviceCmd":{}}},
+        {"DeviceName":"Sensor plug","DeviceIndex":3,"DeviceMessages":{"ScalarCmd":[{"StepCount":20,"ActuatorType":"Vibrate","FeatureDescriptor":""}],"SensorReadCmd":[{"SensorType":"Pressure","FeatureDescriptor":"","SensorRange":[[0,1000]]}],"StopDeviceCmd":{}}}]}})");
+    handler.handleServerMessage(deviceList);
+    json reading = json::parse(R"({"SensorReading":{"Id":0,"DeviceIndex":3,"SensorIndex":0,"SensorType":"Pressure","Data":[591]}})");
+    handler.handleServerMessage(reading);
+}
+
+int main() {
+    const std::size_t iterations = 200000;
+
+    LegacyMessages legacyHandler;
+    fillState(legacyHandler);
+    mhl::Messages handler;
+    fillState(handler);
+
+    // The callbacks are stored in std::function like in Client.
+    std::function<void(const LegacyMessages&)> legacy = [](const LegacyMessages& m) { bench::doNotOptimize(legacyCallback(m)); };
+    void (*compatPtr)(const mhl::Messages) = [](const mhl::Messages m) { bench::doNotOptimize(compatCallback(m)); };
+    mhl::MessageCallback compat = [compatPtr](const mhl::MessageEvent& event) { compatPtr(event.messages()); };
+    mhl::MessageCallback event = [](const mhl::MessageEvent& e) { bench::doNotOptimize(e.sensorReading().Data[0]); };
+
+    auto runLegacy = [&](std::size_t) { legacy(legacyHandler); };
+    auto runCompat = [&](std::size_t) { compat(mhl::MessageEvent(handler.messageType, 0, handler)); };
+    auto runEvent = [&](std::size_t) { event(mhl::MessageEvent(handler.messageType, 0, handler)); };
+
+    bench::report("callback/by_value_with_message_map", iterations,
+        bench::measureNs(iterations, runLegacy), bench::measureAllocations(iterations, runLegacy));
+    bench::report("callback/compat_by_value", iterations,
+        bench::measureNs(iterations, runCompat), bench::measureAllocations(iterations, runCompat));
+    bench::report("callback/event_by_reference", iterations,
+        bench::measureNs(iterations, runEvent), bench::measureAllocations(iterations, runEvent));
+
+    return 0;
+}
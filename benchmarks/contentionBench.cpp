@@ -0,0 +1,109 @@
+// contentionBench.cpp : Measures how long sendScalar keeps application threads waiting while the client is busy
+// with inbound traffic.
+//
+// A local MockServer plays the Buttplug server: it answers every request and streams SensorReading messages
+// to the client meanwhile. The user callback spends a while on every reading, like an application
+// updating its UI would. N producer threads call sendScalar at the same time and the latency of every call is
+// recorded. Command scheduling is disabled so every call goes all the way to the outbound queue.
+//
+// Usage: contentionBench [port], the server listens on 127.0.0.1:12399 by default.
+
+#include "benchmarkUtil.h"
+#include "buttplugclient.h"
+#include "mockServer.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+// Time the user callback spends on every sensor reading.
+static const std::chrono::microseconds callbackWork(200);
+// Interval between two sensor readings streamed by the server.
+static const std::chrono::microseconds streamInterval(100);
+static const std::size_t callsPerProducer = 20000;
+
+// Keeps the calling thread busy for the given time, like real work in a callback.
+static void spin(std::chrono::microseconds duration) {
+    auto end = std::chrono::steady_clock::now() + duration;
+    while (std::chrono::steady_clock::now() < end) {}
+}
+
+static void run(Client& client, const DeviceClass& device, unsigned int producers, std::atomic<unsigned long long>& readings) {
+    std::vector<std::vector<long long>> latencies(producers);
+    std::vector<std::thread> threads;
+    unsigned long long readingsBefore = readings;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned int t = 0; t < producers; t++) {
+        threads.push_back(std::thread([&client, &device, &latencies, t]() {
+            std::vector<long long>& own = latencies[t];
+            own.reserve(callsPerProducer);
+            for (std::size_t i = 0; i < callsPerProducer; i++) {
+                auto before = std::chrono::steady_clock::now();
+                client.sendScalar(device, (i % 20) / 20.0);
+                auto after = std::chrono::steady_clock::now();
+                own.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(after - before).count());
+            }
+        }));
+    }
+    for (auto& el : threads) el.join();
+    auto end = std::chrono::steady_clock::now();
+
+    std::vector<long long> all;
+    for (auto& el : latencies) all.insert(all.end(), el.begin(), el.end());
+    std::sort(all.begin(), all.end());
+    double total = 0;
+    for (long long el : all) total += el;
+
+    std::cout << "{\"benchmark\":\"contention/send_scalar/" << producers << "_producers\",\"iterations\":" << all.size()
+              << ",\"ns_per_op\":" << total / all.size()
+              << ",\"p50_ns\":" << all[all.size() / 2]
+              << ",\"p99_ns\":" << all[all.size() * 99 / 100]
+              << ",\"max_ns\":" << all.back()
+              << ",\"calls_per_s\":" << all.size() / std::chrono::duration<double>(end - start).count()
+              << ",\"sensor_readings\":" << readings - readingsBefore << "}" << std::endl;
+
+    // Let the client work off what is still queued before the next round.
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+}
+
+int main(int argc, char** argv) {
+    int port = argc > 1 ? std::atoi(argv[1]) : 12399;
+
+    MockServer server(port);
+    MockDevice device;
+    device.name = "Bench Device";
+    device.vibrators = 2;
+    device.sensors = { "Pressure" };
+    server.addDevice(device);
+    std::string error;
+    if (!server.start(error)) {
+        std::cerr << "Could not listen on port " << port << ": " << error << std::endl;
+        return 1;
+    }
+
+    std::atomic<unsigned long long> readings{0};
+    {
+        Client client("ws://127.0.0.1", port);
+        client.setCommandScheduling(false);
+        client.connect([&readings](const mhl::MessageEvent& event) {
+            if (event.messageType != mhl::MessageTypes::SensorReading) return;
+            spin(callbackWork);
+            readings++;
+        });
+        auto result = client.requestDeviceListAsync(std::chrono::seconds(5)).get();
+        std::vector<DeviceClass> devices = client.getDevices();
+        if (result.status != mhl::CommandStatus::Ok || devices.empty()) {
+            std::cerr << "Could not get the device list from the local server" << std::endl;
+            return 1;
+        }
+
+        // Stream sensor readings to the client for as long as the producers run.
+        server.startSensorStream(0, 0, "Pressure", streamInterval);
+
+        const unsigned int producerCounts[] = { 1, 2, 4, 8 };
+        for (unsigned int producers : producerCounts) run(client, devices[0], producers, readings);
+
+        server.stopSensorStreams();
+    }
+    server.stop();
+    return 0;
+}
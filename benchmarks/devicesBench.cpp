@@ -0,0 +1,98 @@
+// devicesBench.cpp : Measures what the client rebuilds whenever the device list changes.
+//
+// Every DeviceList, DeviceAdded and DeviceRemoved message makes the client rebuild its feature tables and
+// publish a new devices snapshot. Checks first that devices keep their generation across rebuilds, then
+// measures time and allocations per rebuild for 1, 50 and 500 connected devices.
+
+#include "allocationCounter.h"
+#include "benchmarkUtil.h"
+#include "buttplugclient.h"
+
+// Builds a device the way Intiface reports a typical toy with a few actuators and a battery sensor.
+static Device makeDevice(unsigned int index) {
+    Device device;
+    device.DeviceName = "Lovense Device " + std::to_string(index);
+    device.DeviceIndex = index;
+    device.DeviceMessageTimingGap = 100;
+    device.DeviceDisplayName = "My toy " + std::to_string(index);
+
+    DeviceCmd scalar;
+    scalar.CmdType = "ScalarCmd";
+    for (unsigned int i = 0; i < 3; i++) {
+        DeviceCmdAttr attr;
+        attr.FeatureDescriptor = "Vibrator " + std::to_string(i);
+        attr.StepCount = 20;
+        attr.ActuatorType = "Vibrate";
+        scalar.DeviceCmdAttributes.push_back(attr);
+    }
+    DeviceCmd linear;
+    linear.CmdType = "LinearCmd";
+    DeviceCmdAttr position;
+    position.StepCount = 100;
+    position.ActuatorType = "Position";
+    linear.DeviceCmdAttributes.push_back(position);
+    DeviceCmd sensor;
+    sensor.CmdType = "SensorReadCmd";
+    DeviceCmdAttr battery;
+    battery.FeatureDescriptor = "Battery Level";
+    battery.SensorType = "Battery";
+    battery.SensorRange = { 0, 100 };
+    sensor.DeviceCmdAttributes.push_back(battery);
+    DeviceCmd stop;
+    stop.CmdType = "StopDeviceCmd";
+
+    device.DeviceMessages = { scalar, linear, sensor, stop };
+    return device;
+}
+
+static std::vector<Device> makeDevices(unsigned int count) {
+    std::vector<Device> devices;
+    for (unsigned int i = 0; i < count; i++) devices.push_back(makeDevice(i));
+    return devices;
+}
+
+static bool verify() {
+    unsigned int nextGeneration = 1;
+    std::vector<Device> devices = makeDevices(3);
+    std::unordered_map<unsigned int, DeviceFeatures> features = buildDeviceFeatures(devices, {}, nextGeneration);
+    // Device 1 leaves and device 7 arrives, the others must keep their generation.
+    devices.erase(devices.begin() + 1);
+    devices.push_back(makeDevice(7));
+    std::unordered_map<unsigned int, DeviceFeatures> next = buildDeviceFeatures(devices, features, nextGeneration);
+    if (next.size() != 3 || next.at(0).generation != features.at(0).generation || next.at(2).generation != features.at(2).generation ||
+        next.at(7).generation != 4 || nextGeneration != 5) {
+        std::cerr << "Generations are wrong" << std::endl;
+        return false;
+    }
+    if (next.at(0).features[static_cast<int>(CommandKind::Scalar)].size() != 3 || next.at(0).timingGap != 100) {
+        std::cerr << "Features are wrong" << std::endl;
+        return false;
+    }
+    DeviceSnapshot snapshot = buildDeviceSnapshot(devices, next);
+    if (snapshot->size() != 3 || (*snapshot)[2].deviceID != 7 || (*snapshot)[2].generation != 4 || (*snapshot)[0].commandTypes.size() != 4) {
+        std::cerr << "Snapshot is wrong" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int main() {
+    if (!verify()) return 1;
+
+    const unsigned int deviceCounts[] = { 1, 50, 500 };
+    for (unsigned int count : deviceCounts) {
+        std::vector<Device> devices = makeDevices(count);
+        unsigned int nextGeneration = 1;
+        std::unordered_map<unsigned int, DeviceFeatures> features = buildDeviceFeatures(devices, {}, nextGeneration);
+        // Rebuild against the previous tables, like the client does on every device list change.
+        auto rebuild = [&](std::size_t) {
+            std::unordered_map<unsigned int, DeviceFeatures> next = buildDeviceFeatures(devices, features, nextGeneration);
+            features.swap(next);
+            bench::doNotOptimize(buildDeviceSnapshot(devices, features)->size());
+        };
+        const std::size_t iterations = 200000 / (count * 10) + 10;
+        bench::report("update_devices/" + std::to_string(count) + "_devices", iterations,
+            bench::measureNs(iterations, rebuild), bench::measureAllocations(iterations, rebuild));
+    }
+    return 0;
+}
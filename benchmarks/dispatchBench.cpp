@@ -0,0 +1,62 @@
+// dispatchBench.cpp : Measures the cost of resolving message types, per message.
+//
+// Compares the std::map based lookup that used to run on every inbound and outbound message
+// against the constant-time table in messageHandler.h.
+
+#include "benchmarkUtil.h"
+#include "messageHandler.h"
+
+#include <algorithm>
+#include <vector>
+
+int main() {
+    const std::size_t iterations = 2000000;
+
+    // The map the lookups used to scan.
+    mhl::MessageMap_t messageMap;
+    std::vector<std::string> names;
+    for (std::size_t i = 0; i < static_cast<std::size_t>(mhl::MessageTypes::Unknown); i++) {
+        messageMap[static_cast<mhl::MessageTypes>(i)] = mhl::messageTypeNames[i].name;
+        names.push_back(mhl::messageTypeNames[i].name);
+    }
+
+    // Inbound traffic is dominated by these, so measure them on their own too.
+    std::vector<std::string> hotNames = { "Ok", "SensorReading" };
+
+    // String to enum, the way handleServerMessage used to resolve a received message.
+    auto mapFromString = [&](const std::string& name) {
+        auto result = std::find_if(
+            messageMap.begin(),
+            messageMap.end(),
+            [&name](const std::pair<const mhl::MessageTypes, std::string>& mo) { return mo.second == name; });
+        return result == messageMap.end() ? mhl::MessageTypes::Unknown : result->first;
+    };
+
+    bench::report("dispatch/from_string/map_scan/all_types", iterations, bench::measureNs(iterations, [&](std::size_t i) {
+        bench::doNotOptimize(mapFromString(names[i % names.size()]));
+    }));
+    bench::report("dispatch/from_string/perfect_hash/all_types", iterations, bench::measureNs(iterations, [&](std::size_t i) {
+        bench::doNotOptimize(mhl::messageTypeFromString(names[i % names.size()]));
+    }));
+    bench::report("dispatch/from_string/map_scan/ok_sensor_reading", iterations, bench::measureNs(iterations, [&](std::size_t i) {
+        bench::doNotOptimize(mapFromString(hotNames[i & 1]));
+    }));
+    bench::report("dispatch/from_string/perfect_hash/ok_sensor_reading", iterations, bench::measureNs(iterations, [&](std::size_t i) {
+        bench::doNotOptimize(mhl::messageTypeFromString(hotNames[i & 1]));
+    }));
+
+    // Enum to string, the way sendMessage used to find the name for logging.
+    bench::report("dispatch/to_string/map_scan", iterations, bench::measureNs(iterations, [&](std::size_t i) {
+        mhl::MessageTypes type = static_cast<mhl::MessageTypes>(i % names.size());
+        auto result = std::find_if(
+            messageMap.begin(),
+            messageMap.end(),
+            [type](std::pair<const mhl::MessageTypes, std::string> mo) { return mo.first == type; });
+        bench::doNotOptimize(result->second.size());
+    }));
+    bench::report("dispatch/to_string/table", iterations, bench::measureNs(iterations, [&](std::size_t i) {
+        bench::doNotOptimize(mhl::messageTypeName(static_cast<mhl::MessageTypes>(i % names.size())));
+    }));
+
+    return 0;
+}
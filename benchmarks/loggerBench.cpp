@@ -0,0 +1,60 @@
+// loggerBench.cpp : Measures how many entries per second the Logger writes to disk.
+//
+// Producer threads log entries as fast as they can while the background thread writes them, the time runs
+// until stop returns so every entry is on disk. Runs with the default flush policy and with a flush after
+// every batch of entries while producers wait for room in the queue, with the binary format, then with
+// both drop policies, which report how many entries were dropped.
+//
+// Usage: loggerBench [directory], the log files are written to the current directory by default.
+
+#include "benchmarkUtil.h"
+#include "log.h"
+
+#include <vector>
+
+static const std::size_t entriesPerProducer = 200000;
+
+static void run(const std::string& name, const std::string& baseFilename, unsigned int producers, std::chrono::milliseconds flushInterval,
+                LogOverflowPolicy policy, LogFormat format = LogFormat::Text) {
+    // Large enough that the run does not rotate files.
+    Logger logger(baseFilename, 256 * 1024 * 1024);
+    logger.setFlushPolicy(flushInterval, 64 * 1024);
+    logger.setOverflowPolicy(policy);
+    logger.start(baseFilename, format);
+
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned int t = 0; t < producers; t++) {
+        threads.push_back(std::thread([&logger]() {
+            for (std::size_t i = 0; i < entriesPerProducer; i++) {
+                if (i % 2 == 0) logger.logSentMessage(mhl::MessageTypes::ScalarCmd, static_cast<unsigned int>(i));
+                else logger.logReceivedMessage(mhl::MessageTypes::Ok, static_cast<unsigned int>(i));
+            }
+        }));
+    }
+    for (auto& el : threads) el.join();
+    auto logged = std::chrono::steady_clock::now();
+    logger.stop();
+    auto end = std::chrono::steady_clock::now();
+
+    std::size_t entries = entriesPerProducer * producers;
+    unsigned long long dropped = logger.droppedEntries();
+    std::cout << "{\"benchmark\":\"logger/" << name << "/" << producers << "_producers\",\"iterations\":" << entries
+              << ",\"ns_per_op\":" << std::chrono::duration<double, std::nano>(logged - start).count() / entries
+              << ",\"entries_per_s\":" << (entries - dropped) / std::chrono::duration<double>(end - start).count()
+              << ",\"dropped\":" << dropped << "}" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    std::string baseFilename = argc > 1 ? std::string(argv[1]) + "/loggerBench" : "loggerBench";
+
+    const unsigned int producerCounts[] = { 1, 4 };
+    for (unsigned int producers : producerCounts) {
+        run("block/default_flush", baseFilename, producers, std::chrono::milliseconds(1000), LogOverflowPolicy::Block);
+        run("block/flush_every_batch", baseFilename, producers, std::chrono::milliseconds(0), LogOverflowPolicy::Block);
+        run("block/binary", baseFilename, producers, std::chrono::milliseconds(1000), LogOverflowPolicy::Block, LogFormat::Binary);
+        run("drop_newest", baseFilename, producers, std::chrono::milliseconds(1000), LogOverflowPolicy::DropNewest);
+        run("drop_oldest", baseFilename, producers, std::chrono::milliseconds(1000), LogOverflowPolicy::DropOldest);
+    }
+    return 0;
+}
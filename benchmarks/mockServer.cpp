@@ -0,0 +1,259 @@
+#include "mockServer.h"
+
+#include <algorithm>
+
+MockServer::MockServer(int port, const std::string& host) : server(port, host) {
+    server.disablePerMessageDeflate();
+    server.setOnClientMessageCallback([this](std::shared_ptr<ix::ConnectionState>, ix::WebSocket& webSocket, const ix::WebSocketMessagePtr& msg) {
+        if (msg->type == ix::WebSocketMessageType::Message) onMessage(webSocket, msg->str);
+    });
+}
+
+MockServer::~MockServer() {
+    stop();
+}
+
+bool MockServer::start(std::string& error) {
+    auto result = server.listen();
+    if (!result.first) {
+        error = result.second;
+        return false;
+    }
+    server.start();
+    listening = true;
+
+    std::lock_guard<std::mutex> lock{mx};
+    running = true;
+    worker = std::thread(&MockServer::work, this);
+    return true;
+}
+
+void MockServer::stop() {
+    {
+        std::lock_guard<std::mutex> lock{mx};
+        running = false;
+    }
+    cond.notify_all();
+    if (worker.joinable()) worker.join();
+    if (listening) server.stop();
+    listening = false;
+}
+
+void MockServer::addDevice(const MockDevice& device) {
+    json added;
+    {
+        std::lock_guard<std::mutex> lock{mx};
+        devices.push_back(device);
+        added = deviceJson(device);
+    }
+    added["Id"] = 0;
+    broadcast(json::array({ { { "DeviceAdded", added } } }).dump());
+}
+
+void MockServer::removeDevice(unsigned int index) {
+    {
+        std::lock_guard<std::mutex> lock{mx};
+        devices.erase(std::remove_if(devices.begin(), devices.end(), [index](const MockDevice& el) { return el.index == index; }), devices.end());
+    }
+    broadcast(json::array({ { { "DeviceRemoved", { { "Id", 0 }, { "DeviceIndex", index } } } } }).dump());
+}
+
+void MockServer::setReplyDelay(std::chrono::microseconds delay) {
+    std::lock_guard<std::mutex> lock{mx};
+    replyDelay = delay;
+}
+
+void MockServer::setErrorEvery(unsigned int n) {
+    std::lock_guard<std::mutex> lock{mx};
+    errorEvery = n;
+}
+
+void MockServer::startSensorStream(unsigned int deviceIndex, unsigned int sensorIndex, const std::string& sensorType, std::chrono::microseconds interval) {
+    SensorStream stream;
+    stream.deviceIndex = deviceIndex;
+    stream.sensorIndex = sensorIndex;
+    stream.sensorType = sensorType;
+    stream.interval = std::max(interval, std::chrono::microseconds(1));
+    stream.next = std::chrono::steady_clock::now();
+    {
+        std::lock_guard<std::mutex> lock{mx};
+        streams.push_back(stream);
+    }
+    cond.notify_all();
+}
+
+void MockServer::stopSensorStreams() {
+    std::lock_guard<std::mutex> lock{mx};
+    streams.clear();
+}
+
+MockServerStats MockServer::stats() const {
+    MockServerStats result;
+    result.requests = requests;
+    result.errors = errors;
+    result.streamedReadings = streamedReadings;
+    return result;
+}
+
+void MockServer::onMessage(ix::WebSocket& client, const std::string& frame) {
+    json incoming = json::parse(frame, nullptr, false);
+    if (incoming.is_discarded() || !incoming.is_array()) return;
+
+    json answers = json::array();
+    for (auto& el : incoming) {
+        if (!el.is_object() || el.empty()) continue;
+        requests++;
+        answers.push_back(reply(el));
+    }
+    if (answers.empty()) return;
+
+    std::chrono::microseconds delay;
+    {
+        std::lock_guard<std::mutex> lock{mx};
+        delay = replyDelay;
+    }
+    if (delay.count() == 0) {
+        client.send(answers.dump());
+        return;
+    }
+    // Hand the reply to the worker, so the connection keeps reading while the reply is held back.
+    DelayedReply delayed;
+    delayed.due = std::chrono::steady_clock::now() + delay;
+    delayed.frame = answers.dump();
+    for (auto& el : server.getClients()) {
+        if (el.get() == &client) delayed.client = el;
+    }
+    {
+        std::lock_guard<std::mutex> lock{mx};
+        replies.push_back(std::move(delayed));
+    }
+    cond.notify_all();
+}
+
+json MockServer::reply(const json& request) {
+    const std::string& type = request.begin().key();
+    const json& body = request.begin().value();
+    unsigned int id = body.is_object() ? body.value("Id", 0u) : 0u;
+
+    if (type == "RequestServerInfo")
+        return { { "ServerInfo", { { "Id", id }, { "ServerName", "mockServer" }, { "MessageVersion", 3 }, { "MaxPingTime", 0 } } } };
+
+    std::lock_guard<std::mutex> lock{mx};
+    if (type == "RequestDeviceList") {
+        json list = json::array();
+        for (auto& el : devices) list.push_back(deviceJson(el));
+        return { { "DeviceList", { { "Id", id }, { "Devices", list } } } };
+    }
+    if (!body.is_object() || !body.contains("DeviceIndex"))
+        return { { "Ok", { { "Id", id } } } };
+
+    unsigned int deviceIndex = body.value("DeviceIndex", 0u);
+    auto device = std::find_if(devices.begin(), devices.end(), [deviceIndex](const MockDevice& el) { return el.index == deviceIndex; });
+    if (device == devices.end())
+        return { { "Error", { { "Id", id }, { "ErrorMessage", "Device " + std::to_string(deviceIndex) + " not found" }, { "ErrorCode", 4 } } } };
+
+    deviceCommands++;
+    if (errorEvery && deviceCommands % errorEvery == 0) {
+        errors++;
+        return { { "Error", { { "Id", id }, { "ErrorMessage", "Injected error" }, { "ErrorCode", 4 } } } };
+    }
+    if (type == "SensorReadCmd")
+        return sensorReading(id, deviceIndex, body.value("SensorIndex", 0u), body.value("SensorType", std::string()));
+    return { { "Ok", { { "Id", id } } } };
+}
+
+json MockServer::deviceJson(const MockDevice& device) const {
+    json messages = json::object();
+    auto actuators = [](unsigned int count, const std::string& type, unsigned int steps) {
+        json list = json::array();
+        for (unsigned int i = 0; i < count; i++)
+            list.push_back({ { "FeatureDescriptor", type + " " + std::to_string(i) }, { "StepCount", steps }, { "ActuatorType", type } });
+        return list;
+    };
+    if (device.vibrators) messages["ScalarCmd"] = actuators(device.vibrators, "Vibrate", 20);
+    if (device.linear) messages["LinearCmd"] = actuators(device.linear, "Position", 100);
+    if (device.rotators) messages["RotateCmd"] = actuators(device.rotators, "Rotate", 20);
+    if (!device.sensors.empty()) {
+        json read = json::array();
+        json subscribe = json::array();
+        for (auto& el : device.sensors) {
+            json sensor = { { "FeatureDescriptor", el }, { "SensorType", el }, { "SensorRange", json::array({ json::array({ 0, 100 }) }) } };
+            read.push_back(sensor);
+            // Like Intiface, the battery level can be read but not subscribed to.
+            if (el != "Battery") subscribe.push_back(sensor);
+        }
+        messages["SensorReadCmd"] = read;
+        if (!subscribe.empty()) messages["SensorSubscribeCmd"] = subscribe;
+    }
+    messages["StopDeviceCmd"] = json::object();
+
+    return {
+        { "DeviceName", device.name },
+        { "DeviceIndex", device.index },
+        { "DeviceMessageTimingGap", device.timingGap },
+        { "DeviceMessages", messages }
+    };
+}
+
+json MockServer::sensorReading(unsigned int id, unsigned int deviceIndex, unsigned int sensorIndex, const std::string& sensorType) {
+    return { { "SensorReading", {
+        { "Id", id },
+        { "DeviceIndex", deviceIndex },
+        { "SensorIndex", sensorIndex },
+        { "SensorType", sensorType },
+        { "Data", json::array({ static_cast<int>(sensorValue++ % 101) }) }
+    } } };
+}
+
+void MockServer::broadcast(const std::string& frame) {
+    for (auto& el : server.getClients()) el->send(frame);
+}
+
+// Sends the delayed replies and the sensor readings when they are due.
+void MockServer::work() {
+    std::vector<DelayedReply> dueReplies;
+    std::vector<SensorStream> dueReadings;
+    std::unique_lock<std::mutex> lock{mx};
+    while (running) {
+        auto now = std::chrono::steady_clock::now();
+        while (!replies.empty() && replies.front().due <= now) {
+            dueReplies.push_back(std::move(replies.front()));
+            replies.pop_front();
+        }
+        for (auto& el : streams) {
+            if (el.next > now) continue;
+            dueReadings.push_back(el);
+            // Skip readings missed while the worker was late instead of sending a burst.
+            el.next = std::max(el.next + el.interval, now);
+        }
+
+        if (!dueReplies.empty() || !dueReadings.empty()) {
+            lock.unlock();
+            for (auto& el : dueReplies) {
+                std::shared_ptr<ix::WebSocket> client = el.client.lock();
+                if (client) client->send(el.frame);
+            }
+            for (auto& el : dueReadings) {
+                broadcast(json::array({ sensorReading(0, el.deviceIndex, el.sensorIndex, el.sensorType) }).dump());
+                streamedReadings++;
+            }
+            dueReplies.clear();
+            dueReadings.clear();
+            lock.lock();
+            continue;
+        }
+
+        bool waiting = false;
+        std::chrono::steady_clock::time_point next;
+        if (!replies.empty()) {
+            next = replies.front().due;
+            waiting = true;
+        }
+        for (auto& el : streams) {
+            if (!waiting || el.next < next) next = el.next;
+            waiting = true;
+        }
+        if (waiting) cond.wait_until(lock, next);
+        else cond.wait(lock);
+    }
+}
@@ -0,0 +1,117 @@
+// mockServer.h : Local Buttplug server for running the client end to end without Intiface.
+//
+// Speaks message version 3 on an ix::WebSocketServer: answers RequestServerInfo, reports a configurable set
+// of virtual devices in DeviceList, DeviceAdded and DeviceRemoved, answers SensorReadCmd with a SensorReading
+// and every other request with Ok. Replies can be delayed and some of them turned into Errors, and
+// SensorReading messages can be streamed to every connected client at a fixed interval.
+
+#pragma once
+
+#include "messages.h"
+
+#include <ixwebsocket/IXWebSocketServer.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A device reported by the mock server.
+class MockDevice {
+public:
+    std::string name = "Mock Device";
+    unsigned int index = 0;
+    unsigned int timingGap = 0;
+    // Vibrate actuators listed under ScalarCmd.
+    unsigned int vibrators = 1;
+    // Position actuators listed under LinearCmd.
+    unsigned int linear = 0;
+    // Rotate actuators listed under RotateCmd.
+    unsigned int rotators = 0;
+    // Sensor types listed under SensorReadCmd, e.g. "Battery" or "Pressure".
+    std::vector<std::string> sensors;
+};
+
+// Counters of a MockServer.
+class MockServerStats {
+public:
+    // Requests received, every message of a frame counts.
+    unsigned long long requests = 0;
+    // Requests answered with an injected Error.
+    unsigned long long errors = 0;
+    // SensorReading messages sent by streams.
+    unsigned long long streamedReadings = 0;
+};
+
+class MockServer {
+public:
+    explicit MockServer(int port, const std::string& host = "127.0.0.1");
+    ~MockServer();
+
+    // Starts listening, returns false with the reason in error when the port cannot be used.
+    bool start(std::string& error);
+    void stop();
+
+    // Adds a device, clients already connected get a DeviceAdded.
+    void addDevice(const MockDevice& device);
+    // Removes a device, clients already connected get a DeviceRemoved.
+    void removeDevice(unsigned int index);
+
+    // Time every reply is held back, like a server busy talking to the hardware. 0 answers right away.
+    void setReplyDelay(std::chrono::microseconds delay);
+    // Answers every n-th device command with an Error, 0 never does.
+    void setErrorEvery(unsigned int n);
+
+    // Sends a SensorReading of the sensor to every client at the given interval until stopSensorStreams.
+    void startSensorStream(unsigned int deviceIndex, unsigned int sensorIndex, const std::string& sensorType, std::chrono::microseconds interval);
+    void stopSensorStreams();
+
+    MockServerStats stats() const;
+private:
+    class DelayedReply {
+    public:
+        std::chrono::steady_clock::time_point due;
+        std::weak_ptr<ix::WebSocket> client;
+        std::string frame;
+    };
+    class SensorStream {
+    public:
+        unsigned int deviceIndex;
+        unsigned int sensorIndex;
+        std::string sensorType;
+        std::chrono::microseconds interval;
+        std::chrono::steady_clock::time_point next;
+    };
+
+    ix::WebSocketServer server;
+    bool listening = false;
+
+    mutable std::mutex mx;
+    std::condition_variable cond;
+    std::vector<MockDevice> devices;
+    std::chrono::microseconds replyDelay{0};
+    unsigned int errorEvery = 0;
+    unsigned long long deviceCommands = 0;
+    // Delayed replies in the order they are due, the delay is the same for all of them.
+    std::deque<DelayedReply> replies;
+    std::vector<SensorStream> streams;
+    bool running = false;
+    std::thread worker;
+
+    std::atomic<unsigned long long> requests{0};
+    std::atomic<unsigned long long> errors{0};
+    std::atomic<unsigned long long> streamedReadings{0};
+    std::atomic<unsigned int> sensorValue{0};
+
+    void onMessage(ix::WebSocket& client, const std::string& frame);
+    json reply(const json& request);
+    json deviceJson(const MockDevice& device) const;
+    json sensorReading(unsigned int id, unsigned int deviceIndex, unsigned int sensorIndex, const std::string& sensorType);
+    void broadcast(const std::string& frame);
+    void work();
+};
@@ -0,0 +1,186 @@
+// parseBench.cpp : Compares json::parse based decoding of server frames with the streaming decoder.
+//
+// Checks first that both leave the message handler in the same state for a set of frames, then measures
+// throughput and allocations for DeviceList frames of 1, 50 and 500 devices, an Ok frame and a SensorReading frame.
+
+#include "allocationCounter.h"
+#include "benchmarkUtil.h"
+#include "messageDecoder.h"
+
+// Builds a device the way Intiface reports a typical toy with a few actuators and a battery sensor.
+static json makeDevice(unsigned int index) {
+    json scalar = json::array();
+    for (unsigned int i = 0; i < 3; i++)
+        scalar.push_back({ { "FeatureDescriptor", "Vibrator " + std::to_string(i) }, { "StepCount", 20 }, { "ActuatorType", "Vibrate" } });
+    json device = {
+        { "DeviceName", "Lovense Device " + std::to_string(index) },
+        { "DeviceIndex", index },
+        { "DeviceMessageTimingGap", 100 },
+        { "DeviceDisplayName", "My \"toy\" \xc3\xa9 " + std::to_string(index) },
+        { "DeviceMessages", {
+            { "ScalarCmd", scalar },
+            { "LinearCmd", json::array({ { { "FeatureDescriptor", "" }, { "StepCount", 100 }, { "ActuatorType", "Position" } } }) },
+            { "SensorReadCmd", json::array({ { { "FeatureDescriptor", "Battery Level" }, { "SensorType", "Battery" }, { "SensorRange", json::array({ json::array({ 0, 100 }) }) } } }) },
+            { "StopDeviceCmd", json::object() }
+        } }
+    };
+    return device;
+}
+
+static std::string makeDeviceList(unsigned int devices) {
+    json list = json::array();
+    for (unsigned int i = 0; i < devices; i++) list.push_back(makeDevice(i));
+    json frame = json::array({ { { "DeviceList", { { "Id", 1 }, { "Devices", list } } } } });
+    return frame.dump();
+}
+
+// The path every frame used to take.
+static void domDecode(const std::string& frame, mhl::Messages& handler) {
+    json j = json::parse(frame);
+    for (auto& el : j.items()) handler.handleServerMessage(el.value());
+}
+
+static bool streamDecode(mhl::MessageDecoder& decoder, const std::string& frame, mhl::Messages& handler) {
+    if (!decoder.decode(frame)) return false;
+    for (std::size_t i = 0; i < decoder.size(); i++) handler.applyServerMessage(decoder[i]);
+    return true;
+}
+
+static bool sameDevice(const Device& a, const Device& b) {
+    if (a.DeviceName != b.DeviceName || a.DeviceIndex != b.DeviceIndex || a.DeviceMessageTimingGap != b.DeviceMessageTimingGap ||
+        a.DeviceDisplayName != b.DeviceDisplayName || a.DeviceMessages.size() != b.DeviceMessages.size()) return false;
+    for (std::size_t i = 0; i < a.DeviceMessages.size(); i++) {
+        const DeviceCmd& ca = a.DeviceMessages[i];
+        const DeviceCmd& cb = b.DeviceMessages[i];
+        if (ca.CmdType != cb.CmdType || ca.DeviceCmdAttributes.size() != cb.DeviceCmdAttributes.size()) return false;
+        for (std::size_t k = 0; k < ca.DeviceCmdAttributes.size(); k++) {
+            const DeviceCmdAttr& x = ca.DeviceCmdAttributes[k];
+            const DeviceCmdAttr& y = cb.DeviceCmdAttributes[k];
+            if (x.FeatureDescriptor != y.FeatureDescriptor || x.StepCount != y.StepCount || x.ActuatorType != y.ActuatorType ||
+                x.SensorType != y.SensorType || x.SensorRange != y.SensorRange) return false;
+        }
+    }
+    return true;
+}
+
+// Compares the state the last message of a frame left behind.
+static bool sameState(const mhl::Messages& a, const mhl::Messages& b) {
+    if (a.messageType != b.messageType || a.Id != b.Id) return false;
+    if (a.deviceList.Devices.size() != b.deviceList.Devices.size()) return false;
+    for (std::size_t i = 0; i < a.deviceList.Devices.size(); i++)
+        if (!sameDevice(a.deviceList.Devices[i], b.deviceList.Devices[i])) return false;
+
+    switch (a.messageType) {
+    case mhl::MessageTypes::Ok:
+        return a.ok.Id == b.ok.Id;
+    case mhl::MessageTypes::Error:
+        return a.error.Id == b.error.Id && a.error.ErrorCode == b.error.ErrorCode && a.error.ErrorMessage == b.error.ErrorMessage;
+    case mhl::MessageTypes::ServerInfo:
+        return a.serverInfo.Id == b.serverInfo.Id && a.serverInfo.ServerName == b.serverInfo.ServerName &&
+            a.serverInfo.MessageVersion == b.serverInfo.MessageVersion && a.serverInfo.MaxPingTime == b.serverInfo.MaxPingTime;
+    case mhl::MessageTypes::DeviceAdded:
+        return a.deviceAdded.Id == b.deviceAdded.Id && sameDevice(a.deviceAdded.device, b.deviceAdded.device);
+    case mhl::MessageTypes::DeviceRemoved:
+        return a.deviceRemoved.Id == b.deviceRemoved.Id && a.deviceRemoved.DeviceIndex == b.deviceRemoved.DeviceIndex;
+    case mhl::MessageTypes::SensorReading:
+        return a.sensorReading.Id == b.sensorReading.Id && a.sensorReading.DeviceIndex == b.sensorReading.DeviceIndex &&
+            a.sensorReading.SensorIndex == b.sensorReading.SensorIndex && a.sensorReading.SensorType == b.sensorReading.SensorType &&
+            a.sensorReading.Data == b.sensorReading.Data;
+    default:
+        return true;
+    }
+}
+
+// Verifies the streaming decoder against the json parser, and that it rejects what it should leave to it.
+static bool verify() {
+    json added = makeDevice(7);
+    added["Id"] = 0;
+    std::vector<std::string> frames = {
+        makeDeviceList(0),
+        makeDeviceList(1),
+        makeDeviceList(50),
+        // Fewer devices than the frame before, whose entries are reused.
+        makeDeviceList(1),
+        "[{\"ServerInfo\":{\"Id\":1,\"ServerName\":\"Intiface\",\"MessageVersion\":3,\"MaxPingTime\":0}}]",
+        json::array({ { { "DeviceAdded", added } } }).dump(2),
+        "[{\"DeviceAdded\":{\"Id\":0,\"DeviceName\":\"esc \\\" \\\\ \\/ \\b\\f\\n\\r\\t \\u00e9 \\u20ac \\ud83d\\ude00\",\"DeviceIndex\":3,"
+            "\"DeviceMessages\":{\"ScalarCmd\":[],\"Extra\":[{\"Unknown\":[1,2.5,-3e2,true,false,null,{\"a\":[]}]}]}}}]",
+        "[{\"DeviceAdded\":{\"Id\":0,\"DeviceName\":\"Bare\",\"DeviceIndex\":4}}]",
+        "[ {\"Ok\" : {\"Id\" : 4294967295}} , {\"ScanningFinished\":{\"Id\":0}}\n]",
+        "[{\"Error\":{\"Id\":12,\"ErrorCode\":-3,\"ErrorMessage\":\"Device \\\"x\\\" not found\"}}]",
+        "[{\"SensorReading\":{\"Id\":0,\"DeviceIndex\":1,\"SensorIndex\":0,\"SensorType\":\"Pressure\",\"Data\":[-2147483648,0,2147483647]}}]",
+        "[{\"DeviceRemoved\":{\"Id\":0,\"DeviceIndex\":0}}]",
+        "[]"
+    };
+    // Frames the decoder leaves to the json parser.
+    std::vector<std::string> rejected = {
+        "[{\"Ok\":{\"Id\":1.0}}]",
+        "[{\"Ping\":{\"Id\":1}}]",
+        "[{\"Ok\":{\"Id\":1},\"Error\":{\"Id\":1}}]",
+        "[{\"Ok\":{\"Id\":1}}",
+        "[{\"Ok\":{\"Id\":4294967296}}]",
+        "[{\"DeviceAdded\":{\"Id\":0,\"DeviceMessages\":{\"RawReadCmd\":{\"Endpoints\":[\"tx\"]}}}}]",
+        "[{\"Error\":{\"Id\":1,\"ErrorMessage\":\"\\ud800\"}}]",
+        "{\"Ok\":{\"Id\":1}}"
+    };
+
+    mhl::Messages dom;
+    mhl::Messages stream;
+    mhl::MessageDecoder decoder;
+    for (const std::string& frame : frames) {
+        domDecode(frame, dom);
+        if (!streamDecode(decoder, frame, stream)) {
+            std::cerr << "Rejected: " << frame << std::endl;
+            return false;
+        }
+        if (!sameState(dom, stream)) {
+            std::cerr << "Mismatch: " << frame << std::endl;
+            return false;
+        }
+    }
+    for (const std::string& frame : rejected) {
+        if (decoder.decode(frame)) {
+            std::cerr << "Accepted: " << frame << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Prints one result with the input throughput in MB/s.
+static void report(const std::string& name, std::size_t iterations, std::size_t bytes, double nsPerOp, double allocationsPerOp) {
+    std::cout << "{\"benchmark\":\"" << name << "\",\"iterations\":" << iterations << ",\"bytes\":" << bytes
+              << ",\"ns_per_op\":" << nsPerOp << ",\"mb_per_s\":" << bytes * 1000.0 / nsPerOp
+              << ",\"allocations_per_op\":" << allocationsPerOp << "}" << std::endl;
+}
+
+static void run(const std::string& name, const std::string& frame, std::size_t iterations) {
+    mhl::Messages handler;
+    auto runDom = [&](std::size_t) {
+        domDecode(frame, handler);
+        bench::doNotOptimize(handler.Id);
+    };
+    mhl::MessageDecoder decoder;
+    auto runStream = [&](std::size_t) {
+        streamDecode(decoder, frame, handler);
+        bench::doNotOptimize(handler.Id);
+    };
+
+    report("parse/" + name + "/dom", iterations, frame.size(),
+        bench::measureNs(iterations, runDom), bench::measureAllocations(iterations, runDom));
+    report("parse/" + name + "/stream", iterations, frame.size(),
+        bench::measureNs(iterations, runStream), bench::measureAllocations(iterations, runStream));
+}
+
+int main() {
+    if (!verify()) return 1;
+
+    const unsigned int deviceCounts[] = { 1, 50, 500 };
+    for (unsigned int devices : deviceCounts)
+        run("device_list/" + std::to_string(devices) + "_devices", makeDeviceList(devices), 200000 / (devices * 10));
+
+    run("ok", "[{\"Ok\":{\"Id\":1}}]", 200000);
+    run("sensor_reading", "[{\"SensorReading\":{\"Id\":0,\"DeviceIndex\":1,\"SensorIndex\":0,\"SensorType\":\"Pressure\",\"Data\":[591]}}]", 200000);
+
+    return 0;
+}
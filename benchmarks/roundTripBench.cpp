@@ -0,0 +1,103 @@
+// roundTripBench.cpp : Measures the round trip of a command through Client and a local mock server.
+//
+// A MockServer with one two-motor device answers every ScalarCmd with Ok. A producer thread calls sendScalar
+// at a fixed rate and the time from the call until its callback runs is recorded for every command. Rates are
+// raised step by step to show where latency starts to climb. Command scheduling is disabled so every call is
+// sent and answered instead of being coalesced.
+//
+// Usage: roundTripBench [port], the server listens on 127.0.0.1:12400 by default.
+
+#include "benchmarkUtil.h"
+#include "buttplugclient.h"
+#include "mockServer.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+// Time every rate is kept up.
+static const std::chrono::milliseconds runTime(1000);
+
+static void run(Client& client, const DeviceHandle& device, const std::string& name, unsigned int rate) {
+    const std::size_t commands = std::max<std::size_t>(rate * runTime.count() / 1000, 100);
+    std::vector<long long> latencies;
+    latencies.reserve(commands);
+    std::mutex mx;
+    std::condition_variable done;
+    std::size_t completed = 0;
+    std::size_t failed = 0;
+
+    const std::chrono::nanoseconds interval(1000000000LL / rate);
+    auto start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < commands; i++) {
+        // Pace the calls, late ones go out right away so the average rate holds.
+        auto due = start + interval * i;
+        if (std::chrono::steady_clock::now() < due) std::this_thread::sleep_until(due);
+
+        auto sent = std::chrono::steady_clock::now();
+        client.sendScalar(device, (i % 20) / 20.0, [&, sent](const mhl::CommandResult& result) {
+            auto now = std::chrono::steady_clock::now();
+            std::lock_guard<std::mutex> lock{mx};
+            latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(now - sent).count());
+            if (result.status != mhl::CommandStatus::Ok) failed++;
+            if (++completed == commands) done.notify_all();
+        }, std::chrono::seconds(5));
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    std::unique_lock<std::mutex> lock{mx};
+    done.wait(lock, [&]() { return completed == commands; });
+    std::sort(latencies.begin(), latencies.end());
+    double total = 0;
+    for (long long el : latencies) total += el;
+
+    std::cout << "{\"benchmark\":\"round_trip/" << name << "\",\"iterations\":" << latencies.size()
+              << ",\"ns_per_op\":" << total / latencies.size()
+              << ",\"p50_ns\":" << latencies[latencies.size() / 2]
+              << ",\"p99_ns\":" << latencies[latencies.size() * 99 / 100]
+              << ",\"max_ns\":" << latencies.back()
+              << ",\"target_per_s\":" << rate
+              << ",\"calls_per_s\":" << latencies.size() / std::chrono::duration<double>(end - start).count()
+              << ",\"failed\":" << failed << "}" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    int port = argc > 1 ? std::atoi(argv[1]) : 12400;
+
+    MockServer server(port);
+    MockDevice device;
+    device.name = "Round Trip Device";
+    device.vibrators = 2;
+    device.sensors = { "Battery", "Pressure" };
+    server.addDevice(device);
+    std::string error;
+    if (!server.start(error)) {
+        std::cerr << "Could not listen on port " << port << ": " << error << std::endl;
+        return 1;
+    }
+
+    {
+        Client client("ws://127.0.0.1", port);
+        client.setCommandScheduling(false);
+        client.connect([](const mhl::MessageEvent&) {});
+        auto result = client.requestDeviceListAsync(std::chrono::seconds(5)).get();
+        std::vector<DeviceClass> devices = client.getDevices();
+        if (result.status != mhl::CommandStatus::Ok || devices.empty()) {
+            std::cerr << "Could not get the device list from the mock server" << std::endl;
+            return 1;
+        }
+        DeviceHandle handle = devices[0].handle();
+
+        const unsigned int rates[] = { 100, 1000, 5000, 20000 };
+        for (unsigned int rate : rates) run(client, handle, std::to_string(rate) + "_per_s", rate);
+
+        // The same with a server that takes a millisecond to answer and streams pressure readings at 1 kHz.
+        server.setReplyDelay(std::chrono::milliseconds(1));
+        run(client, handle, "1000_per_s/reply_delay_1ms", 1000);
+        server.setReplyDelay(std::chrono::microseconds(0));
+        server.startSensorStream(0, 1, "Pressure", std::chrono::microseconds(1000));
+        run(client, handle, "1000_per_s/sensor_stream_1khz", 1000);
+        server.stopSensorStreams();
+    }
+    server.stop();
+    return 0;
+}
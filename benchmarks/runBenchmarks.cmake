@@ -0,0 +1,22 @@
+# Runs every benchmark executable in BENCHMARKS, separated by |, and writes their JSON lines to OUTPUT.
+# Used by the run_benchmarks target: cmake -DBENCHMARKS=a|b -DOUTPUT=file -DWORKING_DIRECTORY=dir -P runBenchmarks.cmake
+
+string(REPLACE "|" ";" BENCHMARKS "${BENCHMARKS}")
+file(WRITE ${OUTPUT} "")
+foreach(bench ${BENCHMARKS})
+    get_filename_component(name ${bench} NAME_WE)
+    message(STATUS "Running ${name}")
+    execute_process(COMMAND ${bench}
+        WORKING_DIRECTORY ${WORKING_DIRECTORY}
+        OUTPUT_VARIABLE results
+        RESULT_VARIABLE status)
+    if(NOT status EQUAL 0)
+        message(FATAL_ERROR "${name} failed with ${status}")
+    endif()
+    # Keep the result lines only, a build with BUTTPLUG_DEBUG prints debug messages to stdout as well.
+    string(REGEX MATCHALL "{\"benchmark\"[^\n]*\n" lines "${results}")
+    foreach(line ${lines})
+        file(APPEND ${OUTPUT} "${line}")
+    endforeach()
+endforeach()
+message(STATUS "Results written to ${OUTPUT}")
@@ -0,0 +1,80 @@
+// sensorBufferBench.cpp : Measures storing sensor readings in a SensorBuffer and reading them back in bulk.
+//
+// Checks first that a reader sees every reading in order and counts the overwritten ones, then measures time
+// and allocations per reading for a 100 Hz stream polled every frame of a 60 Hz loop and for bulk reads of a
+// full buffer.
+
+#include "allocationCounter.h"
+#include "benchmarkUtil.h"
+#include "sensorBuffer.h"
+
+// Pushes count readings of width values, the first value is the sequence number.
+static void pushReadings(SensorBuffer& buffer, int first, int count, std::size_t width) {
+    std::vector<int> data(width);
+    auto now = std::chrono::steady_clock::now();
+    for (int i = first; i < first + count; i++) {
+        data[0] = i;
+        buffer.push(now, data);
+    }
+}
+
+static bool verify() {
+    SensorBuffer buffer(64);
+    SensorCursor cursor;
+    SensorSamples out;
+
+    pushReadings(buffer, 0, 40, 3);
+    if (buffer.read(cursor, out) != 40 || out.width != 3 || out[0][0] != 0 || out[39][0] != 39 || cursor.missed != 0) {
+        std::cerr << "First read is wrong" << std::endl;
+        return false;
+    }
+    // Wraps around the end of the ring and overwrites 36 unread readings.
+    pushReadings(buffer, 40, 100, 3);
+    if (buffer.read(cursor, out) != 64 || out[0][0] != 76 || out[63][0] != 139 || cursor.missed != 36) {
+        std::cerr << "Read after overflow is wrong" << std::endl;
+        return false;
+    }
+    if (buffer.stats().received != 140 || buffer.stats().overflowed != 36) {
+        std::cerr << "Counters are wrong" << std::endl;
+        return false;
+    }
+    if (buffer.read(cursor, out) != 0) {
+        std::cerr << "Read without new readings is not empty" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int main() {
+    if (!verify()) return 1;
+
+    // 100 Hz readings polled by a 60 Hz loop, one or two readings per read.
+    {
+        SensorBuffer buffer;
+        SensorCursor cursor;
+        SensorSamples out;
+        std::vector<int> data(1);
+        auto now = std::chrono::steady_clock::now();
+        auto step = [&](std::size_t i) {
+            data[0] = static_cast<int>(i);
+            buffer.push(now, data);
+            if (i % 5 < 3) bench::doNotOptimize(buffer.read(cursor, out));
+        };
+        const std::size_t iterations = 1000000;
+        bench::report("sensor_buffer/stream_100hz_poll_60hz", iterations, bench::measureNs(iterations, step), bench::measureAllocations(iterations, step));
+    }
+
+    // Reading a full buffer of 256 readings with 3 values at once.
+    {
+        SensorBuffer buffer;
+        SensorSamples out;
+        pushReadings(buffer, 0, 256, 3);
+        auto readAll = [&](std::size_t) {
+            SensorCursor cursor;
+            bench::doNotOptimize(buffer.read(cursor, out));
+        };
+        const std::size_t iterations = 100000;
+        bench::report("sensor_buffer/read_256_readings", iterations, bench::measureNs(iterations, readAll), bench::measureAllocations(iterations, readAll));
+    }
+    return 0;
+}
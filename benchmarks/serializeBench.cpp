@@ -0,0 +1,129 @@
+// serializeBench.cpp : Compares the json DOM serialization of actuator commands with the direct writers.
+//
+// Checks first that both produce the same JSON for a range of values, then measures time and
+// allocations per command for 1, 4 and 16 actuators.
+
+#include "allocationCounter.h"
+#include "benchmarkUtil.h"
+#include "messages.h"
+
+#include <cmath>
+#include <limits>
+#include <random>
+
+// Invalid UTF-8 is replaced, as the direct writers do, instead of throwing.
+template<typename Cmd>
+static std::string domText(const Cmd& cmd) {
+    json j = cmd;
+    return j.dump(-1, ' ', false, json::error_handler_t::replace);
+}
+
+template<typename Cmd>
+static std::string bufferText(const Cmd& cmd) {
+    std::string out;
+    msg::to_buffer(out, cmd);
+    return out;
+}
+
+template<typename Cmd>
+static bool check(const Cmd& cmd) {
+    std::string expected = domText(cmd);
+    std::string actual = bufferText(cmd);
+    if (expected == actual) return true;
+    std::cerr << "Mismatch:\n  dom:    " << expected << "\n  buffer: " << actual << std::endl;
+    return false;
+}
+
+// Verifies the direct writers against json::dump() on edge cases and random values.
+static bool verify() {
+    std::vector<double> values = { 0.0, -0.0, 1.0, 0.5, 0.1, 1.0 / 3.0, 1e-7, 123456789.0, 1e21, 1e300, -2.5,
+        std::numeric_limits<double>::quiet_NaN(), std::numeric_limits<double>::infinity(), std::numeric_limits<double>::denorm_min() };
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    for (int i = 0; i < 10000; i++) values.push_back(unit(rng));
+
+    std::vector<std::string> types = { "Vibrate", "Oscillate", "", "quote\"back\\slash", std::string("ctl\x01\x1f\n\t", 8), "\xc3\xa9",
+        "bad\xff", "\xed\xa0\x80", "\xf0\x9f\x98\x80" };
+
+    bool ok = true;
+    for (std::size_t i = 0; i < values.size(); i++) {
+        msg::ScalarCmd scalar;
+        scalar.Id = static_cast<unsigned int>(i * 2654435761u);
+        scalar.DeviceIndex = static_cast<unsigned int>(i % 7);
+        msg::LinearCmd linear;
+        linear.Id = static_cast<unsigned int>(i);
+        linear.DeviceIndex = 4294967295u;
+        msg::RotateCmd rotate;
+        rotate.Id = 0;
+        rotate.DeviceIndex = static_cast<unsigned int>(i);
+        for (unsigned int a = 0; a < i % 4; a++) {
+            Scalar sc;
+            sc.Index = a;
+            sc.ScalarVal = values[(i + a) % values.size()];
+            sc.ActuatorType = types[(i + a) % types.size()];
+            scalar.Scalars.push_back(sc);
+            Linear lin;
+            lin.Index = a;
+            lin.Duration = std::floor(values[i] * 1000.0);
+            lin.Position = values[(i + a) % values.size()];
+            linear.Vectors.push_back(lin);
+            Rotate rot;
+            rot.Index = a;
+            rot.Speed = values[(i + a) % values.size()];
+            rot.Clockwise = (i + a) % 2 == 0;
+            rotate.Rotations.push_back(rot);
+        }
+        ok = check(scalar) && check(linear) && check(rotate) && ok;
+        if (!ok) break;
+    }
+    return ok;
+}
+
+static msg::ScalarCmd makeScalar(unsigned int actuators) {
+    msg::ScalarCmd cmd;
+    cmd.Id = 1234;
+    cmd.DeviceIndex = 2;
+    for (unsigned int i = 0; i < actuators; i++) {
+        Scalar sc;
+        sc.Index = i;
+        sc.ScalarVal = 0.05 * (i + 1);
+        sc.ActuatorType = "Vibrate";
+        cmd.Scalars.push_back(sc);
+    }
+    return cmd;
+}
+
+int main() {
+    if (!verify()) return 1;
+
+    const std::size_t iterations = 100000;
+    const unsigned int actuatorCounts[] = { 1, 4, 16 };
+
+    for (unsigned int actuators : actuatorCounts) {
+        msg::ScalarCmd cmd = makeScalar(actuators);
+        std::string suffix = "/" + std::to_string(actuators) + "_actuators";
+
+        // What every ScalarCmd used to go through: to_json into an array, then dump().
+        auto runDom = [&](std::size_t i) {
+            cmd.Scalars[0].ScalarVal = (i % 100) / 100.0;
+            json j = json::array({ cmd });
+            std::string text = j.dump();
+            bench::doNotOptimize(text.size());
+        };
+        // The direct writer into a reused buffer.
+        std::string buffer;
+        auto runBuffer = [&](std::size_t i) {
+            cmd.Scalars[0].ScalarVal = (i % 100) / 100.0;
+            buffer.clear();
+            msg::to_buffer(buffer, cmd);
+            bench::doNotOptimize(buffer.size());
+        };
+
+        bench::report("serialize/scalar_cmd/dom" + suffix, iterations,
+            bench::measureNs(iterations, runDom), bench::measureAllocations(iterations, runDom));
+        bench::report("serialize/scalar_cmd/buffer" + suffix, iterations,
+            bench::measureNs(iterations, runBuffer), bench::measureAllocations(iterations, runBuffer));
+    }
+
+    return 0;
+}
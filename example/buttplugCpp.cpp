@@ -13,9 +13,9 @@ using namespace std;
  * This function is called whenever the client receives a message from the server.
  * It demonstrates how to handle different types of messages that might be received.
  * 
- * @param msg The message received from the server
+ * @param msg View of the message received from the server, only valid during the call
  */
-void callbackFunction(const mhl::Messages msg) {
+void callbackFunction(const mhl::MessageEvent& msg) {
     // Handle different message types from the server
     switch (msg.messageType) {
         case mhl::MessageTypes::DeviceList:
@@ -1,22 +1,52 @@
+#pragma once
+
 #include <string>
 #include <functional>
 #include <iostream>
 #include <atomic>
 #include <sstream>
 #include <queue>
+#include <deque>
 #include <map>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <memory>
+#include <vector>
 
 #include <ixwebsocket/IXWebSocket.h>
 #ifdef _WIN32
 #include <ixwebsocket/IXNetSystem.h>
 #endif
 #include "messageHandler.h"
+#include "messageDecoder.h"
+#include "sensorBuffer.h"
+#include "clientStats.h"
 #include "log.h"
 // #include "thread_safe_queue.hpp"
 
 // Alias for sensor reading class to make it more accessible
 typedef msg::SensorReading SensorClass;
 
+class DeviceClass;
+
+// Lightweight reference to a connected device, which every request takes. It is trivially copyable and
+// looked up without comparing strings. Once the device is removed its handle is stale and requests made
+// with it are aborted right away, even if the server gives the index to another device later.
+class DeviceHandle {
+public:
+	DeviceHandle() : deviceIndex(0), generation(0) {}
+	DeviceHandle(unsigned int index, unsigned int gen) : deviceIndex(index), generation(gen) {}
+	// Devices from getDevices convert implicitly.
+	DeviceHandle(const DeviceClass& dev);
+
+	unsigned int deviceIndex;
+	// Assigned when the device appears. Zero matches whichever device has the index.
+	unsigned int generation;
+};
+
 // Helper class to store devices and access them outside of the library.
 class DeviceClass {
 public:
@@ -26,6 +56,164 @@ public:
 	std::vector<std::string> sensorTypes;
 	std::map<std::string, std::vector<DeviceCmdAttr>> commandAttributes;
 	unsigned int deviceID;
+	// Generation of the device handle, zero for devices not built by the library.
+	unsigned int generation = 0;
+
+	DeviceHandle handle() const { return DeviceHandle(deviceID, generation); }
+};
+
+inline DeviceHandle::DeviceHandle(const DeviceClass& dev) : deviceIndex(dev.deviceID), generation(dev.generation) {}
+
+// Command kinds of the device feature table.
+enum class CommandKind {
+	Scalar,
+	Linear,
+	Rotate,
+	Sensor
+};
+
+// Feature table of a connected device, built once when the device list or the device arrives.
+class DeviceFeatures {
+public:
+	unsigned int generation = 0;
+	unsigned int timingGap = 0;
+	// Actuators, or sensors, of every command kind in the order the server lists them, indexed by CommandKind.
+	std::vector<DeviceCmdAttr> features[4];
+
+	const std::vector<DeviceCmdAttr>& operator[](CommandKind kind) const { return features[static_cast<int>(kind)]; }
+};
+
+// Immutable device list and sensor reading shared with the caller, see Client::getDeviceSnapshot.
+typedef std::shared_ptr<const std::vector<DeviceClass>> DeviceSnapshot;
+typedef std::shared_ptr<const SensorClass> SensorSnapshot;
+
+// What the client rebuilds whenever the device list changes: the feature tables by device index and the
+// devices snapshot. Devices found in previous keep their generation, new ones take the next one.
+std::unordered_map<unsigned int, DeviceFeatures> buildDeviceFeatures(const std::vector<Device>& devices,
+	const std::unordered_map<unsigned int, DeviceFeatures>& previous, unsigned int& nextGeneration);
+DeviceSnapshot buildDeviceSnapshot(const std::vector<Device>& devices, const std::unordered_map<unsigned int, DeviceFeatures>& features);
+
+// Frame received from the server, waiting in the inbound queue for the message handler.
+class InboundFrame {
+public:
+	std::string text;
+	std::chrono::steady_clock::time_point received;
+	// Set for a streamed sensor reading a newer one queued later replaced, the handler skips it.
+	bool superseded = false;
+};
+
+// Request waiting in the outbound queue for the sender thread.
+class OutboundMessage {
+public:
+	// JSON text of the message, without the surrounding array.
+	std::string payload;
+	mhl::MessageTypes mType;
+	unsigned int Id;
+	// Set for requests that could not be sent, the sender thread only runs their callback.
+	bool aborted;
+	// Status the callback of such a request gets, Ok for a command suppressed as unchanged.
+	mhl::CommandStatus status = mhl::CommandStatus::Aborted;
+	// Device the request is for, -1 if none. A stop purges the queued actuator commands of its devices.
+	int deviceIndex = -1;
+	mhl::CommandCallback callback;
+	// For a committed batch, the payload holds several messages separated by commas and parts lists
+	// their types and IDs. Empty for a single message.
+	std::vector<std::pair<mhl::MessageTypes, unsigned int>> parts;
+};
+
+// Request waiting in an open batch. It is registered, and its timeout starts, when the batch is committed.
+class BatchedRequest {
+public:
+	mhl::MessageTypes mType;
+	unsigned int id;
+	mhl::CommandCallback callback;
+	std::chrono::milliseconds timeout;
+	int deviceIndex;
+};
+
+// Batch opened by a thread with beginBatch, collecting its requests until commitBatch.
+class OpenBatch {
+public:
+	// Nesting depth, the batch is sent when the outermost commitBatch is reached.
+	int depth = 0;
+	std::string payload;
+	std::vector<BatchedRequest> requests;
+};
+
+// Actuator command of one type waiting in the scheduler for its device's timing gap.
+class ScheduledCommand {
+public:
+	bool pending = false;
+	mhl::MessageTypes mType;
+	// Callbacks of all requests merged into the command, they complete together.
+	std::vector<mhl::CommandCallback> callbacks;
+	// Earliest deadline of the merged requests, time_point::max() if none has a timeout.
+	std::chrono::steady_clock::time_point deadline;
+};
+
+// Scheduler state of one device. Holds the latest value of every actuator that is not sent yet.
+class DeviceSchedule {
+public:
+	std::chrono::milliseconds gap{0};
+	// Time the last commands were sent to the device, and the time the waiting ones are due.
+	std::chrono::steady_clock::time_point lastSent;
+	std::chrono::steady_clock::time_point due;
+	msg::ScalarCmd scalarCmd;
+	msg::LinearCmd linearCmd;
+	msg::RotateCmd rotateCmd;
+	// Bookkeeping of the three commands above, in that order.
+	ScheduledCommand commands[3];
+
+	bool pending() const { return commands[0].pending || commands[1].pending || commands[2].pending; }
+};
+
+// Actuator command taken from the scheduler by the sender thread.
+class DueCommand {
+public:
+	unsigned int deviceIndex;
+	msg::ScalarCmd scalarCmd;
+	msg::LinearCmd linearCmd;
+	msg::RotateCmd rotateCmd;
+	ScheduledCommand command;
+};
+
+// Value last sent to an actuator while command deduplication is enabled.
+class ActuatorValue {
+public:
+	bool known = false;
+	// Whether the server confirmed the command that carried value.
+	bool confirmed = false;
+	// Quantized value, negative for counterclockwise rotation.
+	double value = 0;
+};
+
+// Actuator values of one device for command deduplication, by actuator index.
+class DeviceActuatorValues {
+public:
+	unsigned int generation = 0;
+	std::vector<ActuatorValue> scalars;
+	std::vector<ActuatorValue> rotations;
+};
+
+// Values carried by a ScalarCmd or RotateCmd until the server answers it.
+class UnconfirmedCommand {
+public:
+	unsigned int deviceIndex;
+	bool rotate;
+	std::vector<std::pair<unsigned int, double>> values;
+};
+
+// Counters of the command scheduler.
+class SchedulerStats {
+public:
+	// Actuator requests submitted to the scheduler.
+	unsigned long long submitted = 0;
+	// Requests merged into a command that was already waiting for its device.
+	unsigned long long coalesced = 0;
+	// Commands actually sent.
+	unsigned long long sent = 0;
+	// Waiting commands dropped because a stop command for their device was sent.
+	unsigned long long dropped = 0;
 };
 
 // Main client class
@@ -38,10 +226,11 @@ public:
 		#endif
 		lUrl = url;
 		lPort = port;
+		senderThread = std::thread(&Client::sendHandling, this);
 	}
 	
-	// Constructor with logging capability
-	Client(std::string url, unsigned int port, std::string logfile) {
+	// Constructor with logging capability. Binary logs are decoded with the logDecoder tool.
+	Client(std::string url, unsigned int port, std::string logfile, LogFormat logFormat = LogFormat::Text) {
 		#ifdef _WIN32
 		ix::initNetSystem();
 		#endif
@@ -49,26 +238,63 @@ public:
 		lPort = port;
 		if (!logfile.empty()) {
 			logging = 1;
-			logInfo.start(logfile);
+			logInfo.start(logfile, logFormat);
 		}
 		// else logInfo.init("log.txt");
+		senderThread = std::thread(&Client::sendHandling, this);
 	}
 	
 	// Destructor that cleans up resources and ensures thread termination
 	~Client() {
-		#ifdef _WIN32
-		ix::uninitNetSystem();
-		#endif
 		stopRequested = true;
-		cond.notify_one(); // Notify the condition variable to wake up the thread
+		// Notify the condition variables under their mutexes so no waiting thread misses the stop request.
+		{
+			std::lock_guard<std::mutex> lock{msgMx};
+			cond.notify_all();
+		}
+		{
+			std::lock_guard<std::mutex> lock{connMx};
+			condWs.notify_all();
+			condClient.notify_all();
+		}
+		{
+			std::lock_guard<std::mutex> lock{sendMx};
+			condSend.notify_all();
+		}
+		// The sender thread drains the outbound queue before it exits.
+		if (senderThread.joinable()) {
+			senderThread.join();
+		}
 		if (messageHandlerThread.joinable()) {
 			messageHandlerThread.join();
 		}
+		// Requests that never got an answer, or were never sent, are completed as aborted.
+		for (auto& el : pendingRequests) {
+			if (!el.second.callback) continue;
+			mhl::CommandResult result;
+			result.status = mhl::CommandStatus::Aborted;
+			result.messageType = el.second.messageType;
+			result.Id = el.first;
+			el.second.callback(result);
+		}
+		for (auto& el : takeOpenBatches()) {
+			if (!el.callback) continue;
+			mhl::CommandResult result;
+			result.status = mhl::CommandStatus::Aborted;
+			result.messageType = el.mType;
+			result.Id = el.id;
+			el.callback(result);
+		}
 		logInfo.stop();
 		webSocket.stop();
+		#ifdef _WIN32
+		ix::uninitNetSystem();
+		#endif
 	}
 
 	// Connects to the server and sets up the message handling callbacks
+	int connect(mhl::MessageCallback callFunc);
+	// Older callback signature, which receives a copy of the whole message handler state for every message.
 	int connect(void (*callFunc)(const mhl::Messages));
 	
 	// Atomic variables to store connection status. Can be accessed outside library too since atomic.
@@ -81,27 +307,105 @@ public:
 	std::condition_variable condWs;
 
 	// Public functions that send requests to server.
-	void startScan();
-	void stopScan();
-	void requestDeviceList();
-	void stopDevice(DeviceClass dev);
-	void stopAllDevices();
-	void sendScalar(DeviceClass dev, double str);
-	void sendScalarActuators(DeviceClass dev, const std::map<unsigned int, double>& actuatorValues);
-	void sendLinear(DeviceClass dev, double duration, double position);
-    void sendLinearActuators(DeviceClass dev, const std::map<unsigned int, std::pair<double, double>>& actuatorValues);
-    void sendRotation(DeviceClass dev, double speed, bool clockwise);
-    void sendRotationActuators(DeviceClass dev, const std::map<unsigned int, std::pair<double, bool>>& actuatorValues);
-	std::vector<DeviceCmdAttr> getDeviceCommandAttributes(DeviceClass dev, const std::string& commandType);
-	void sensorRead(DeviceClass dev, int senIndex);
-	void sensorSubscribe(DeviceClass dev, int senIndex);
-	void sensorUnsubscribe(DeviceClass dev, int senIndex);
+	// The optional callback is called once with the outcome of the request: when the server answers it,
+	// when the timeout (if non-zero) expires first, or right away if the request cannot be sent.
+	// It runs on a library thread without any library lock held, so it may send further requests.
+	void startScan(mhl::CommandCallback callback = nullptr, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+	void stopScan(mhl::CommandCallback callback = nullptr, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+	void requestDeviceList(mhl::CommandCallback callback = nullptr, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+	// Stops are sent ahead of every queued request, and the actuator commands of the stopped devices still
+	// waiting to be sent are aborted. Inside a batch they keep their place among the batched requests.
+	void stopDevice(DeviceHandle dev, mhl::CommandCallback callback = nullptr, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+	void stopAllDevices(mhl::CommandCallback callback = nullptr, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+	void sendScalar(DeviceHandle dev, double str, mhl::CommandCallback callback = nullptr, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+	void sendScalarActuators(DeviceHandle dev, const std::map<unsigned int, double>& actuatorValues, mhl::CommandCallback callback = nullptr, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+	void sendLinear(DeviceHandle dev, double duration, double position, mhl::CommandCallback callback = nullptr, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+    void sendLinearActuators(DeviceHandle dev, const std::map<unsigned int, std::pair<double, double>>& actuatorValues, mhl::CommandCallback callback = nullptr, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+    void sendRotation(DeviceHandle dev, double speed, bool clockwise, mhl::CommandCallback callback = nullptr, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+    void sendRotationActuators(DeviceHandle dev, const std::map<unsigned int, std::pair<double, bool>>& actuatorValues, mhl::CommandCallback callback = nullptr, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+	std::vector<DeviceCmdAttr> getDeviceCommandAttributes(DeviceHandle dev, const std::string& commandType);
+	// Whether the handle still refers to a connected device.
+	bool isDeviceConnected(DeviceHandle dev);
+	void sensorRead(DeviceHandle dev, int senIndex, mhl::CommandCallback callback = nullptr, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+	void sensorSubscribe(DeviceHandle dev, int senIndex, mhl::CommandCallback callback = nullptr, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+	void sensorUnsubscribe(DeviceHandle dev, int senIndex, mhl::CommandCallback callback = nullptr, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+
+	// Same requests, returning a future that is resolved with the outcome of the request.
+	// For sensorReadAsync the reading itself is in CommandResult::sensorReading.
+	std::future<mhl::CommandResult> startScanAsync(std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+	std::future<mhl::CommandResult> stopScanAsync(std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+	std::future<mhl::CommandResult> requestDeviceListAsync(std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+	std::future<mhl::CommandResult> stopDeviceAsync(DeviceHandle dev, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+	std::future<mhl::CommandResult> stopAllDevicesAsync(std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+	std::future<mhl::CommandResult> sendScalarAsync(DeviceHandle dev, double str, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+	std::future<mhl::CommandResult> sendScalarActuatorsAsync(DeviceHandle dev, const std::map<unsigned int, double>& actuatorValues, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+	std::future<mhl::CommandResult> sendLinearAsync(DeviceHandle dev, double duration, double position, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+	std::future<mhl::CommandResult> sendLinearActuatorsAsync(DeviceHandle dev, const std::map<unsigned int, std::pair<double, double>>& actuatorValues, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+	std::future<mhl::CommandResult> sendRotationAsync(DeviceHandle dev, double speed, bool clockwise, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+	std::future<mhl::CommandResult> sendRotationActuatorsAsync(DeviceHandle dev, const std::map<unsigned int, std::pair<double, bool>>& actuatorValues, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+	std::future<mhl::CommandResult> sensorReadAsync(DeviceHandle dev, int senIndex, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+	std::future<mhl::CommandResult> sensorSubscribeAsync(DeviceHandle dev, int senIndex, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+	std::future<mhl::CommandResult> sensorUnsubscribeAsync(DeviceHandle dev, int senIndex, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+
+	// ScalarCmd, LinearCmd and RotateCmd are scheduled per device: a device gets at most one frame per
+	// DeviceMessageTimingGap, holding its waiting command of each type, and values set while a command is waiting
+	// replace its values for the same actuators. A device that was idle for a whole gap gets its command right away. Enabled by default,
+	// when disabled every command is sent as it is requested.
+	void setCommandScheduling(bool enabled);
+	SchedulerStats getSchedulerStats();
+
+	// Command deduplication: ScalarCmd and RotateCmd values are rounded to the StepCount of their actuator,
+	// and actuators already at that step, as confirmed by the server, are left out of the command. A command
+	// left without actuators is not sent and completes with Ok. Stopping a device forgets its values.
+	// Disabled by default, the number of values and commands left out is in getStats.
+	void setCommandDeduplication(bool enabled);
+
+	// Requests made by the calling thread between beginBatch and commitBatch are sent together as one frame
+	// on commit, their timeouts start then. Actuator commands in a batch bypass the scheduler. Batches can be
+	// nested, only the outermost commitBatch sends. Requests in open batches are aborted when the connection
+	// closes or the client is destroyed.
+	void beginBatch();
+	void commitBatch();
+	// Auto batching: the sender thread puts everything queued within window after a message into one frame,
+	// at most maxMessages messages if that is non-zero. A zero window and size turns it off, which is the default.
+	void setAutoBatching(std::chrono::milliseconds window, std::size_t maxMessages = 0);
 
 	void waitForEmptyConfirmQueue();
 
-	// Mutex blocked function which grabs the currently connected devices and sensor reads.
+	// Copies of the currently connected devices and the last sensor reading. They never wait for the message handler.
 	std::vector<DeviceClass> getDevices();
 	SensorClass getSensors();
+	// The current state itself, shared and never modified, for callers that read it often. A new snapshot is
+	// published on every change, the old one stays valid as long as the caller holds it.
+	DeviceSnapshot getDeviceSnapshot() const;
+	SensorSnapshot getSensorSnapshot() const;
+	// Incremented after every published snapshot, so callers can skip work when nothing changed.
+	unsigned long long getDeviceGeneration() const;
+	unsigned long long getSensorGeneration() const;
+
+	// Every SensorReading is also kept in a ring buffer per device and sensor, so readings arriving faster
+	// than getSensors is polled are not lost. readSensorSamples copies the readings after the cursor to out and
+	// moves the cursor past them, returning their number. Each reader keeps its own cursor, readings it did
+	// not read before they were overwritten are counted in cursor.missed. Stale handles read nothing.
+	std::size_t readSensorSamples(DeviceHandle dev, int senIndex, SensorCursor& cursor, SensorSamples& out);
+	SensorBufferStats getSensorBufferStats(DeviceHandle dev, int senIndex);
+	// Readings kept per sensor, for buffers created after the call. 256 by default.
+	void setSensorBufferCapacity(std::size_t readings);
+	// Frames the inbound queue holds while the message handler is busy, 1024 by default. Once frames back up,
+	// a streamed SensorReading replaces the queued one of the same sensor, and one that finds the queue full is
+	// dropped. Other messages are always queued. Counted in getStats.
+	void setInboundQueueLimit(std::size_t frames);
+
+	// Message counters, request latencies and queue depths. The counters are always kept, reading them
+	// takes the library locks one after another for a moment.
+	ClientStats getStats();
+
+	// How often the log file is flushed, see Logger::setFlushPolicy.
+	void setLogFlushPolicy(std::chrono::milliseconds interval, std::size_t bytes);
+	// What logging does when messages are logged faster than the log file is written, and how many
+	// log entries were dropped because of it.
+	void setLogOverflowPolicy(LogOverflowPolicy policy);
+	unsigned long long getLogDroppedEntries() const;
 private:
 	// URL variables for the websocket.
 	std::string FullUrl;
@@ -115,32 +419,159 @@ private:
 	// WebSocket client for server communication
 	ix::WebSocket webSocket;
 
+	// Every mutex below guards one concern. When several are held at once they are taken in this order:
+	// deviceMx, batchMx, pendingMx, msgMx, connMx, sendMx, sensorMx. User callbacks run without any of them held.
+
 	// Message handler class, which takes messages, parses them and makes them to classes.
+	// Only the message handler thread uses it.
 	mhl::Messages messageHandler;
+	// Streaming decoder for received frames, used by the message handler thread.
+	mhl::MessageDecoder decoder;
 
-	// Queue variable for passing received messages from server.
-	std::queue<std::string> q;
-	// Condition variable to wait for received messages in the queue.
+	// Queue variable for passing received messages from server, guarded by msgMx. The message handler swaps
+	// it out as a whole and hands the strings back to inboundPool, so their capacity is reused for later frames.
+	std::vector<InboundFrame> q;
+	std::vector<std::string> inboundPool;
+	// Frames the message handler took from the queue. Message handler thread only.
+	std::vector<InboundFrame> inboundBatch;
+	// Condition variable to wait for received messages in the queue, or for a new earliest request deadline.
 	std::condition_variable cond;
-	std::condition_variable condQueue;
-	// Mutex to ensure no race conditions.
 	std::mutex msgMx;
+	bool deadlinesChanged = false;
+	// Set while the message handler works on frames it took from the queue.
+	bool frameInProgress = false;
+	// Set while frames wait in the queue or are being handled, arriving frames are only scanned then.
+	std::atomic<bool> inboundBacklog{false};
+	// Position in q of the queued streamed SensorReading of each sensor, by sensorKey. Guarded by msgMx.
+	std::unordered_map<unsigned long long, std::size_t> queuedReadings;
+	// One past the position in q of the last frame that is not a streamed reading, 0 if none. Guarded by msgMx.
+	std::size_t controlEnd = 0;
+	std::size_t inboundLimit = 1024;
+	// Inbound queue counters, guarded by msgMx.
+	std::size_t inboundHighWater = 0;
+	unsigned long long collapsedReadings = 0;
+	unsigned long long droppedReadings = 0;
+	// Time the current frame was received, the receive time of sensor readings. Message handler thread only.
+	std::chrono::steady_clock::time_point frameTime;
+
+	// Requests sent and not yet confirmed by the server, keyed by message ID, guarded by pendingMx.
+	std::unordered_map<unsigned int, mhl::PendingRequest> pendingRequests;
+	// Deadlines of pending requests sent with a timeout, earliest first.
+	std::priority_queue<std::pair<std::chrono::steady_clock::time_point, unsigned int>,
+		std::vector<std::pair<std::chrono::steady_clock::time_point, unsigned int>>,
+		std::greater<std::pair<std::chrono::steady_clock::time_point, unsigned int>>> pendingDeadlines;
+	std::mutex pendingMx;
+	// Notified when pending requests complete.
+	std::condition_variable condQueue;
+	// Completion callbacks to run once pendingMx is released, guarded by pendingMx.
+	std::vector<std::pair<mhl::CommandCallback, mhl::CommandResult>> completedRequests;
+	// Guards waiting on condWs and condClient for the connection state.
+	std::mutex connMx;
+	// Source of unique message IDs.
+	std::atomic<unsigned int> nextMessageId{1};
 	// Callback function for when a message is received and handled.
-	std::function<void(const mhl::Messages&)> messageCallback;
+	mhl::MessageCallback messageCallback;
+	// Counters behind getStats, updated without locks.
+	StatsRecorder stats;
 
-	// Device and sensor class vector which is grabbed outside of the library.
-	std::vector<DeviceClass> devices;
-	SensorClass sensorData;
+	// Device and sensor snapshots which are grabbed outside of the library. Only the message handler thread
+	// replaces them, with std::atomic_store, readers use std::atomic_load and do not take a lock.
+	DeviceSnapshot devices = std::make_shared<const std::vector<DeviceClass>>();
+	SensorSnapshot sensorData = std::make_shared<SensorClass>();
+	std::atomic<unsigned long long> deviceGeneration{0};
+	std::atomic<unsigned long long> sensorGeneration{0};
+	// Sensor snapshot replaced last, reused for the next reading once no reader holds it any more.
+	// Message handler thread only.
+	std::shared_ptr<SensorClass> spareSensorData;
+	// Sensor ring buffers keyed by device index in the upper and sensor index in the lower 32 bits,
+	// filled by the message handler thread and guarded by sensorMx.
+	std::unordered_map<unsigned long long, SensorBuffer> sensorBuffers;
+	std::size_t sensorBufferCapacity = 256;
+	std::mutex sensorMx;
+	// Feature tables of the connected devices by device index. Replaced by the message handler thread
+	// under deviceMx, which request functions hold while they look a device up.
+	std::unordered_map<unsigned int, DeviceFeatures> deviceFeatures;
+	unsigned int nextDeviceGeneration = 1;
+	std::mutex deviceMx;
 
 	// Thread for handling incoming messages
 	std::thread messageHandlerThread;
     std::atomic<bool> stopRequested{false};
 
+	// Outbound queue, filled by any thread calling the public send functions and emptied in order by the sender thread.
+	// Stops wait in stopQueue, which the sender thread empties first.
+	std::deque<OutboundMessage> sendQueue;
+	std::deque<OutboundMessage> stopQueue;
+	std::mutex sendMx;
+	std::condition_variable condSend;
+	std::thread senderThread;
+	// Buffer the sender thread builds websocket frames in, and the type and ID of each message in it.
+	std::string frameBuffer;
+	std::vector<std::pair<mhl::MessageTypes, unsigned int>> frameParts;
+	// Device of each message in the frame, only filled in when logging.
+	std::vector<int> frameDevices;
+	// Auto batching settings, guarded by sendMx.
+	std::chrono::milliseconds autoBatchWindow{0};
+	std::size_t autoBatchSize = 0;
+	// Batches opened by beginBatch, per thread, guarded by batchMx.
+	std::unordered_map<std::thread::id, OpenBatch> batches;
+	std::mutex batchMx;
+
+	// Command scheduler, guarded by sendMx and flushed by the sender thread.
+	std::atomic<bool> schedulingEnabled{true};
+	std::unordered_map<unsigned int, DeviceSchedule> schedules;
+	SchedulerStats schedulerStats;
+	// Commands the sender thread took from the scheduler and has not registered yet.
+	std::size_t unregisteredCommands = 0;
+
+	// Command deduplication state by device index and the values of the commands the server has not
+	// answered yet by message ID, guarded by dedupMx. No other lock is taken while holding it.
+	std::atomic<bool> dedupEnabled{false};
+	std::unordered_map<unsigned int, DeviceActuatorValues> actuatorValues;
+	std::unordered_map<unsigned int, UnconfirmedCommand> unconfirmedCommands;
+	unsigned long long suppressedValues = 0;
+	unsigned long long suppressedCommands = 0;
+	std::mutex dedupMx;
+
 	// Private helper methods
 	void connectServer();
 	void callbackFunction(const ix::WebSocketMessagePtr& msg);
+	bool streamedReading(const std::string& text, unsigned long long& key);
 	void messageHandling();
-	void sendMessage(json msg, mhl::MessageTypes mType);
+	void handleFrame(const std::string& value);
+	void dispatchServerMessage();
+	void queueMessage(const std::string& payload, mhl::MessageTypes mType, unsigned int id, mhl::CommandCallback callback = nullptr, std::chrono::milliseconds timeout = std::chrono::milliseconds(0), int deviceIndex = -1);
+	void queueStop(const std::string& payload, mhl::MessageTypes mType, unsigned int id, mhl::CommandCallback callback, std::chrono::milliseconds timeout, int deviceIndex);
+	bool addToBatch(const std::string& payload, mhl::MessageTypes mType, unsigned int id, mhl::CommandCallback callback, std::chrono::milliseconds timeout, int deviceIndex);
+	std::vector<BatchedRequest> takeOpenBatches();
+	void registerRequest(mhl::MessageTypes mType, unsigned int id, mhl::CommandCallback callback, std::chrono::steady_clock::time_point deadline, int deviceIndex = -1);
+	void submitCommand(mhl::Requests& req, mhl::MessageTypes mType, unsigned int gap, mhl::CommandCallback callback, std::chrono::milliseconds timeout);
+	void dropScheduledCommands(bool allDevices, unsigned int deviceIndex);
+	bool nextDueTime(std::chrono::steady_clock::time_point& next);
+	bool commandsScheduled();
+	void takeDueCommands(std::vector<DueCommand>& due);
+	void registerDueCommands(std::vector<DueCommand>& due);
+	void appendDueCommand(DueCommand& cmd);
+	void sendHandling();
+	void takeMessages(std::unique_lock<std::mutex>& lock, bool batching, std::size_t taken, std::vector<OutboundMessage>& messages);
+	void beginFrame();
+	void appendMessage(const OutboundMessage& out);
+	void sendFrame();
+	void transmitFrame();
+	unsigned int allocateId();
+	void abortRequest(mhl::CommandCallback callback, mhl::MessageTypes mType);
+	void completeRequest(mhl::CommandCallback callback, mhl::MessageTypes mType, mhl::CommandStatus status);
+	bool suppressUnchanged(const DeviceFeatures& features, mhl::MessageTypes mType, mhl::Requests& req);
+	void trackCommand(const msg::ScalarCmd& cmd);
+	void trackCommand(const msg::RotateCmd& cmd);
+	void confirmCommand(unsigned int id, bool ok);
+	void forgetActuatorValues(bool allDevices, unsigned int deviceIndex);
+	void finishRequest(std::unordered_map<unsigned int, mhl::PendingRequest>::iterator it, mhl::CommandStatus status);
+	void expireRequests();
+	void runCompletions();
+	void abortFrame();
+	static mhl::CommandCallback makePromiseCallback(std::future<mhl::CommandResult>& future);
 	void updateDevices();
-	int findDevice(DeviceClass dev);
+	const DeviceFeatures* findFeatures(DeviceHandle dev) const;
+	bool batchOpen();
 };
\ No newline at end of file
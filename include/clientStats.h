@@ -0,0 +1,117 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+
+#include "messageHandler.h"
+
+// Latencies counted in buckets of powers of two nanoseconds.
+class LatencyHistogram {
+public:
+	static const std::size_t bucketCount = 40;
+	// buckets[i] counts latencies from 2^i ns up to 2^(i+1) ns, the first and last buckets also count
+	// the shorter and longer ones.
+	unsigned long long buckets[bucketCount] = {};
+	unsigned long long count = 0;
+	std::chrono::nanoseconds total{0};
+	std::chrono::nanoseconds max{0};
+
+	// Adds one latency, negative ones count as 0.
+	void record(std::chrono::nanoseconds value);
+	std::chrono::nanoseconds mean() const;
+	// Upper bound of the bucket reaching the given fraction of the latencies, 0.99 for the 99th percentile.
+	std::chrono::nanoseconds percentile(double fraction) const;
+	void merge(const LatencyHistogram& other);
+
+	// Index of the bucket counting a latency of ns nanoseconds.
+	static std::size_t bucketOf(long long ns);
+};
+
+// Counters of one message type.
+class MessageTypeStats {
+public:
+	// Messages of the type sent to or received from the server.
+	unsigned long long sent = 0;
+	unsigned long long received = 0;
+	// Requests of the type the server answered with an Error, and the ones that timed out.
+	unsigned long long errors = 0;
+	unsigned long long timeouts = 0;
+	// Time from sending a request of the type until its Ok, Error or SensorReading arrived.
+	LatencyHistogram latency;
+};
+
+// Performance counters of a Client, see Client::getStats.
+class ClientStats {
+public:
+	MessageTypeStats messageTypes[mhl::messageTypeCount];
+
+	// Frames received and not handled yet, requests waiting for the sender thread and requests
+	// waiting for their reply.
+	std::size_t inboundQueued = 0;
+	std::size_t outboundQueued = 0;
+	std::size_t pendingRequests = 0;
+	// Most frames the inbound queue held at once.
+	std::size_t inboundHighWater = 0;
+	// Streamed SensorReadings replaced in the inbound queue by a newer reading of the same sensor, and the
+	// ones dropped because the queue was full. Neither reaches the callback or the sensor ring buffers.
+	unsigned long long collapsedSensorReadings = 0;
+	unsigned long long droppedSensorReadings = 0;
+	// Actuator requests merged into a waiting command, and waiting or queued commands dropped by a stop.
+	unsigned long long coalescedCommands = 0;
+	unsigned long long droppedCommands = 0;
+	// Actuator values left out by command deduplication, and commands not sent since all their values were.
+	unsigned long long suppressedValues = 0;
+	unsigned long long suppressedCommands = 0;
+	// Log entries dropped because the log queue was full.
+	unsigned long long droppedLogEntries = 0;
+	// Sensor readings overwritten in their ring buffers before anyone read them.
+	unsigned long long overflowedSensorReadings = 0;
+	// Time from calling stopDevice or stopAllDevices until the server's Ok.
+	LatencyHistogram stopLatency;
+
+	const MessageTypeStats& operator[](mhl::MessageTypes type) const { return messageTypes[static_cast<std::size_t>(type)]; }
+	// Latencies of all request types together.
+	LatencyHistogram requestLatency() const;
+};
+
+// Records the per message type counters of a Client. Every update is a relaxed atomic increment,
+// so it is safe from any thread and cheap enough to stay enabled.
+class StatsRecorder {
+public:
+	StatsRecorder();
+
+	void sent(mhl::MessageTypes type) { counters[index(type)].sent.fetch_add(1, std::memory_order_relaxed); }
+	void received(mhl::MessageTypes type) { counters[index(type)].received.fetch_add(1, std::memory_order_relaxed); }
+	void error(mhl::MessageTypes type) { counters[index(type)].errors.fetch_add(1, std::memory_order_relaxed); }
+	void timeout(mhl::MessageTypes type) { counters[index(type)].timeouts.fetch_add(1, std::memory_order_relaxed); }
+	void latency(mhl::MessageTypes type, std::chrono::nanoseconds value);
+	void stopLatency(std::chrono::nanoseconds value) { record(stops, value); }
+
+	// Copies the counters to the messageTypes of out.
+	void copyTo(ClientStats& out) const;
+private:
+	class Counters {
+	public:
+		std::atomic<unsigned long long> sent;
+		std::atomic<unsigned long long> received;
+		std::atomic<unsigned long long> errors;
+		std::atomic<unsigned long long> timeouts;
+		std::atomic<unsigned long long> buckets[LatencyHistogram::bucketCount];
+		std::atomic<unsigned long long> latencyCount;
+		std::atomic<long long> latencyTotal;
+		std::atomic<long long> latencyMax;
+	};
+
+	static std::size_t index(mhl::MessageTypes type) {
+		return static_cast<std::size_t>(type) < mhl::messageTypeCount ? static_cast<std::size_t>(type) : static_cast<std::size_t>(mhl::MessageTypes::Unknown);
+	}
+
+	Counters counters[mhl::messageTypeCount];
+	// Only the latency counters are used.
+	Counters stops;
+
+	static void clear(Counters& c);
+	static void record(Counters& c, std::chrono::nanoseconds value);
+	static void copyLatency(const Counters& c, LatencyHistogram& out);
+};
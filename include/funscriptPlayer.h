@@ -0,0 +1,100 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <istream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "buttplugclient.h"
+
+// One LinearCmd of a funscript: move to position within duration, the time up to the next action.
+class FunscriptSegment {
+public:
+	// Milliseconds since the start of the script. 32 bits cover 49 days and keep long scripts small.
+	unsigned int start;
+	unsigned int duration;
+	// Target position from 0 to 1, with inverted and range of the script applied.
+	float position;
+
+	unsigned int end() const { return start + duration; }
+};
+
+// The actions of a .funscript file turned into LinearCmd segments.
+class Funscript {
+public:
+	// Segments in time order. The first one moves to the first action from the start of the script.
+	std::vector<FunscriptSegment> segments;
+
+	// Loads a funscript. The file is read through a SAX parser that keeps nothing but the actions, so even
+	// hour-long scripts never exist as a JSON document in memory. Returns false with the reason in error.
+	bool load(const std::string& path, std::string& error);
+	bool load(std::istream& in, std::string& error);
+
+	std::chrono::milliseconds length() const;
+	// Index of the segment playing at time t, which is the first one ending after it.
+	std::size_t find(std::chrono::milliseconds t) const;
+};
+
+// Counters of a FunscriptPlayer.
+class FunscriptPlayerStats {
+public:
+	// Segments sent as LinearCmd.
+	unsigned long long segmentsSent = 0;
+	// Segments over before they could be sent, because the player ran late or sought past them.
+	unsigned long long segmentsSkipped = 0;
+	// How late segments were sent relative to their due time.
+	LatencyHistogram lateness;
+};
+
+// Plays a Funscript on the Linear actuators of a device. A thread of its own sends every segment
+// latencyOffset before the script reaches its start, so the command gets to the device in time. Seeking,
+// pausing and changing the rate only move the script clock, the segments are not rebuilt. After any of them
+// the segment playing is sent again with the time it has left.
+class FunscriptPlayer {
+public:
+	FunscriptPlayer(Client& client, DeviceHandle dev);
+	~FunscriptPlayer();
+
+	// Replaces the script, paused at its start.
+	void setScript(Funscript script);
+	void play();
+	// Stops the device where it is until play is called.
+	void pause();
+	void seek(std::chrono::milliseconds time);
+	// Playback speed, 1 plays the script as written.
+	void setRate(double rate);
+	// Time commands take to get to the device, they are sent this much ahead of their segment.
+	void setLatencyOffset(std::chrono::milliseconds offset);
+
+	// Current time in the script.
+	std::chrono::milliseconds position() const;
+	bool isPlaying() const;
+	FunscriptPlayerStats getStats() const;
+private:
+	Client& client;
+	DeviceHandle dev;
+
+	mutable std::mutex mx;
+	std::condition_variable cond;
+	Funscript script;
+	// Script clock: at wall time wallBase the script was at scriptBase and moves on at rate while playing.
+	std::chrono::steady_clock::time_point wallBase;
+	std::chrono::nanoseconds scriptBase{0};
+	double rate = 1.0;
+	bool playing = false;
+	std::chrono::milliseconds latencyOffset{50};
+	// Next segment to send.
+	std::size_t next = 0;
+	// Set when the clock or the script changed, so the thread works out its next send again.
+	bool changed = false;
+	bool running = true;
+	FunscriptPlayerStats stats;
+	std::thread thread;
+
+	std::chrono::nanoseconds scriptTime(std::chrono::steady_clock::time_point wall) const;
+	void rebase(std::chrono::steady_clock::time_point now);
+	void run();
+};
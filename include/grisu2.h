@@ -0,0 +1,8 @@
+#pragma once
+
+// Shortest round-trip formatting of doubles, the same text json::dump() writes for them.
+namespace grisu2 {
+	// Writes value to [first, last) and returns the end of the written text. The buffer needs room for
+	// at least 32 characters and value must be finite.
+	char* to_chars(char* first, const char* last, double value);
+}
@@ -1,3 +1,5 @@
+#pragma once
+
 #include <fstream>
 #include <queue>
 #include <mutex>
@@ -6,36 +8,133 @@
 #include <thread>
 #include <condition_variable>
 #include <atomic>
+#include <ctime>
+#include <memory>
+#include <vector>
 #include <filesystem>
 
-// Structure to store information about a log entry
+#include "messageHandler.h"
+
+// Direction of a logged message. Dropped only appears in binary logs, as a record noting dropped entries.
+enum class LogDirection : unsigned char {
+    Sent,
+    Received,
+    Ok,
+    Error,
+    Dropped
+};
+
+// Format of the log files
+enum class LogFormat {
+    // One line of text per entry
+    Text,
+    // Fixed size binary records, see below
+    Binary
+};
+
+// Binary log files start with a header followed by fixed size records, all integers little endian.
+//   header: magic "BPLOG01\n", u64 system clock ns and u64 steady clock ns when the file was opened,
+//           u32 record size, u32 reserved
+//   record: u64 steady clock ns, i64 latency ns or -1, u32 message ID, i32 device index or -1,
+//           u8 LogDirection, u8 mhl::MessageTypes, 6 reserved bytes
+// A Dropped record holds the number of entries dropped before it in the message ID field.
+const char binaryLogMagic[8] = { 'B', 'P', 'L', 'O', 'G', '0', '1', '\n' };
+const size_t binaryLogHeaderSize = 32;
+const size_t binaryLogRecordSize = 32;
+// Binary log files are rotated at this size at least.
+const size_t binaryLogFileSize = 64 * 1024 * 1024;
+
+// Structure to store information about a log entry. Fixed size, so entries are copied into the
+// log ring without allocating.
 struct LogEntry {
     std::chrono::system_clock::time_point timestamp;
-    std::string messageType;
-    std::string direction; 
+    std::chrono::steady_clock::time_point monotonic;
+    mhl::MessageTypes messageType;
+    LogDirection direction;
     unsigned int messageId;
+    // Device the message is about, -1 if none or unknown
+    int deviceIndex;
+    // Time from the request until its confirmation for Ok and Error entries, negative if unknown
+    std::chrono::nanoseconds latency;
+    // Error text of Error entries, truncated to fit and null terminated
+    char errorMessage[64];
+};
+
+// What logging does when the log ring is full
+enum class LogOverflowPolicy {
+    // Drop the entry being logged
+    DropNewest,
+    // Drop the oldest entry not written yet to make room
+    DropOldest,
+    // Wait until the background thread made room
+    Block
+};
+
+// Bounded multi-producer multi-consumer ring of log entries, preallocated and without locks.
+// Every cell carries a sequence number telling whether it is free for the producer or filled for
+// the consumer at the current position.
+class LogRing {
+public:
+    // The capacity is rounded up to a power of two
+    explicit LogRing(size_t capacity);
+
+    // Return false when the ring is full or empty respectively
+    bool tryPush(const LogEntry& entry);
+    bool tryPop(LogEntry& entry);
+    bool empty() const;
+    size_t capacity() const { return mask + 1; }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        LogEntry entry;
+    };
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+    std::atomic<size_t> enqueuePos;
+    // Keeps the producer and consumer positions on separate cache lines
+    char padding[64];
+    std::atomic<size_t> dequeuePos;
 };
 
 // Logger class that handles message logging in a thread-safe way
 // Uses a separate thread to write log entries to avoid blocking the main thread
 class Logger {
 public:
-    // Constructor that sets up the logger with filename and max file size
-    Logger(const std::string baseFilename = "log", size_t maxFileSize = 102400);
+    // Constructor that sets up the logger with filename, max file size and the number of entries
+    // that can wait for the background thread
+    Logger(const std::string baseFilename = "log", size_t maxFileSize = 102400, size_t queueCapacity = 8192);
     ~Logger();
 
     // Start the logging system with default or custom filename
     void start();
     void start(const std::string& baseFilenameOverride);
+    // Binary logs are rotated at binaryLogFileSize or the max file size, whichever is larger
+    void start(const std::string& baseFilenameOverride, LogFormat format);
     
     // Stop the logging system and clean up resources
     void stop();
+
+    // Written entries are flushed to disk once interval passed since the last flush or bytes were written
+    // since then, whichever comes first. Defaults to one second and 64 KiB, a zero interval flushes after
+    // every batch of entries.
+    void setFlushPolicy(std::chrono::milliseconds interval, size_t bytes);
     
-    // Thread-safe methods to log sent and received messages
-    void logSentMessage(const std::string& messageType, unsigned int messageId);
-    void logReceivedMessage(const std::string& messageType, unsigned int messageId);
-    void logOkMessage(const std::string& messageType, unsigned int messageId);
-    void logErrorMessage(const std::string& messageType, unsigned int messageId, const std::string& errorMessage);
+    // What logging does when the queue is full, DropNewest by default. Block only waits while the
+    // logger is running.
+    void setOverflowPolicy(LogOverflowPolicy policy);
+    // Entries dropped because the queue was full. Each drop is also noted in the log file.
+    unsigned long long droppedEntries() const;
+
+    // Thread-safe methods to log sent and received messages, they do not lock or allocate unless
+    // the queue is full and the policy is Block
+    void logSentMessage(mhl::MessageTypes messageType, unsigned int messageId, int deviceIndex = -1);
+    void logReceivedMessage(mhl::MessageTypes messageType, unsigned int messageId, int deviceIndex = -1);
+    void logOkMessage(mhl::MessageTypes messageType, unsigned int messageId, int deviceIndex = -1,
+        std::chrono::nanoseconds latency = std::chrono::nanoseconds(-1));
+    void logErrorMessage(mhl::MessageTypes messageType, unsigned int messageId, const std::string& errorMessage,
+        int deviceIndex = -1, std::chrono::nanoseconds latency = std::chrono::nanoseconds(-1));
 
 private:
     // Background thread processing function that writes queued log entries to file
@@ -44,19 +143,43 @@ private:
     // Check if log file needs rotation based on size
     void checkAndRotateFile();
     
+    // Fill in the fields every entry has, and queue it
+    void log(mhl::MessageTypes messageType, LogDirection direction, unsigned int messageId, int deviceIndex,
+        std::chrono::nanoseconds latency, const std::string* errorMessage);
+    // Queue an entry according to the overflow policy and wake the background thread if it sleeps
+    void push(const LogEntry& entry);
+
     // Generate a unique log filename based on date, time and counter
     std::string generateFilename() const;
+    // Open a new log file, with the header in binary format
+    void openFile();
     
-    // Write a single log entry to the file
-    void writeEntryToFile(const LogEntry& entry);
+    // Write a batch of log entries to the file
+    void writeEntriesToFile(const std::vector<LogEntry>& entries);
+    // Format a log entry at the end of lineBuffer
+    void formatEntry(const LogEntry& entry);
+    void formatTimestamp(std::chrono::system_clock::time_point timestamp);
+    // Append the binary record of a log entry to lineBuffer
+    void encodeEntry(const LogEntry& entry);
+    // Write lineBuffer to the file and clear it
+    void writeBuffer();
 
-    // Queue for storing log entries awaiting processing
-    std::queue<LogEntry> logQueue;
+    // Queue for storing log entries awaiting processing, and the batch the background thread took from it
+    LogRing logQueue;
+    std::vector<LogEntry> batch;
+    std::atomic<LogOverflowPolicy> overflowPolicy;
+    std::atomic<unsigned long long> dropped;
+    // Drops already noted in the log file, background thread only
+    unsigned long long reportedDropped;
     
-    // Synchronization primitives
+    // Synchronization primitives. Producers only take queueMutex to wake a sleeping background
+    // thread or to wait for room with the Block policy.
     std::mutex queueMutex;
     std::mutex fileMutex;
     std::condition_variable queueCondition;
+    std::condition_variable spaceCondition;
+    std::atomic<bool> writerSleeping;
+    std::atomic<unsigned int> blockedProducers;
     
     // Log file and properties
     std::ofstream logFile;
@@ -64,6 +187,20 @@ private:
     size_t maxFileSize;
     size_t currentFileSize;
     unsigned int fileCounter;
+    LogFormat format;
+
+    // Flush policy, guarded by queueMutex
+    std::chrono::milliseconds flushInterval;
+    size_t flushBytes;
+
+    // Formatting state used by the background thread only. The date and time part of the timestamp
+    // is formatted once per second.
+    std::string lineBuffer;
+    std::time_t cachedSecond;
+    char cachedTime[32];
+    size_t cachedTimeLength;
+    size_t unflushedBytes;
+    std::chrono::steady_clock::time_point lastFlush;
     
     // Flag to control background thread operation
     std::atomic<bool> running;
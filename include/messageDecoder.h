@@ -0,0 +1,64 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+#include "messageHandler.h"
+
+namespace mhl {
+	// Streaming decoder for frames received from the server. Reads the JSON text in a single pass straight
+	// into ServerMessage objects, without building json trees in between. Decoded messages and their
+	// strings and vectors are reused between frames, so steady traffic does not allocate.
+	//
+	// Frames with anything the decoder does not handle (unknown message types, malformed text, floating point
+	// numbers where integers are expected) are rejected as a whole, the caller falls back to json::parse then.
+	class MessageDecoder {
+	public:
+		// Decodes one frame, an array of server messages. Returns false if the frame was rejected.
+		bool decode(const char* text, std::size_t length);
+		bool decode(const std::string& frame) { return decode(frame.data(), frame.size()); }
+
+		// Messages of the last successfully decoded frame.
+		std::size_t size() const { return count; }
+		ServerMessage& operator[](std::size_t i) { return messages[i]; }
+	private:
+		// Read position in the current frame.
+		const char* pos = nullptr;
+		const char* end = nullptr;
+		// Last object key read, reused to avoid allocations.
+		std::string key;
+		// Whether the message being read had an Id.
+		bool hasId = false;
+
+		std::vector<ServerMessage> messages;
+		std::size_t count = 0;
+
+		template<typename F> bool readObject(F field);
+		template<typename F> bool readArray(F element);
+
+		void skipWhitespace();
+		bool consume(char c);
+		bool readKey();
+		bool readString(std::string& out);
+		bool readHex(unsigned int& out);
+		bool readUnsigned(unsigned int& out);
+		bool readId(unsigned int& out);
+		bool readInt(int& out);
+		bool readIntArray(std::vector<int>& out);
+		bool skipValue();
+		bool skipString();
+
+		bool readMessage(ServerMessage& m);
+		bool readDevice(Device& device, unsigned int* id);
+		bool readDeviceField(Device& device);
+		bool readDeviceMessages(std::vector<DeviceCmd>& out);
+		bool readDeviceCmdAttr(DeviceCmdAttr& attr);
+	};
+
+	// Checks whether a frame holds exactly one SensorReading with Id 0, one the server streams on its own,
+	// and reads its device and sensor index. A single pass over the text that skips the Data values and
+	// does not allocate, for looking at frames before they are decoded. Frames it cannot tell, like ones
+	// with whitespace before the message type, are reported as something else.
+	bool peekStreamedReading(const char* text, std::size_t length, unsigned int& deviceIndex, unsigned int& sensorIndex);
+}
@@ -1,5 +1,10 @@
+#pragma once
+
 #include<string>
 #include<map>
+#include<chrono>
+#include<functional>
+#include<cstddef>
 
 #include "messages.h"
 
@@ -26,12 +31,121 @@ namespace mhl {
 		SensorReadCmd,
 		SensorReading,
 		SensorSubscribeCmd,
-		SensorUnsubscribeCmd
+		SensorUnsubscribeCmd,
+		// Any message type not known to this client.
+		Unknown
+	};
+
+	// Name of a message type together with its length.
+	struct MessageTypeName {
+		const char* name;
+		std::size_t length;
 	};
 
-	// Maps enum MessageTypes to their string representation
+	template<std::size_t N>
+	constexpr MessageTypeName makeMessageTypeName(const char (&name)[N]) {
+		return MessageTypeName{ name, N - 1 };
+	}
+
+	// Compile-time table of message type names, indexed by the MessageTypes value.
+	constexpr MessageTypeName messageTypeNames[] = {
+		makeMessageTypeName("Ok"),
+		makeMessageTypeName("Error"),
+		makeMessageTypeName("Ping"),
+		makeMessageTypeName("RequestServerInfo"),
+		makeMessageTypeName("ServerInfo"),
+		makeMessageTypeName("StartScanning"),
+		makeMessageTypeName("StopScanning"),
+		makeMessageTypeName("ScanningFinished"),
+		makeMessageTypeName("RequestDeviceList"),
+		makeMessageTypeName("DeviceList"),
+		makeMessageTypeName("DeviceAdded"),
+		makeMessageTypeName("DeviceRemoved"),
+		makeMessageTypeName("StopDeviceCmd"),
+		makeMessageTypeName("StopAllDevices"),
+		makeMessageTypeName("ScalarCmd"),
+		makeMessageTypeName("LinearCmd"),
+		makeMessageTypeName("RotateCmd"),
+		makeMessageTypeName("SensorReadCmd"),
+		makeMessageTypeName("SensorReading"),
+		makeMessageTypeName("SensorSubscribeCmd"),
+		makeMessageTypeName("SensorUnsubscribeCmd"),
+		makeMessageTypeName("Unknown")
+	};
+
+	constexpr std::size_t messageTypeCount = sizeof(messageTypeNames) / sizeof(messageTypeNames[0]);
+	static_assert(messageTypeCount == static_cast<std::size_t>(MessageTypes::Unknown) + 1, "messageTypeNames must have one entry per MessageTypes value");
+
+	// Returns the protocol name of a message type.
+	constexpr const char* messageTypeName(MessageTypes type) {
+		return static_cast<std::size_t>(type) < messageTypeCount ? messageTypeNames[static_cast<std::size_t>(type)].name : "Unknown";
+	}
+
+	// Perfect hash of the message type names, built from the length, the first two and the last character.
+	// Only valid for names of at least two characters.
+	constexpr std::size_t messageTypeHashSize = 64;
+	constexpr std::size_t messageTypeHash(const char* name, std::size_t length) {
+		return (2 * length + 6 * static_cast<unsigned char>(name[0]) + static_cast<unsigned char>(name[1])
+			+ 3 * static_cast<unsigned char>(name[length - 1])) & (messageTypeHashSize - 1);
+	}
+
+	// Checks at compile time that no two names share a hash slot.
+	constexpr bool messageTypeHashDistinct(std::size_t i, std::size_t j) {
+		return j >= messageTypeCount ? true :
+			messageTypeHash(messageTypeNames[i].name, messageTypeNames[i].length) != messageTypeHash(messageTypeNames[j].name, messageTypeNames[j].length)
+			&& messageTypeHashDistinct(i, j + 1);
+	}
+	constexpr bool messageTypeHashPerfect(std::size_t i) {
+		return i >= messageTypeCount ? true : messageTypeHashDistinct(i, i + 1) && messageTypeHashPerfect(i + 1);
+	}
+	static_assert(messageTypeHashPerfect(0), "messageTypeHash has collisions, adjust it after changing messageTypeNames");
+
+	// Looks up the message type of a protocol name in constant time, returns MessageTypes::Unknown if there is none.
+	MessageTypes messageTypeFromString(const char* name, std::size_t length);
+	MessageTypes messageTypeFromString(const std::string& name);
+
+	// Maps enum MessageTypes to their string representation. Lookups go through messageTypeNames,
+	// the type is kept for code that builds its own map.
 	typedef std::map<MessageTypes, std::string> MessageMap_t;
 
+	// Outcome of a request, handed to its completion callback or future.
+	enum class CommandStatus {
+		Ok,
+		Error,
+		Timeout,
+		Aborted
+	};
+
+	// Result of a request once the server answered it, it timed out or it could not be sent.
+	class CommandResult {
+	public:
+		CommandStatus status = CommandStatus::Aborted;
+		// Type and ID of the request this is the result of.
+		MessageTypes messageType = MessageTypes::Ok;
+		unsigned int Id = 0;
+		// Set when status is Error.
+		msg::Error error;
+		// Set when a SensorReadCmd is answered.
+		msg::SensorReading sensorReading;
+	};
+
+	// Callback that receives the result of a request.
+	typedef std::function<void(const CommandResult&)> CommandCallback;
+
+	// Request sent to the server that is still waiting for its confirmation.
+	class PendingRequest {
+	public:
+		MessageTypes messageType;
+		// Device the request is for, -1 if none.
+		int deviceIndex = -1;
+		// Time at which the request was issued, and the time it was sent if it was.
+		std::chrono::steady_clock::time_point timestamp;
+		std::chrono::steady_clock::time_point sentAt;
+		// Optional completion callback and the time after which the request times out.
+		CommandCallback callback;
+		std::chrono::steady_clock::time_point deadline;
+	};
+
 	// Class for request messages - contains all possible request message types
 	class Requests {
 	public:
@@ -51,38 +165,28 @@ namespace mhl {
 		msg::SensorUnsubscribeCmd sensorUnsubscribeCmd;
 	};
 
+	// One decoded server message, only the payload matching messageType is set.
+	class ServerMessage {
+	public:
+		MessageTypes messageType = MessageTypes::Unknown;
+		unsigned int Id = 0;
+
+		msg::Ok ok;
+		msg::Error error;
+		msg::ServerInfo serverInfo;
+		msg::DeviceList deviceList;
+		msg::DeviceAdded deviceAdded;
+		msg::DeviceRemoved deviceRemoved;
+		msg::SensorReading sensorReading;
+	};
+
 	// Class for messages received and for handling all types of messages.
 	// Also handles converting between JSON and message objects
 	class Messages {
 	public:
 		// Current message type being processed
 		MessageTypes messageType = MessageTypes::Ok;
-		unsigned int Id;
-
-		// A map for message strings corresponding to enum. This is in this class since it is more convenient.
-		MessageMap_t messageMap = {
-			{MessageTypes::Ok, "Ok"},
-			{MessageTypes::Error, "Error"},
-			{MessageTypes::Ping, "Ping"},
-			{MessageTypes::RequestServerInfo, "RequestServerInfo"},
-			{MessageTypes::ServerInfo, "ServerInfo"},
-			{MessageTypes::StartScanning, "StartScanning"},
-			{MessageTypes::StopScanning, "StopScanning"},
-			{MessageTypes::ScanningFinished, "ScanningFinished"},
-			{MessageTypes::RequestDeviceList, "RequestDeviceList"},
-			{MessageTypes::DeviceList, "DeviceList"},
-			{MessageTypes::DeviceAdded, "DeviceAdded"},
-			{MessageTypes::DeviceRemoved, "DeviceRemoved"},
-			{MessageTypes::StopDeviceCmd, "StopDeviceCmd"},
-			{MessageTypes::StopAllDevices, "StopAllDevices"},
-			{MessageTypes::ScalarCmd, "ScalarCmd"},
-			{MessageTypes::LinearCmd, "LinearCmd"},
-			{MessageTypes::RotateCmd, "RotateCmd"},
-			{MessageTypes::SensorReadCmd, "SensorReadCmd"},
-			{MessageTypes::SensorReading, "SensorReading"},
-			{MessageTypes::SensorSubscribeCmd, "SensorSubscribeCmd"},
-			{MessageTypes::SensorUnsubscribeCmd, "SensorUnsubscribeCmd"}
-		};
+		unsigned int Id = 0;
 
 		// Store server responses in these objects
 		msg::Ok ok;
@@ -93,14 +197,52 @@ namespace mhl {
 		msg::DeviceRemoved deviceRemoved;
 		msg::SensorReading sensorReading;
 
-		std::vector<std::pair<std::string, unsigned int>> q_sent;
-
 		// Both server message and requests are handled in this class.
 		// Parses incoming JSON messages from server into appropriate classes
 		void handleServerMessage(json& msg);
-		
-		// Converts outgoing request objects to JSON for transmission
-		json handleClientRequest(Requests req);
+
+		// Takes over an already decoded server message and updates the device list with it.
+		// The payload is swapped in, so m is left with the previous contents of the handler.
+		void applyServerMessage(ServerMessage& m);
+
+		// Converts outgoing request objects to JSON for transmission. The request written is the one
+		// of the given type, the overloads without it use messageType.
+		json handleClientRequest(const Requests& req);
+		static json handleClientRequest(MessageTypes type, const Requests& req);
+
+		// Appends the JSON text of the request to out. ScalarCmd, LinearCmd and RotateCmd are written
+		// directly, other requests go through handleClientRequest and dump(). The static overloads
+		// touch no handler state, so any thread can write requests with them.
+		void writeClientRequest(const Requests& req, std::string& out);
+		static void writeClientRequest(MessageTypes type, const Requests& req, std::string& out);
+	private:
+	};
+
+	// Lightweight view of a message received from the server, passed to the user callback by const reference.
+	// The payload accessors refer to the message handler's storage and are only valid during the callback.
+	class MessageEvent {
+	public:
+		MessageEvent(MessageTypes type, unsigned int id, const Messages& source)
+			: messageType(type), Id(id), source(&source) {}
+
+		MessageTypes messageType;
+		unsigned int Id;
+
+		// Decoded payload, read the one matching messageType.
+		const msg::Ok& ok() const { return source->ok; }
+		const msg::Error& error() const { return source->error; }
+		const msg::ServerInfo& serverInfo() const { return source->serverInfo; }
+		const msg::DeviceList& deviceList() const { return source->deviceList; }
+		const msg::DeviceAdded& deviceAdded() const { return source->deviceAdded; }
+		const msg::DeviceRemoved& deviceRemoved() const { return source->deviceRemoved; }
+		const msg::SensorReading& sensorReading() const { return source->sensorReading; }
+
+		// The whole message handler state, for callbacks written against mhl::Messages.
+		const Messages& messages() const { return *source; }
 	private:
+		const Messages* source;
 	};
+
+	// Callback type receiving server messages.
+	typedef std::function<void(const MessageEvent&)> MessageCallback;
 }
\ No newline at end of file
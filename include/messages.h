@@ -1,3 +1,5 @@
+#pragma once
+
 #include <nlohmann/json.hpp>
 #include "helperClasses.h"
 #include <string>
@@ -178,6 +180,12 @@ namespace msg {
 	extern void to_json(json& j, const SensorSubscribeCmd& k);
 	extern void to_json(json& j, const SensorUnsubscribeCmd& k);
 	
+	// Writers appending the JSON of the frequent actuator commands to a buffer without building a json object.
+	// The output is byte for byte what to_json followed by dump() produces.
+	extern void to_buffer(std::string& out, const ScalarCmd& k);
+	extern void to_buffer(std::string& out, const LinearCmd& k);
+	extern void to_buffer(std::string& out, const RotateCmd& k);
+	
 	// JSON deserialization function declarations for response messages
 	extern void from_json(const json& j, Ok& k);
 	extern void from_json(const json& j, Error& k);
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "buttplugclient.h"
+
+// Shapes of the periodic waves of Pattern::wave.
+enum class WaveShape {
+	// Smooth rise from low to high and back within a period.
+	Sine,
+	// high for the duty fraction of the period, low for the rest.
+	Square,
+	// Rises linearly from low to high over the period, then jumps back to low.
+	Ramp,
+	// Jumps to high at the start of the period and falls linearly back to low over the duty fraction of it.
+	Pulse
+};
+
+// Value of a pattern at a point in time since the pattern started.
+class PatternKeyframe {
+public:
+	std::chrono::milliseconds time;
+	double value;
+};
+
+// Value of an actuator over time, either keyframes with linear interpolation between them or a periodic wave.
+class Pattern {
+public:
+	// Keyframes are sorted by time. A looping pattern starts over after its last keyframe, any other one
+	// holds the last value and ends there.
+	static Pattern keyframes(std::vector<PatternKeyframe> frames, bool loop = false);
+	// A wave between low and high that repeats every period and never ends.
+	static Pattern wave(WaveShape shape, std::chrono::milliseconds period, double low = 0.0, double high = 1.0, double duty = 0.5);
+
+	double valueAt(std::chrono::nanoseconds elapsed) const;
+	bool finished(std::chrono::nanoseconds elapsed) const;
+private:
+	bool isWave = false;
+	WaveShape shape = WaveShape::Sine;
+	std::chrono::nanoseconds period{0};
+	double low = 0.0;
+	double high = 1.0;
+	double duty = 0.5;
+	std::vector<PatternKeyframe> frames;
+	bool loop = false;
+};
+
+// Counters of a PatternEngine.
+class PatternEngineStats {
+public:
+	unsigned long long ticks = 0;
+	// Ticks skipped because the engine woke up more than a tick late.
+	unsigned long long missedTicks = 0;
+	// ScalarCmd and RotateCmd requests sent, at most one per device, command kind and tick.
+	unsigned long long commandsSent = 0;
+	// Actuator values not sent since they quantized to the step sent last.
+	unsigned long long unchangedValues = 0;
+	// How late the engine woke up for its ticks.
+	LatencyHistogram jitter;
+};
+
+// Plays patterns on Scalar and Rotate actuators of a Client's devices. A thread of its own wakes up on ticks
+// counted from a fixed steady_clock start, so a late wakeup delays one tick without shifting the following
+// ones. Every tick evaluates the playing patterns and sends one command per device with the actuators whose
+// value moved to another step of the actuator's StepCount.
+class PatternEngine {
+public:
+	explicit PatternEngine(Client& client, std::chrono::microseconds tickInterval = std::chrono::milliseconds(10));
+	~PatternEngine();
+
+	// Plays pattern on an actuator from now on, replacing what played there. Patterns of Rotate actuators
+	// range from -1 to 1, negative values turn counterclockwise, Scalar ones from 0 to 1. Returns false if
+	// the device is gone or has no such actuator.
+	bool play(DeviceHandle dev, CommandKind kind, unsigned int actuator, const Pattern& pattern);
+	// Stops the pattern of an actuator, which keeps running at the last value sent.
+	void stop(DeviceHandle dev, CommandKind kind, unsigned int actuator);
+	void stopAll();
+
+	void setTickInterval(std::chrono::microseconds interval);
+	PatternEngineStats getStats() const;
+private:
+	// Steps used for actuators that report no StepCount.
+	static const unsigned int defaultSteps = 100;
+
+	// A pattern playing on one actuator.
+	class Track {
+	public:
+		DeviceHandle dev;
+		CommandKind kind;
+		unsigned int actuator;
+		Pattern pattern;
+		std::chrono::steady_clock::time_point start;
+		unsigned int steps;
+		// Step sent last, none yet if sent is false.
+		long long step = 0;
+		bool sent = false;
+	};
+
+	// Actuator values of one command sent by a tick.
+	class Command {
+	public:
+		DeviceHandle dev;
+		CommandKind kind;
+		std::map<unsigned int, double> scalars;
+		std::map<unsigned int, std::pair<double, bool>> rotations;
+	};
+
+	Client& client;
+
+	mutable std::mutex mx;
+	std::condition_variable cond;
+	std::vector<Track> tracks;
+	std::chrono::microseconds tickInterval;
+	// Set when the ticks have to be counted from a new start.
+	bool restart = true;
+	bool running = true;
+	PatternEngineStats stats;
+	std::thread thread;
+
+	void run();
+	void evaluate(std::chrono::steady_clock::time_point now, std::vector<Command>& commands);
+	std::size_t send(std::vector<Command>& commands);
+};
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <vector>
+
+// Read position of one reader in a SensorBuffer. Start with a default constructed cursor to read everything
+// the buffer still holds.
+class SensorCursor {
+public:
+	// Sequence number of the next reading to read.
+	unsigned long long next = 0;
+	// Readings this reader lost because they were overwritten before it read them.
+	unsigned long long missed = 0;
+};
+
+// Readings taken from a SensorBuffer. Reused between reads, so reading does not allocate once its vectors
+// have grown to the buffer capacity.
+class SensorSamples {
+public:
+	// Values per reading. Readings with fewer values than the widest one are padded with zeros.
+	std::size_t width = 0;
+	// Time every reading was received.
+	std::vector<std::chrono::steady_clock::time_point> timestamps;
+	// width values per reading, one reading after the other.
+	std::vector<int> samples;
+
+	std::size_t size() const { return timestamps.size(); }
+	// Values of reading i.
+	const int* operator[](std::size_t i) const { return samples.data() + i * width; }
+};
+
+// Counters of a SensorBuffer.
+class SensorBufferStats {
+public:
+	// Readings received.
+	unsigned long long received = 0;
+	// Readings overwritten before any reader read them.
+	unsigned long long overflowed = 0;
+};
+
+// Fixed capacity ring buffer of the readings of one sensor. Timestamps and values are stored in flat arrays
+// allocated up front, a full buffer overwrites its oldest reading. Not synchronized, the owner locks.
+class SensorBuffer {
+public:
+	explicit SensorBuffer(std::size_t capacity = 256);
+
+	void push(std::chrono::steady_clock::time_point time, const std::vector<int>& data);
+	// Copies the readings after the cursor to out, replacing its contents, and moves the cursor past them.
+	// Returns the number of readings copied.
+	std::size_t read(SensorCursor& cursor, SensorSamples& out);
+
+	SensorBufferStats stats() const;
+private:
+	std::size_t capacity;
+	std::size_t width = 0;
+	// Sequence number of the next reading pushed, so also the number of readings received.
+	unsigned long long head = 0;
+	// Readings before this sequence number were read by some reader.
+	unsigned long long consumed = 0;
+	unsigned long long overflowed = 0;
+
+	std::vector<std::chrono::steady_clock::time_point> timestamps;
+	std::vector<int> samples;
+
+	void widen(std::size_t newWidth);
+};
@@ -1,7 +1,25 @@
 #include "../include/buttplugclient.h"
+#include <algorithm>
+#include <cmath>
+
+// Received frame buffers kept for reuse, and the capacity above which a buffer is freed instead.
+static const std::size_t inboundPoolSize = 64;
+static const std::size_t inboundBufferLimit = 64 * 1024;
+
+// Key of the ring buffer of a sensor in sensorBuffers, and of its reading in queuedReadings.
+static unsigned long long sensorKey(unsigned int deviceIndex, unsigned int sensorIndex) {
+	return static_cast<unsigned long long>(deviceIndex) << 32 | sensorIndex;
+}
+
+// Per-thread buffer that requests are serialized into before they are copied to the outbound queue.
+static std::string& requestBuffer() {
+	thread_local std::string buffer;
+	buffer.clear();
+	return buffer;
+}
 
 // Connection function with a function parameter which acts as a callback.
-int Client::connect(void (*callFunc)(const mhl::Messages)) {
+int Client::connect(mhl::MessageCallback callFunc) {
 	FullUrl = lUrl + ":" + std::to_string(lPort);
 
 	webSocket.setUrl(FullUrl);
@@ -32,15 +50,54 @@ int Client::connect(void (*callFunc)(const mhl::Messages)) {
 	return 0;
 }
 
+// Compatibility overload, the old callback gets the handler state by value.
+int Client::connect(void (*callFunc)(const mhl::Messages)) {
+	return connect([callFunc](const mhl::MessageEvent& event) { callFunc(event.messages()); });
+}
+
 // Websocket callback function.
 void Client::callbackFunction(const ix::WebSocketMessagePtr& msg) {
 	// If a message is received to the websocket, pass it to the message handler and notify to stop waiting.
 	if (msg->type == ix::WebSocketMessageType::Message)
 	{
+		auto received = std::chrono::steady_clock::now();
+		// Frames only pile up while the handler is busy, the others need not be looked at.
+		unsigned long long key = 0;
+		bool reading = inboundBacklog && streamedReading(msg->str, key);
 		// Mutex lock this scope.
 		std::lock_guard<std::mutex> lock{msgMx};
-		// Push message.
-		q.push(msg->str);
+		if (reading) {
+			// A newer reading supersedes the queued one of the same sensor.
+			auto it = queuedReadings.find(key);
+			if (it != queuedReadings.end()) {
+				collapsedReadings++;
+				InboundFrame& queued = q[it->second];
+				// It takes the old one's place, unless other messages were queued after it. Those still
+				// have to be handled before the newer reading, so it goes to the end instead.
+				if (it->second >= controlEnd) {
+					queued.text.assign(msg->str);
+					queued.received = received;
+					return;
+				}
+				queued.superseded = true;
+			}
+			else if (q.size() >= inboundLimit) {
+				droppedReadings++;
+				return;
+			}
+			queuedReadings[key] = q.size();
+		}
+		else controlEnd = q.size() + 1;
+		// Copy the message into a recycled buffer, which usually has the capacity for it already.
+		q.emplace_back();
+		if (!inboundPool.empty()) {
+			q.back().text.swap(inboundPool.back());
+			inboundPool.pop_back();
+		}
+		q.back().text.assign(msg->str);
+		q.back().received = received;
+		inboundHighWater = std::max(inboundHighWater, q.size());
+		inboundBacklog = true;
 		// Notify conditional variable to stop waiting.
 		cond.notify_one();
 	}
@@ -58,97 +115,904 @@ void Client::callbackFunction(const ix::WebSocketMessagePtr& msg) {
 
 	// Set atomic variable that websocket is connected once it is open.
 	if (msg->type == ix::WebSocketMessageType::Open) {
+		// Lock so the sender thread cannot miss the notification between checking and waiting.
+		std::lock_guard<std::mutex> lock{connMx};
 		wsConnected = 1;
 		condWs.notify_all();
 	}
 	
 	// Set atomic variable that websocket is not connected if socket closes.
+	// Requests still in open batches could not be sent anymore, they are aborted.
 	if (msg->type == ix::WebSocketMessageType::Close) {
 		wsConnected = 0;
+		for (auto& el : takeOpenBatches()) {
+			if (dedupEnabled) confirmCommand(el.id, false);
+			abortRequest(el.callback, el.mType);
+		}
 	}
 }
 
-// Function to start scanning in the server.
-void Client::startScan() {
-	// Mutex lock scope.
-	std::lock_guard<std::mutex> lock{msgMx};
+// Whether a frame is a lone SensorReading the server streams on its own, with Id 0, and the sensorKey of it.
+bool Client::streamedReading(const std::string& text, unsigned long long& key) {
+	unsigned int deviceIndex, sensorIndex;
+	if (!mhl::peekStreamedReading(text.data(), text.size(), deviceIndex, sensorIndex)) return false;
+	key = sensorKey(deviceIndex, sensorIndex);
+	return true;
+}
 
+// Function to start scanning in the server.
+void Client::startScan(mhl::CommandCallback callback, std::chrono::milliseconds timeout) {
 	// Get a request class from message handling header.
 	mhl::Requests req;
-	// Set the ID of message according to the message enum in message handling header.
-	req.startScanning.Id = static_cast<unsigned int>(mhl::MessageTypes::StartScanning);
-	// Set message type for the handler to recognize what message it is.
-	messageHandler.messageType = mhl::MessageTypes::StartScanning;
+	// Give the message a unique ID so its confirmation can be matched to it.
+	req.startScanning.Id = allocateId();
 
-	// Convert the returned handled request message class to json.
-	json j = json::array({ messageHandler.handleClientRequest(req) });
-	DEBUG_MSG(j);
+	// Serialize the request message class to json text.
+	std::string& payload = requestBuffer();
+	mhl::Messages::writeClientRequest(mhl::MessageTypes::StartScanning, req, payload);
+	DEBUG_MSG(payload);
 
-	// Start a thread that sends the message.
-	std::thread sendHandler(&Client::sendMessage, this, j, messageHandler.messageType);
-	sendHandler.detach();
+	// Queue the message for the sender thread.
+	queueMessage(payload, mhl::MessageTypes::StartScanning, req.startScanning.Id, callback, timeout);
 }
 
 // Function to stop scanning, same as before but different type.
-void Client::stopScan() {
-	std::lock_guard<std::mutex> lock{msgMx};
-
+void Client::stopScan(mhl::CommandCallback callback, std::chrono::milliseconds timeout) {
 	mhl::Requests req;
-	req.stopScanning.Id = static_cast<unsigned int>(mhl::MessageTypes::StopScanning);
-	messageHandler.messageType = mhl::MessageTypes::StopScanning;
+	req.stopScanning.Id = allocateId();
 
-	json j = json::array({ messageHandler.handleClientRequest(req) });
-	DEBUG_MSG(j);
+	std::string& payload = requestBuffer();
+	mhl::Messages::writeClientRequest(mhl::MessageTypes::StopScanning, req, payload);
+	DEBUG_MSG(payload);
 
-	std::thread sendHandler(&Client::sendMessage, this, j, messageHandler.messageType);
-	sendHandler.detach();
+	queueMessage(payload, mhl::MessageTypes::StopScanning, req.stopScanning.Id, callback, timeout);
 }
 
 // Function to get device list, same as before but different type.
-void Client::requestDeviceList() {
-	std::lock_guard<std::mutex> lock{msgMx};
-
+void Client::requestDeviceList(mhl::CommandCallback callback, std::chrono::milliseconds timeout) {
 	mhl::Requests req;
-	req.requestDeviceList.Id = static_cast<unsigned int>(mhl::MessageTypes::RequestDeviceList);
-	messageHandler.messageType = mhl::MessageTypes::RequestDeviceList;
+	req.requestDeviceList.Id = allocateId();
 
-	json j = json::array({ messageHandler.handleClientRequest(req) });
-	DEBUG_MSG(j);
+	std::string& payload = requestBuffer();
+	mhl::Messages::writeClientRequest(mhl::MessageTypes::RequestDeviceList, req, payload);
+	DEBUG_MSG(payload);
 
-	std::thread sendHandler(&Client::sendMessage, this, j, messageHandler.messageType);
-	sendHandler.detach();
+	queueMessage(payload, mhl::MessageTypes::RequestDeviceList, req.requestDeviceList.Id, callback, timeout);
 }
 
 // Function to send RequestServerInfo, same as before but different type.
 void Client::connectServer() {
-	std::lock_guard<std::mutex> lock{msgMx};
-
 	mhl::Requests req;
-	req.requestServerInfo.Id = static_cast<unsigned int>(mhl::MessageTypes::RequestServerInfo);
+	req.requestServerInfo.Id = allocateId();
 	req.requestServerInfo.ClientName = "Testing";
 	req.requestServerInfo.MessageVersion = 3;
-	messageHandler.messageType = mhl::MessageTypes::RequestServerInfo;
 
-	json j = json::array({ messageHandler.handleClientRequest(req) });
-	DEBUG_MSG(j);
+	std::string& payload = requestBuffer();
+	mhl::Messages::writeClientRequest(mhl::MessageTypes::RequestServerInfo, req, payload);
+	DEBUG_MSG(payload);
+
+	queueMessage(payload, mhl::MessageTypes::RequestServerInfo, req.requestServerInfo.Id);
+}
+
+// Function that queues a message for the sender thread. Messages are written in the order they are queued.
+// Also registers the request in the pending table until its confirmation arrives.
+void Client::queueMessage(const std::string& payload, mhl::MessageTypes mType, unsigned int id, mhl::CommandCallback callback, std::chrono::milliseconds timeout, int deviceIndex) {
+	// Drop the message right away if no connection process is started, it would never be sent.
+	if (!isConnecting && !wsConnected) {
+		DEBUG_MSG("Client is not connected and not started, start before sending a message");
+		abortRequest(callback, mType);
+		return;
+	}
+
+	if (addToBatch(payload, mType, id, callback, timeout, deviceIndex)) return;
+	auto deadline = std::chrono::steady_clock::time_point::max();
+	if (timeout.count() > 0) deadline = std::chrono::steady_clock::now() + timeout;
+	registerRequest(mType, id, callback, deadline, deviceIndex);
+
+	{
+		std::lock_guard<std::mutex> lock{sendMx};
+		OutboundMessage out;
+		out.payload = payload;
+		out.mType = mType;
+		out.Id = id;
+		out.aborted = false;
+		out.deviceIndex = deviceIndex;
+		sendQueue.push_back(std::move(out));
+	}
+	condSend.notify_one();
+}
+
+// Like queueMessage, but for StopDeviceCmd and StopAllDevices, with a deviceIndex of -1 for all devices.
+// The stop goes to the priority lane, and the actuator commands of its devices still in the outbound queue
+// are aborted, since they were requested before the stop and would restart the devices after it.
+void Client::queueStop(const std::string& payload, mhl::MessageTypes mType, unsigned int id, mhl::CommandCallback callback, std::chrono::milliseconds timeout, int deviceIndex) {
+	if (!isConnecting && !wsConnected) {
+		DEBUG_MSG("Client is not connected and not started, start before sending a message");
+		abortRequest(callback, mType);
+		return;
+	}
+
+	// Inside a batch the stop keeps its place, the batch is sent in order anyway.
+	if (addToBatch(payload, mType, id, callback, timeout, deviceIndex)) return;
+	auto deadline = std::chrono::steady_clock::time_point::max();
+	if (timeout.count() > 0) deadline = std::chrono::steady_clock::now() + timeout;
+	registerRequest(mType, id, callback, deadline, deviceIndex);
+
+	std::vector<std::pair<mhl::MessageTypes, unsigned int>> purged;
+	{
+		std::lock_guard<std::mutex> lock{sendMx};
+		auto out = sendQueue.begin();
+		for (auto it = sendQueue.begin(); it != sendQueue.end(); ++it) {
+			// Committed batches are left alone, they are sent as a whole.
+			bool actuator = it->mType == mhl::MessageTypes::ScalarCmd || it->mType == mhl::MessageTypes::LinearCmd || it->mType == mhl::MessageTypes::RotateCmd;
+			if (actuator && !it->aborted && it->parts.empty() && (deviceIndex < 0 || it->deviceIndex == deviceIndex)) {
+				purged.push_back(std::make_pair(it->mType, it->Id));
+				continue;
+			}
+			if (out != it) *out = std::move(*it);
+			++out;
+		}
+		sendQueue.erase(out, sendQueue.end());
+		schedulerStats.dropped += purged.size();
+
+		OutboundMessage stop;
+		stop.payload = payload;
+		stop.mType = mType;
+		stop.Id = id;
+		stop.aborted = false;
+		stop.deviceIndex = deviceIndex;
+		stopQueue.push_back(std::move(stop));
+	}
+	condSend.notify_one();
+	if (purged.empty()) return;
+
+	// The purged requests will never be answered, take them out of the pending table.
+	std::vector<std::pair<mhl::CommandCallback, mhl::MessageTypes>> callbacks;
+	{
+		std::lock_guard<std::mutex> lock{pendingMx};
+		for (auto& el : purged) {
+			auto it = pendingRequests.find(el.second);
+			if (it == pendingRequests.end()) continue;
+			if (it->second.callback) callbacks.push_back(std::make_pair(it->second.callback, el.first));
+			pendingRequests.erase(it);
+		}
+	}
+	if (dedupEnabled)
+		for (auto& el : purged) confirmCommand(el.second, false);
+	for (auto& el : callbacks) abortRequest(el.first, el.second);
+}
+
+// Appends a request to the batch of the calling thread, if it has one open. The request then waits for commitBatch,
+// which registers it.
+bool Client::addToBatch(const std::string& payload, mhl::MessageTypes mType, unsigned int id, mhl::CommandCallback callback, std::chrono::milliseconds timeout, int deviceIndex) {
+	std::lock_guard<std::mutex> lock{batchMx};
+	auto it = batches.find(std::this_thread::get_id());
+	if (it == batches.end()) return false;
+	if (!it->second.requests.empty()) it->second.payload.push_back(',');
+	it->second.payload.append(payload);
+	BatchedRequest request;
+	request.mType = mType;
+	request.id = id;
+	request.callback = callback;
+	request.timeout = timeout;
+	request.deviceIndex = deviceIndex;
+	it->second.requests.push_back(std::move(request));
+	return true;
+}
+
+// Empties the open batches of all threads and returns their requests, which were never registered.
+// The batches stay open, so their commitBatch calls still match.
+std::vector<BatchedRequest> Client::takeOpenBatches() {
+	std::vector<BatchedRequest> requests;
+	std::lock_guard<std::mutex> lock{batchMx};
+	for (auto& el : batches) {
+		for (auto& request : el.second.requests) requests.push_back(std::move(request));
+		el.second.requests.clear();
+		el.second.payload.clear();
+	}
+	return requests;
+}
+
+// Completes a request that could not be sent.
+void Client::abortRequest(mhl::CommandCallback callback, mhl::MessageTypes mType) {
+	completeRequest(callback, mType, mhl::CommandStatus::Aborted);
+}
+
+// Completes a request without sending it. The callback is run from the sender thread,
+// so it never runs while the caller still holds a library lock.
+void Client::completeRequest(mhl::CommandCallback callback, mhl::MessageTypes mType, mhl::CommandStatus status) {
+	if (!callback) return;
+	{
+		std::lock_guard<std::mutex> lock{sendMx};
+		OutboundMessage out;
+		out.mType = mType;
+		out.Id = 0;
+		out.callback = callback;
+		out.aborted = true;
+		out.status = status;
+		sendQueue.push_back(std::move(out));
+	}
+	condSend.notify_one();
+}
+
+// Registers a request in the pending table until its confirmation arrives. A deadline of
+// time_point::max() means the request does not time out.
+void Client::registerRequest(mhl::MessageTypes mType, unsigned int id, mhl::CommandCallback callback, std::chrono::steady_clock::time_point deadline, int deviceIndex) {
+	mhl::PendingRequest pending;
+	pending.messageType = mType;
+	pending.deviceIndex = deviceIndex;
+	pending.timestamp = std::chrono::steady_clock::now();
+	pending.callback = callback;
+	pending.deadline = deadline;
+
+	std::lock_guard<std::mutex> lock{pendingMx};
+	pendingRequests[id] = std::move(pending);
+	if (deadline != std::chrono::steady_clock::time_point::max()) {
+		pendingDeadlines.push(std::make_pair(deadline, id));
+		// Wake the message handler if it has to wait for an earlier deadline now.
+		if (pendingDeadlines.top().second == id) {
+			std::lock_guard<std::mutex> msgLock{msgMx};
+			deadlinesChanged = true;
+			cond.notify_one();
+		}
+	}
+}
+
+// Whether the calling thread has a batch open.
+bool Client::batchOpen() {
+	std::lock_guard<std::mutex> lock{batchMx};
+	return batches.count(std::this_thread::get_id()) > 0;
+}
+
+// Overwrites the waiting values of the actuators in update, and adds the others.
+template<typename T>
+static void mergeActuators(std::vector<T>& waiting, const std::vector<T>& update) {
+	for (auto& el : update) {
+		auto it = std::find_if(waiting.begin(), waiting.end(), [&el](const T& w) { return w.Index == el.Index; });
+		if (it != waiting.end()) *it = el;
+		else waiting.push_back(el);
+	}
+}
+
+// Hands an actuator command (ScalarCmd, LinearCmd or RotateCmd in req) to the scheduler, or queues it right away
+// when scheduling is disabled. gap is the device's DeviceMessageTimingGap in milliseconds.
+void Client::submitCommand(mhl::Requests& req, mhl::MessageTypes mType, unsigned int gap, mhl::CommandCallback callback, std::chrono::milliseconds timeout) {
+	if (!schedulingEnabled || batchOpen()) {
+		unsigned int id = allocateId();
+		if (mType == mhl::MessageTypes::ScalarCmd) req.scalarCmd.Id = id;
+		else if (mType == mhl::MessageTypes::LinearCmd) req.linearCmd.Id = id;
+		else req.rotateCmd.Id = id;
+		if (dedupEnabled) {
+			if (mType == mhl::MessageTypes::ScalarCmd) trackCommand(req.scalarCmd);
+			else if (mType == mhl::MessageTypes::RotateCmd) trackCommand(req.rotateCmd);
+		}
+
+		std::string& payload = requestBuffer();
+		mhl::Messages::writeClientRequest(mType, req, payload);
+		DEBUG_MSG(payload);
+
+		int deviceIndex = mType == mhl::MessageTypes::ScalarCmd ? req.scalarCmd.DeviceIndex :
+			mType == mhl::MessageTypes::LinearCmd ? req.linearCmd.DeviceIndex : req.rotateCmd.DeviceIndex;
+		queueMessage(payload, mType, id, callback, timeout, deviceIndex);
+		return;
+	}
+	// Same as queueMessage, a command that would never be sent is aborted right away.
+	if (!isConnecting && !wsConnected) {
+		DEBUG_MSG("Client is not connected and not started, start before sending a message");
+		abortRequest(callback, mType);
+		return;
+	}
+
+	auto now = std::chrono::steady_clock::now();
+	{
+		std::lock_guard<std::mutex> lock{sendMx};
+		unsigned int deviceIndex = mType == mhl::MessageTypes::ScalarCmd ? req.scalarCmd.DeviceIndex :
+			mType == mhl::MessageTypes::LinearCmd ? req.linearCmd.DeviceIndex : req.rotateCmd.DeviceIndex;
+		DeviceSchedule& schedule = schedules[deviceIndex];
+		schedule.gap = std::chrono::milliseconds(gap);
+		// A device that was idle for a whole gap is due right away.
+		if (!schedule.pending()) schedule.due = std::max(now, schedule.lastSent + schedule.gap);
+
+		int slot = 0;
+		if (mType == mhl::MessageTypes::ScalarCmd) {
+			schedule.scalarCmd.DeviceIndex = deviceIndex;
+			mergeActuators(schedule.scalarCmd.Scalars, req.scalarCmd.Scalars);
+		}
+		else if (mType == mhl::MessageTypes::LinearCmd) {
+			slot = 1;
+			schedule.linearCmd.DeviceIndex = deviceIndex;
+			mergeActuators(schedule.linearCmd.Vectors, req.linearCmd.Vectors);
+		}
+		else {
+			slot = 2;
+			schedule.rotateCmd.DeviceIndex = deviceIndex;
+			mergeActuators(schedule.rotateCmd.Rotations, req.rotateCmd.Rotations);
+		}
+
+		ScheduledCommand& command = schedule.commands[slot];
+		if (command.pending) {
+			schedulerStats.coalesced++;
+		}
+		else {
+			command.pending = true;
+			command.mType = mType;
+			command.deadline = std::chrono::steady_clock::time_point::max();
+		}
+		if (callback) command.callbacks.push_back(callback);
+		if (timeout.count() > 0) command.deadline = std::min(command.deadline, now + timeout);
+		schedulerStats.submitted++;
+	}
+	condSend.notify_one();
+}
+
+// Drops the waiting commands of a device, or of all devices, since a stop command supersedes them.
+// Their callbacks are completed as aborted.
+void Client::dropScheduledCommands(bool allDevices, unsigned int deviceIndex) {
+	std::vector<std::pair<mhl::CommandCallback, mhl::MessageTypes>> callbacks;
+	{
+		std::lock_guard<std::mutex> lock{sendMx};
+		for (auto& el : schedules) {
+			if (!allDevices && el.first != deviceIndex) continue;
+			DeviceSchedule& schedule = el.second;
+			for (auto& command : schedule.commands) {
+				if (!command.pending) continue;
+				schedulerStats.dropped++;
+				for (auto& callback : command.callbacks) callbacks.push_back(std::make_pair(callback, command.mType));
+				command.callbacks.clear();
+				command.pending = false;
+			}
+			schedule.scalarCmd.Scalars.clear();
+			schedule.linearCmd.Vectors.clear();
+			schedule.rotateCmd.Rotations.clear();
+		}
+	}
+	for (auto& el : callbacks) abortRequest(el.first, el.second);
+}
+
+// Finds the earliest time a waiting command is due. Called with sendMx held.
+bool Client::nextDueTime(std::chrono::steady_clock::time_point& next) {
+	bool found = false;
+	for (auto& el : schedules) {
+		if (!el.second.pending()) continue;
+		if (!found || el.second.due < next) next = el.second.due;
+		found = true;
+	}
+	return found;
+}
+
+// Moves the commands of all devices that are due out of the scheduler, grouped by device. They count as
+// scheduled until registerDueCommands has registered them. Called by the sender thread with sendMx held.
+void Client::takeDueCommands(std::vector<DueCommand>& due) {
+	auto now = std::chrono::steady_clock::now();
+	for (auto& el : schedules) {
+		DeviceSchedule& schedule = el.second;
+		if (!schedule.pending() || schedule.due > now) continue;
+
+		for (int slot = 0; slot < 3; slot++) {
+			ScheduledCommand& command = schedule.commands[slot];
+			if (!command.pending) continue;
+
+			due.push_back(DueCommand());
+			DueCommand& out = due.back();
+			out.deviceIndex = el.first;
+			// Swap the actuator vectors out, so both sides keep their capacity.
+			if (slot == 0) {
+				out.scalarCmd.DeviceIndex = el.first;
+				std::swap(out.scalarCmd.Scalars, schedule.scalarCmd.Scalars);
+			}
+			else if (slot == 1) {
+				out.linearCmd.DeviceIndex = el.first;
+				std::swap(out.linearCmd.Vectors, schedule.linearCmd.Vectors);
+			}
+			else {
+				out.rotateCmd.DeviceIndex = el.first;
+				std::swap(out.rotateCmd.Rotations, schedule.rotateCmd.Rotations);
+			}
+			std::swap(out.command.callbacks, command.callbacks);
+			out.command.mType = command.mType;
+			out.command.deadline = command.deadline;
+			command.pending = false;
+			unregisteredCommands++;
+			schedulerStats.sent++;
+		}
+		schedule.lastSent = now;
+	}
+}
+
+// Gives the commands taken from the scheduler their IDs and registers them. Sender thread only.
+void Client::registerDueCommands(std::vector<DueCommand>& due) {
+	if (due.empty()) return;
+	for (auto& cmd : due) {
+		unsigned int id = allocateId();
+		cmd.scalarCmd.Id = id;
+		cmd.linearCmd.Id = id;
+		cmd.rotateCmd.Id = id;
+
+		// Merged requests complete together with the command that carried their values.
+		mhl::CommandCallback callback;
+		if (cmd.command.callbacks.size() == 1) {
+			callback = cmd.command.callbacks[0];
+		}
+		else if (cmd.command.callbacks.size() > 1) {
+			std::vector<mhl::CommandCallback> callbacks = cmd.command.callbacks;
+			callback = [callbacks](const mhl::CommandResult& result) {
+				for (auto& cb : callbacks) cb(result);
+			};
+		}
+		registerRequest(cmd.command.mType, id, callback, cmd.command.deadline, cmd.deviceIndex);
+	}
+
+	// Now the requests are pending, waitForEmptyConfirmQueue can stop counting the commands.
+	{
+		std::lock_guard<std::mutex> lock{pendingMx};
+		std::lock_guard<std::mutex> sendLock{sendMx};
+		unregisteredCommands -= due.size();
+	}
+	condQueue.notify_all();
+}
+
+// Appends a registered command taken from the scheduler to the frame. Sender thread only.
+void Client::appendDueCommand(DueCommand& cmd) {
+	if (!frameParts.empty()) frameBuffer.push_back(',');
+	if (cmd.command.mType == mhl::MessageTypes::ScalarCmd) {
+		if (dedupEnabled) trackCommand(cmd.scalarCmd);
+		msg::to_buffer(frameBuffer, cmd.scalarCmd);
+		frameParts.push_back(std::make_pair(cmd.command.mType, cmd.scalarCmd.Id));
+	}
+	else if (cmd.command.mType == mhl::MessageTypes::LinearCmd) {
+		msg::to_buffer(frameBuffer, cmd.linearCmd);
+		frameParts.push_back(std::make_pair(cmd.command.mType, cmd.linearCmd.Id));
+	}
+	else {
+		if (dedupEnabled) trackCommand(cmd.rotateCmd);
+		msg::to_buffer(frameBuffer, cmd.rotateCmd);
+		frameParts.push_back(std::make_pair(cmd.command.mType, cmd.rotateCmd.Id));
+	}
+}
+
+// Whether commands are waiting in the scheduler.
+bool Client::commandsScheduled() {
+	std::lock_guard<std::mutex> lock{sendMx};
+	std::chrono::steady_clock::time_point next;
+	return unregisteredCommands > 0 || nextDueTime(next);
+}
+
+void Client::beginBatch() {
+	std::lock_guard<std::mutex> lock{batchMx};
+	batches[std::this_thread::get_id()].depth++;
+}
+
+void Client::commitBatch() {
+	std::lock_guard<std::mutex> lock{batchMx};
+	auto it = batches.find(std::this_thread::get_id());
+	if (it == batches.end() || --it->second.depth > 0) return;
+
+	std::vector<BatchedRequest>& requests = it->second.requests;
+	if (!requests.empty()) {
+		// The requests become pending, and their timeouts start, only now that they are about to be sent.
+		OutboundMessage out;
+		auto now = std::chrono::steady_clock::now();
+		for (auto& el : requests) {
+			auto deadline = std::chrono::steady_clock::time_point::max();
+			if (el.timeout.count() > 0) deadline = now + el.timeout;
+			registerRequest(el.mType, el.id, el.callback, deadline, el.deviceIndex);
+			out.parts.push_back(std::make_pair(el.mType, el.id));
+		}
+		{
+			std::lock_guard<std::mutex> sendLock{sendMx};
+			out.payload = std::move(it->second.payload);
+			out.mType = requests.front().mType;
+			out.Id = requests.front().id;
+			out.aborted = false;
+			sendQueue.push_back(std::move(out));
+		}
+		condSend.notify_one();
+	}
+	batches.erase(it);
+}
+
+void Client::setAutoBatching(std::chrono::milliseconds window, std::size_t maxMessages) {
+	std::lock_guard<std::mutex> lock{sendMx};
+	autoBatchWindow = window;
+	autoBatchSize = maxMessages;
+}
+
+void Client::setCommandScheduling(bool enabled) {
+	schedulingEnabled = enabled;
+}
+
+void Client::setCommandDeduplication(bool enabled) {
+	std::lock_guard<std::mutex> lock{dedupMx};
+	dedupEnabled = enabled;
+	actuatorValues.clear();
+	unconfirmedCommands.clear();
+}
+
+// Rounds a value to the steps of its actuator, values of actuators without a StepCount stay as they are.
+static double quantize(double value, const std::vector<DeviceCmdAttr>& actuators, unsigned int index) {
+	unsigned int steps = index < actuators.size() ? actuators[index].StepCount : 0;
+	if (steps == 0) return value;
+	return std::round(std::min(std::max(value, 0.0), 1.0) * steps) / steps;
+}
+
+static double actuatorValue(const Scalar& el) { return el.ScalarVal; }
+static double actuatorValue(const Rotate& el) { return el.Clockwise ? el.Speed : -el.Speed; }
+
+// Leaves out the actuators whose value the server confirmed last and records the others as sent.
+// Returns how many were left out.
+template<typename T>
+static std::size_t dropUnchanged(std::vector<ActuatorValue>& known, std::vector<T>& actuators) {
+	std::size_t dropped = 0;
+	auto out = actuators.begin();
+	for (auto it = actuators.begin(); it != actuators.end(); ++it) {
+		double value = actuatorValue(*it);
+		if (it->Index >= known.size()) known.resize(it->Index + 1);
+		ActuatorValue& state = known[it->Index];
+		if (state.known && state.confirmed && state.value == value) {
+			dropped++;
+			continue;
+		}
+		state.known = true;
+		state.confirmed = false;
+		state.value = value;
+		if (out != it) *out = std::move(*it);
+		++out;
+	}
+	actuators.erase(out, actuators.end());
+	return dropped;
+}
+
+// Quantizes the values of a ScalarCmd or RotateCmd in req and leaves out the unchanged ones. Returns true
+// if none are left, so the command is not sent. Called with deviceMx held.
+bool Client::suppressUnchanged(const DeviceFeatures& features, mhl::MessageTypes mType, mhl::Requests& req) {
+	bool rotate = mType == mhl::MessageTypes::RotateCmd;
+	if (rotate) {
+		for (auto& el : req.rotateCmd.Rotations) el.Speed = quantize(el.Speed, features[CommandKind::Rotate], el.Index);
+	}
+	else {
+		for (auto& el : req.scalarCmd.Scalars) el.ScalarVal = quantize(el.ScalarVal, features[CommandKind::Scalar], el.Index);
+	}
+	if (rotate ? req.rotateCmd.Rotations.empty() : req.scalarCmd.Scalars.empty()) return false;
+
+	std::lock_guard<std::mutex> lock{dedupMx};
+	DeviceActuatorValues& device = actuatorValues[rotate ? req.rotateCmd.DeviceIndex : req.scalarCmd.DeviceIndex];
+	// A device that took the index of a removed one starts over.
+	if (device.generation != features.generation) {
+		device = DeviceActuatorValues();
+		device.generation = features.generation;
+	}
+	bool empty;
+	if (rotate) {
+		suppressedValues += dropUnchanged(device.rotations, req.rotateCmd.Rotations);
+		empty = req.rotateCmd.Rotations.empty();
+	}
+	else {
+		suppressedValues += dropUnchanged(device.scalars, req.scalarCmd.Scalars);
+		empty = req.scalarCmd.Scalars.empty();
+	}
+	if (empty) suppressedCommands++;
+	return empty;
+}
+
+// Remembers the values of a command that got its ID, until the server answers it.
+void Client::trackCommand(const msg::ScalarCmd& cmd) {
+	UnconfirmedCommand unconfirmed;
+	unconfirmed.deviceIndex = cmd.DeviceIndex;
+	unconfirmed.rotate = false;
+	for (auto& el : cmd.Scalars) unconfirmed.values.push_back(std::make_pair(el.Index, actuatorValue(el)));
+	std::lock_guard<std::mutex> lock{dedupMx};
+	unconfirmedCommands[cmd.Id] = std::move(unconfirmed);
+}
+
+void Client::trackCommand(const msg::RotateCmd& cmd) {
+	UnconfirmedCommand unconfirmed;
+	unconfirmed.deviceIndex = cmd.DeviceIndex;
+	unconfirmed.rotate = true;
+	for (auto& el : cmd.Rotations) unconfirmed.values.push_back(std::make_pair(el.Index, actuatorValue(el)));
+	std::lock_guard<std::mutex> lock{dedupMx};
+	unconfirmedCommands[cmd.Id] = std::move(unconfirmed);
+}
+
+// Marks the values of an answered command as confirmed, or forgets them if it failed, unless a later
+// command changed them meanwhile.
+void Client::confirmCommand(unsigned int id, bool ok) {
+	std::lock_guard<std::mutex> lock{dedupMx};
+	auto it = unconfirmedCommands.find(id);
+	if (it == unconfirmedCommands.end()) return;
+	auto device = actuatorValues.find(it->second.deviceIndex);
+	if (device != actuatorValues.end()) {
+		std::vector<ActuatorValue>& known = it->second.rotate ? device->second.rotations : device->second.scalars;
+		for (auto& el : it->second.values) {
+			if (el.first >= known.size() || !known[el.first].known || known[el.first].value != el.second) continue;
+			if (ok) known[el.first].confirmed = true;
+			else known[el.first].known = false;
+		}
+	}
+	unconfirmedCommands.erase(it);
+}
 
-	std::thread sendHandler(&Client::sendMessage, this, j, messageHandler.messageType);
-	sendHandler.detach();
+// Forgets the actuator values of a device, or of all devices, after a stop.
+void Client::forgetActuatorValues(bool allDevices, unsigned int deviceIndex) {
+	std::lock_guard<std::mutex> lock{dedupMx};
+	if (allDevices) actuatorValues.clear();
+	else actuatorValues.erase(deviceIndex);
 }
 
-// Function that actually sends the message.
-void Client::sendMessage(json msg, mhl::MessageTypes mType) {
+ClientStats Client::getStats() {
+	ClientStats result;
+	stats.copyTo(result);
+	{
+		std::lock_guard<std::mutex> lock{pendingMx};
+		result.pendingRequests = pendingRequests.size();
+	}
+	{
+		std::lock_guard<std::mutex> lock{msgMx};
+		result.inboundQueued = q.size();
+		result.inboundHighWater = inboundHighWater;
+		result.collapsedSensorReadings = collapsedReadings;
+		result.droppedSensorReadings = droppedReadings;
+	}
+	{
+		std::lock_guard<std::mutex> lock{sendMx};
+		result.outboundQueued = sendQueue.size() + stopQueue.size();
+		result.coalescedCommands = schedulerStats.coalesced;
+		result.droppedCommands = schedulerStats.dropped;
+	}
+	{
+		std::lock_guard<std::mutex> lock{dedupMx};
+		result.suppressedValues = suppressedValues;
+		result.suppressedCommands = suppressedCommands;
+	}
+	{
+		std::lock_guard<std::mutex> lock{sensorMx};
+		for (auto& el : sensorBuffers) result.overflowedSensorReadings += el.second.stats().overflowed;
+	}
+	result.droppedLogEntries = logInfo.droppedEntries();
+	return result;
+}
+
+SchedulerStats Client::getSchedulerStats() {
+	std::lock_guard<std::mutex> lock{sendMx};
+	return schedulerStats;
+}
+
+// Removes a request from the pending table and queues its completion callback, if it has one.
+// Called by the message handler thread with pendingMx held, the callbacks are run by runCompletions
+// once the lock is released.
+void Client::finishRequest(std::unordered_map<unsigned int, mhl::PendingRequest>::iterator it, mhl::CommandStatus status) {
+	if (status == mhl::CommandStatus::Timeout) {
+		stats.timeout(it->second.messageType);
+	}
+	// Aborted requests were never answered, so they have no latency.
+	else if (status != mhl::CommandStatus::Aborted) {
+		if (status == mhl::CommandStatus::Error) stats.error(it->second.messageType);
+		// Requests answered before the sender thread marked them sent count from when they were issued.
+		auto sent = it->second.sentAt != std::chrono::steady_clock::time_point() ? it->second.sentAt : it->second.timestamp;
+		stats.latency(it->second.messageType, frameTime - sent);
+		// Stops count from the call, so the time they waited behind other requests is included.
+		if (status == mhl::CommandStatus::Ok && (it->second.messageType == mhl::MessageTypes::StopDeviceCmd || it->second.messageType == mhl::MessageTypes::StopAllDevices))
+			stats.stopLatency(frameTime - it->second.timestamp);
+	}
+	if (dedupEnabled && (it->second.messageType == mhl::MessageTypes::ScalarCmd || it->second.messageType == mhl::MessageTypes::RotateCmd))
+		confirmCommand(it->first, status == mhl::CommandStatus::Ok);
+	if (it->second.callback) {
+		mhl::CommandResult result;
+		result.status = status;
+		result.messageType = it->second.messageType;
+		result.Id = it->first;
+		if (status == mhl::CommandStatus::Error) result.error = messageHandler.error;
+		if (status == mhl::CommandStatus::Ok && messageHandler.messageType == mhl::MessageTypes::SensorReading)
+			result.sensorReading = messageHandler.sensorReading;
+		completedRequests.push_back(std::make_pair(it->second.callback, result));
+	}
+	pendingRequests.erase(it);
+}
+
+// Times out pending requests whose deadline has passed. Called with pendingMx held.
+void Client::expireRequests() {
+	auto now = std::chrono::steady_clock::now();
+	bool expired = false;
+	while (!pendingDeadlines.empty() && pendingDeadlines.top().first <= now) {
+		unsigned int id = pendingDeadlines.top().second;
+		pendingDeadlines.pop();
+		// The request may have been confirmed already, in which case there is nothing to do.
+		auto it = pendingRequests.find(id);
+		if (it != pendingRequests.end()) {
+			if (logging) logInfo.logErrorMessage(it->second.messageType, id, "Timeout", it->second.deviceIndex, now - it->second.timestamp);
+			finishRequest(it, mhl::CommandStatus::Timeout);
+			expired = true;
+		}
+	}
+	if (expired) condQueue.notify_all();
+}
+
+// Runs the completion callbacks collected by finishRequest. Must be called without holding a library lock.
+void Client::runCompletions() {
+	// Swapped out under the lock since the sender thread completes requests too. Each thread keeps its
+	// own vector, so the capacity is reused.
+	thread_local std::vector<std::pair<mhl::CommandCallback, mhl::CommandResult>> completed;
+	{
+		std::lock_guard<std::mutex> lock{pendingMx};
+		completed.swap(completedRequests);
+	}
+	for (auto& el : completed)
+		el.first(el.second);
+	completed.clear();
+}
+
+// Completes the requests of a frame that cannot be sent as aborted. Sender thread only.
+void Client::abortFrame() {
+	{
+		std::lock_guard<std::mutex> lock{pendingMx};
+		for (auto& el : frameParts) {
+			auto it = pendingRequests.find(el.second);
+			if (it != pendingRequests.end()) finishRequest(it, mhl::CommandStatus::Aborted);
+		}
+		condQueue.notify_all();
+	}
+	runCompletions();
+}
+
+// Creates a completion callback that fulfils the promise behind the given future.
+mhl::CommandCallback Client::makePromiseCallback(std::future<mhl::CommandResult>& future) {
+	std::shared_ptr<std::promise<mhl::CommandResult>> promise = std::make_shared<std::promise<mhl::CommandResult>>();
+	future = promise->get_future();
+	return [promise](const mhl::CommandResult& result) { promise->set_value(result); };
+}
+
+// Allocates a unique, increasing message ID. ID 0 is reserved for messages the server sends on its own.
+unsigned int Client::allocateId() {
+	unsigned int id = nextMessageId++;
+	if (id == 0) id = nextMessageId++;
+	return id;
+}
+
+// Sender thread function, pops queued messages and sends them, along with the scheduled commands that are due.
+// Every message, and the due commands of each device, get their own frame unless auto batching is enabled. Waiting stops are sent before anything else.
+void Client::sendHandling() {
+	std::vector<DueCommand> due;
+	std::vector<OutboundMessage> messages;
+	while (true) {
+		bool exiting = false;
+		bool batching = false;
+		std::vector<std::pair<mhl::CommandCallback, mhl::MessageTypes>> dropped;
+		{
+			std::unique_lock<std::mutex> lock{sendMx};
+			// Wait for a queued message, or until the earliest scheduled command is due.
+			while (sendQueue.empty() && stopQueue.empty() && !stopRequested) {
+				std::chrono::steady_clock::time_point next;
+				bool scheduled = nextDueTime(next);
+				if (scheduled && next <= std::chrono::steady_clock::now()) break;
+				if (scheduled) condSend.wait_until(lock, next);
+				else condSend.wait(lock);
+			}
+
+			// On shutdown the queue is drained first, so a final stop command still goes out.
+			// Commands still waiting in the scheduler are dropped.
+			if (stopRequested && sendQueue.empty() && stopQueue.empty()) {
+				for (auto& el : schedules)
+					for (auto& command : el.second.commands)
+						for (auto& callback : command.callbacks) dropped.push_back(std::make_pair(callback, command.mType));
+				schedules.clear();
+				exiting = true;
+			}
+			else {
+				// Only batch once the handshake is done, RequestServerInfo has to go out on its own.
+				batching = (autoBatchWindow.count() > 0 || autoBatchSize > 0) && clientConnected;
+				if (!stopQueue.empty()) {
+					for (auto& el : stopQueue) messages.push_back(std::move(el));
+					stopQueue.clear();
+				}
+				else {
+					takeDueCommands(due);
+					takeMessages(lock, batching, due.size(), messages);
+				}
+			}
+		}
+		if (exiting) {
+			for (auto& el : dropped) {
+				mhl::CommandResult result;
+				result.status = mhl::CommandStatus::Aborted;
+				result.messageType = el.second;
+				el.first(result);
+			}
+			return;
+		}
+
+		// The due commands of a device share a frame, so it gets one frame per timing gap.
+		registerDueCommands(due);
+		beginFrame();
+		for (std::size_t i = 0; i < due.size(); i++) {
+			if (!batching && !frameParts.empty() && due[i].deviceIndex != due[i - 1].deviceIndex) {
+				sendFrame();
+				beginFrame();
+			}
+			appendDueCommand(due[i]);
+		}
+		for (auto& el : messages) {
+			// Requests that could not be sent only get their callback run.
+			if (el.aborted) {
+				mhl::CommandResult result;
+				result.status = el.status;
+				result.messageType = el.mType;
+				el.callback(result);
+				continue;
+			}
+			if (!batching && !frameParts.empty()) {
+				sendFrame();
+				beginFrame();
+			}
+			appendMessage(el);
+		}
+		if (!frameParts.empty()) sendFrame();
+		due.clear();
+		messages.clear();
+	}
+}
+
+// Moves queued messages to messages: one, or with auto batching everything queued within the batch window,
+// up to the batch size counting the taken scheduled commands. Called by the sender thread with sendMx held.
+void Client::takeMessages(std::unique_lock<std::mutex>& lock, bool batching, std::size_t taken, std::vector<OutboundMessage>& messages) {
+	if (sendQueue.empty()) return;
+	if (!batching) {
+		messages.push_back(std::move(sendQueue.front()));
+		sendQueue.pop_front();
+		return;
+	}
+
+	std::size_t limit = autoBatchSize > 0 ? autoBatchSize : static_cast<std::size_t>(-1);
+	auto windowEnd = std::chrono::steady_clock::now() + autoBatchWindow;
+	while (true) {
+		// A stop queued meanwhile must not wait for the window, nor go after requests queued behind it.
+		if (!stopQueue.empty()) return;
+		while (!sendQueue.empty() && (messages.empty() || taken + messages.size() < limit)) {
+			messages.push_back(std::move(sendQueue.front()));
+			sendQueue.pop_front();
+		}
+		if (taken + messages.size() >= limit || stopRequested) return;
+		if (std::chrono::steady_clock::now() >= windowEnd) return;
+		condSend.wait_until(lock, windowEnd);
+	}
+}
+
+// Starts a new frame in frameBuffer. Sender thread only.
+void Client::beginFrame() {
+	frameBuffer.clear();
+	frameBuffer.push_back('[');
+	frameParts.clear();
+}
+
+// Appends a queued message, which may hold a whole batch, to the frame. Sender thread only.
+void Client::appendMessage(const OutboundMessage& out) {
+	if (!frameParts.empty()) frameBuffer.push_back(',');
+	frameBuffer.append(out.payload);
+	if (out.parts.empty()) frameParts.push_back(std::make_pair(out.mType, out.Id));
+	else frameParts.insert(frameParts.end(), out.parts.begin(), out.parts.end());
+}
+
+// Function that actually sends the frame, only called from the sender thread.
+void Client::sendFrame() {
+	// Close the array the protocol expects.
+	frameBuffer.push_back(']');
+	mhl::MessageTypes mType = frameParts.front().first;
+
 	// First check whether a connection process is started.
 	if (!isConnecting && !wsConnected) {
 		DEBUG_MSG("Client is not connected and not started, start before sending a message");
+		abortFrame();
 		return;
 	}
 	// If started, wait for the socket to connect first.
 	if (!wsConnected && isConnecting) {
-		std::unique_lock<std::mutex> lock{msgMx};
+		std::unique_lock<std::mutex> lock{connMx};
 		DEBUG_MSG("Waiting for socket to connect");
-		auto wsConnStatus = [this]() {return wsConnected == 1; };
+		auto wsConnStatus = [this]() {return wsConnected == 1 || stopRequested; };
 		condWs.wait(lock, wsConnStatus);
+		if (!wsConnected) {
+			lock.unlock();
+			abortFrame();
+			return;
+		}
 		DEBUG_MSG("Connected to socket");
 		//webSocket.send(msg.dump());
 	}
@@ -157,59 +1021,94 @@ void Client::sendMessage(json msg, mhl::MessageTypes mType) {
 	if (!clientConnected && isConnecting) {
 		DEBUG_MSG("Waiting for client to connect");
 		if (mType == mhl::MessageTypes::RequestServerInfo) {
-			webSocket.send(msg.dump());
-			DEBUG_MSG(msg.dump());
-			if (logging) logInfo.logSentMessage("RequestServerInfo", static_cast<unsigned int>(msg.at(0).at("RequestServerInfo").at("Id")));
+			transmitFrame();
+			DEBUG_MSG(frameBuffer);
 			DEBUG_MSG("Started connection to client");
 			return;
 		}
-		std::unique_lock<std::mutex> lock{msgMx};
-		auto clientConnStatus = [this]() {return clientConnected == 1; };
+		std::unique_lock<std::mutex> lock{connMx};
+		auto clientConnStatus = [this]() {return clientConnected == 1 || stopRequested; };
 		// Wait until client connection is established
 		condClient.wait(lock, clientConnStatus);
+		lock.unlock();
+		if (!clientConnected) {
+			abortFrame();
+			return;
+		}
 		DEBUG_MSG("Connected to client");
-		webSocket.send(msg.dump());
-	}
-	// If everything is connected, simply send message and log request if enabled.
-	else if (wsConnected && clientConnected) webSocket.send(msg.dump());
-	// Find the string representation of the message type for logging
-	auto result = std::find_if(
-		messageHandler.messageMap.begin(),
-		messageHandler.messageMap.end(),
-		[mType](std::pair<const mhl::MessageTypes, std::string> mo) {return mo.first == mType; });
-	
-	// Check if the message type was found
-	if (result != messageHandler.messageMap.end()) {
-		std::string msgTypeText = result->second;
-		
-		// Check if the JSON structure is valid before accessing it
-		if (msg.is_array() && msg.size() > 0 && 
-			msg.at(0).contains(msgTypeText) && 
-			msg.at(0).at(msgTypeText).contains("Id")) {
-			
-			unsigned int msgId = static_cast<unsigned int>(msg.at(0).at(msgTypeText).at("Id"));
-			
-			// Lock and add to queue
-			// std::lock_guard<std::mutex> lock{msgMx};
-			// messageHandler.q_sent.push_back(std::make_pair(msgTypeText, msgId));
-			
-			// Log the sent message with its type and ID
-			if (logging) {
-				// Log the sent message
-				logInfo.logSentMessage(msgTypeText, msgId);
-			}
+		transmitFrame();
+	}
+	// If everything is connected, simply send message.
+	else if (wsConnected && clientConnected) transmitFrame();
+	else abortFrame();
+}
+
+// Writes the frame to the websocket, counts and logs its messages. Sender thread only.
+void Client::transmitFrame() {
+	// Mark the requests sent, and look up their devices for the log, before the replies can complete them.
+	{
+		auto now = std::chrono::steady_clock::now();
+		frameDevices.clear();
+		std::lock_guard<std::mutex> lock{pendingMx};
+		for (auto& el : frameParts) {
+			auto it = pendingRequests.find(el.second);
+			if (it != pendingRequests.end()) it->second.sentAt = now;
+			if (logging) frameDevices.push_back(it != pendingRequests.end() ? it->second.deviceIndex : -1);
 		}
 	}
+	for (auto& el : frameParts) stats.sent(el.first);
+
+	webSocket.send(frameBuffer);
+
+	// Log every sent message with its type, ID and device
+	if (logging)
+		for (std::size_t i = 0; i < frameParts.size(); i++) logInfo.logSentMessage(frameParts[i].first, frameParts[i].second, frameDevices[i]);
 }
 
-// Function to update the internal devices vector based on the current state of messageHandler.deviceList
+// Function to rebuild the device feature tables and publish a new devices snapshot based on the current
+// state of messageHandler.deviceList. Called by the message handler thread, the only one changing the
+// tables, so it reads them without deviceMx.
 void Client::updateDevices() {
-    std::vector<DeviceClass> tempDeviceVec;
+    std::unordered_map<unsigned int, DeviceFeatures> features = buildDeviceFeatures(messageHandler.deviceList.Devices, deviceFeatures, nextDeviceGeneration);
+    {
+        std::lock_guard<std::mutex> lock{deviceMx};
+        deviceFeatures.swap(features);
+    }
+
+    std::atomic_store(&devices, buildDeviceSnapshot(messageHandler.deviceList.Devices, deviceFeatures));
+    deviceGeneration++;
+}
+
+std::unordered_map<unsigned int, DeviceFeatures> buildDeviceFeatures(const std::vector<Device>& devices,
+    const std::unordered_map<unsigned int, DeviceFeatures>& previous, unsigned int& nextGeneration) {
+    std::unordered_map<unsigned int, DeviceFeatures> features;
+    for (auto& el : devices) {
+        DeviceFeatures& f = features[el.DeviceIndex];
+        // A device keeps its generation while it stays connected, so existing handles remain valid.
+        auto old = previous.find(el.DeviceIndex);
+        f.generation = old != previous.end() ? old->second.generation : nextGeneration++;
+        f.timingGap = el.DeviceMessageTimingGap;
+        for (auto& el2 : el.DeviceMessages) {
+            std::vector<DeviceCmdAttr>* attributes = nullptr;
+            if (el2.CmdType == "ScalarCmd") attributes = &f.features[static_cast<int>(CommandKind::Scalar)];
+            else if (el2.CmdType == "LinearCmd") attributes = &f.features[static_cast<int>(CommandKind::Linear)];
+            else if (el2.CmdType == "RotateCmd") attributes = &f.features[static_cast<int>(CommandKind::Rotate)];
+            else if (el2.CmdType == "SensorReadCmd") attributes = &f.features[static_cast<int>(CommandKind::Sensor)];
+            if (attributes) *attributes = el2.DeviceCmdAttributes;
+        }
+    }
+    return features;
+}
+
+DeviceSnapshot buildDeviceSnapshot(const std::vector<Device>& devices, const std::unordered_map<unsigned int, DeviceFeatures>& features) {
+    std::shared_ptr<std::vector<DeviceClass>> snapshot = std::make_shared<std::vector<DeviceClass>>();
+    snapshot->reserve(devices.size());
     // Iterate through available devices.
-    for (auto& el : messageHandler.deviceList.Devices) {
+    for (auto& el : devices) {
         DeviceClass tempDevice;
         // Set the appropriate class variables.
         tempDevice.deviceID = el.DeviceIndex;
+        tempDevice.generation = features.at(el.DeviceIndex).generation;
         tempDevice.deviceName = el.DeviceName;
         tempDevice.displayName = el.DeviceDisplayName;
         if (el.DeviceMessages.size() > 0) {
@@ -224,484 +1123,680 @@ void Client::updateDevices() {
             }
         }
         // Push back the device in vector.
-        tempDeviceVec.push_back(tempDevice);
+        snapshot->push_back(std::move(tempDevice));
     }
-    // Update the class member with the new device list
-    devices = tempDeviceVec;
+    return snapshot;
 }
 
-// Mutex locked function to provide the user with available devices.
+// Functions to provide the user with available devices and sensor reads, from the current snapshots.
 std::vector<DeviceClass> Client::getDevices() {
-	std::lock_guard<std::mutex> lock{msgMx};
-	return devices;
+	return *getDeviceSnapshot();
 }
 
 SensorClass Client::getSensors() {
-	std::lock_guard<std::mutex> lock{msgMx};
-	return sensorData;
+	return *getSensorSnapshot();
 }
 
-int Client::findDevice(DeviceClass dev) {
-	for (long unsigned int i = 0; i < messageHandler.deviceList.Devices.size(); i++)
-		if (messageHandler.deviceList.Devices[i].DeviceIndex == dev.deviceID)
-			return i;
-	return -1;
+DeviceSnapshot Client::getDeviceSnapshot() const {
+	return std::atomic_load(&devices);
 }
 
-void Client::stopDevice(DeviceClass dev) {
-	std::lock_guard<std::mutex> lock{msgMx};
+SensorSnapshot Client::getSensorSnapshot() const {
+	return std::atomic_load(&sensorData);
+}
 
-	mhl::Requests req;
-	req.stopDeviceCmd.Id = static_cast<unsigned int>(mhl::MessageTypes::StopDeviceCmd);
-	req.stopDeviceCmd.DeviceIndex = dev.deviceID;
-	
-	messageHandler.messageType = mhl::MessageTypes::StopDeviceCmd;
+unsigned long long Client::getDeviceGeneration() const {
+	return deviceGeneration;
+}
+
+unsigned long long Client::getSensorGeneration() const {
+	return sensorGeneration;
+}
 
-	json j = json::array({ messageHandler.handleClientRequest(req) });
-	DEBUG_MSG(j);
+std::size_t Client::readSensorSamples(DeviceHandle dev, int senIndex, SensorCursor& cursor, SensorSamples& out) {
+	out.timestamps.clear();
+	out.samples.clear();
+	if (senIndex < 0 || !isDeviceConnected(dev)) return 0;
 
-	std::thread sendHandler(&Client::sendMessage, this, j, messageHandler.messageType);
-	sendHandler.detach();
+	std::lock_guard<std::mutex> lock{sensorMx};
+	auto it = sensorBuffers.find(sensorKey(dev.deviceIndex, senIndex));
+	if (it == sensorBuffers.end()) return 0;
+	return it->second.read(cursor, out);
 }
 
-void Client::stopAllDevices() {
+SensorBufferStats Client::getSensorBufferStats(DeviceHandle dev, int senIndex) {
+	if (senIndex < 0 || !isDeviceConnected(dev)) return SensorBufferStats();
+
+	std::lock_guard<std::mutex> lock{sensorMx};
+	auto it = sensorBuffers.find(sensorKey(dev.deviceIndex, senIndex));
+	if (it == sensorBuffers.end()) return SensorBufferStats();
+	return it->second.stats();
+}
+
+void Client::setSensorBufferCapacity(std::size_t readings) {
+	std::lock_guard<std::mutex> lock{sensorMx};
+	sensorBufferCapacity = readings;
+}
+
+void Client::setInboundQueueLimit(std::size_t frames) {
 	std::lock_guard<std::mutex> lock{msgMx};
+	inboundLimit = frames;
+}
 
-	mhl::Requests req;
-	req.stopDeviceCmd.Id = static_cast<unsigned int>(mhl::MessageTypes::StopAllDevices);
+void Client::setLogFlushPolicy(std::chrono::milliseconds interval, std::size_t bytes) {
+	logInfo.setFlushPolicy(interval, bytes);
+}
 
-	messageHandler.messageType = mhl::MessageTypes::StopAllDevices;
+void Client::setLogOverflowPolicy(LogOverflowPolicy policy) {
+	logInfo.setOverflowPolicy(policy);
+}
 
-	json j = json::array({ messageHandler.handleClientRequest(req) });
-	DEBUG_MSG(j);
+unsigned long long Client::getLogDroppedEntries() const {
+	return logInfo.droppedEntries();
+}
 
-	std::thread sendHandler(&Client::sendMessage, this, j, messageHandler.messageType);
-	sendHandler.detach();
+// Looks up the feature table of a device, nullptr if the handle is stale. Called with deviceMx held.
+const DeviceFeatures* Client::findFeatures(DeviceHandle dev) const {
+	auto it = deviceFeatures.find(dev.deviceIndex);
+	if (it == deviceFeatures.end()) return nullptr;
+	if (dev.generation != 0 && dev.generation != it->second.generation) return nullptr;
+	return &it->second;
 }
 
-void Client::sendScalar(DeviceClass dev, double str) {
-	std::lock_guard<std::mutex> lock{msgMx};
-	int idx = findDevice(dev);
-	if (idx > -1) {
-		mhl::Requests req;
-
-		for (auto& el1 : messageHandler.deviceList.Devices[idx].DeviceMessages) {
-			std::string testScalar = "ScalarCmd";
-			if (!el1.CmdType.compare(testScalar)) {
-				req.scalarCmd.DeviceIndex = messageHandler.deviceList.Devices[idx].DeviceIndex;
-				req.scalarCmd.Id = static_cast<unsigned int>(mhl::MessageTypes::ScalarCmd);
-				int i = 0;
-				for (auto& el2: el1.DeviceCmdAttributes) {
-					Scalar sc;
-					sc.ActuatorType = el2.ActuatorType;
-					sc.ScalarVal = str;
-					sc.Index = i;
-					req.scalarCmd.Scalars.push_back(sc);
-					i++;
-				}
-				messageHandler.messageType = mhl::MessageTypes::ScalarCmd;
+bool Client::isDeviceConnected(DeviceHandle dev) {
+	std::lock_guard<std::mutex> lock{deviceMx};
+	return findFeatures(dev) != nullptr;
+}
 
-				json j = json::array({ messageHandler.handleClientRequest(req) });
-				DEBUG_MSG(j);
+void Client::stopDevice(DeviceHandle dev, mhl::CommandCallback callback, std::chrono::milliseconds timeout) {
+	// Abort the request if the device is gone.
+	if (!isDeviceConnected(dev)) {
+		abortRequest(callback, mhl::MessageTypes::StopDeviceCmd);
+		return;
+	}
 
-				std::thread sendHandler(&Client::sendMessage, this, j, messageHandler.messageType);
-				sendHandler.detach();
-			}
-		}
+	mhl::Requests req;
+	req.stopDeviceCmd.Id = allocateId();
+	req.stopDeviceCmd.DeviceIndex = dev.deviceIndex;
+	// Values still waiting in the scheduler would restart the device after the stop.
+	dropScheduledCommands(false, dev.deviceIndex);
+	forgetActuatorValues(false, dev.deviceIndex);
+
+	std::string& payload = requestBuffer();
+	mhl::Messages::writeClientRequest(mhl::MessageTypes::StopDeviceCmd, req, payload);
+	DEBUG_MSG(payload);
+
+	queueStop(payload, mhl::MessageTypes::StopDeviceCmd, req.stopDeviceCmd.Id, callback, timeout, dev.deviceIndex);
+}
+
+void Client::stopAllDevices(mhl::CommandCallback callback, std::chrono::milliseconds timeout) {
+	mhl::Requests req;
+	req.stopAllDevices.Id = allocateId();
+	dropScheduledCommands(true, 0);
+	forgetActuatorValues(true, 0);
+
+	std::string& payload = requestBuffer();
+	mhl::Messages::writeClientRequest(mhl::MessageTypes::StopAllDevices, req, payload);
+	DEBUG_MSG(payload);
+
+	queueStop(payload, mhl::MessageTypes::StopAllDevices, req.stopAllDevices.Id, callback, timeout, -1);
+}
+
+void Client::sendScalar(DeviceHandle dev, double str, mhl::CommandCallback callback, std::chrono::milliseconds timeout) {
+	std::unique_lock<std::mutex> lock{deviceMx};
+	const DeviceFeatures* features = findFeatures(dev);
+	// Abort the request if the device is gone or has no scalar actuators.
+	if (!features || (*features)[CommandKind::Scalar].empty()) {
+		abortRequest(callback, mhl::MessageTypes::ScalarCmd);
+		return;
+	}
+
+	mhl::Requests req;
+	req.scalarCmd.DeviceIndex = dev.deviceIndex;
+	const std::vector<DeviceCmdAttr>& actuators = (*features)[CommandKind::Scalar];
+	for (unsigned int i = 0; i < actuators.size(); i++) {
+		Scalar sc;
+		sc.ActuatorType = actuators[i].ActuatorType;
+		sc.ScalarVal = str;
+		sc.Index = i;
+		req.scalarCmd.Scalars.push_back(sc);
 	}
+	bool suppressed = dedupEnabled && suppressUnchanged(*features, mhl::MessageTypes::ScalarCmd, req);
+	unsigned int gap = features->timingGap;
+	lock.unlock();
+	if (suppressed) completeRequest(callback, mhl::MessageTypes::ScalarCmd, mhl::CommandStatus::Ok);
+	else submitCommand(req, mhl::MessageTypes::ScalarCmd, gap, callback, timeout);
 }
 
-std::vector<DeviceCmdAttr> Client::getDeviceCommandAttributes(DeviceClass dev, const std::string& commandType) {
-    std::lock_guard<std::mutex> lock{msgMx};
-    int idx = findDevice(dev);
-    if (idx > -1) {
-        for (auto& el1 : messageHandler.deviceList.Devices[idx].DeviceMessages) {
-            if (el1.CmdType == commandType) {
-				for (auto &el2 : el1.DeviceCmdAttributes)
-				DEBUG_MSG(el2.ActuatorType << " " << el2.FeatureDescriptor << " " << el2.StepCount);
-                return el1.DeviceCmdAttributes;
-            }
+std::vector<DeviceCmdAttr> Client::getDeviceCommandAttributes(DeviceHandle dev, const std::string& commandType) {
+    // Read from the devices snapshot, which needs no lock.
+    DeviceSnapshot snapshot = getDeviceSnapshot();
+    for (auto& el1 : *snapshot) {
+        if (el1.deviceID != dev.deviceIndex || (dev.generation != 0 && el1.generation != dev.generation)) continue;
+        auto it = el1.commandAttributes.find(commandType);
+        if (it != el1.commandAttributes.end()) {
+			for (auto &el2 : it->second)
+			DEBUG_MSG(el2.ActuatorType << " " << el2.FeatureDescriptor << " " << el2.StepCount);
+            return it->second;
         }
     }
     return {};
 }
 
-void Client::sendScalarActuators(DeviceClass dev, const std::map<unsigned int, double>& actuatorValues) {
-    std::lock_guard<std::mutex> lock{msgMx};
-    int idx = findDevice(dev);
-    if (idx > -1) {
-        mhl::Requests req;
-
-        // Find the ScalarCmd entry
-        for (auto& el1 : messageHandler.deviceList.Devices[idx].DeviceMessages) {
-            if (el1.CmdType == "ScalarCmd") {
-                req.scalarCmd.DeviceIndex = messageHandler.deviceList.Devices[idx].DeviceIndex;
-                req.scalarCmd.Id = static_cast<unsigned int>(mhl::MessageTypes::ScalarCmd);
-                
-                // Use C++11 compatible map iteration
-                for (auto it = actuatorValues.begin(); it != actuatorValues.end(); ++it) {
-                    unsigned int actuatorIdx = it->first;
-                    double value = it->second;
-                    
-                    // Check if this actuator index is valid
-                    if (actuatorIdx < el1.DeviceCmdAttributes.size()) {
-                        Scalar sc;
-                        sc.ActuatorType = el1.DeviceCmdAttributes[actuatorIdx].ActuatorType;
-                        sc.ScalarVal = value;
-                        sc.Index = actuatorIdx;
-                        req.scalarCmd.Scalars.push_back(sc);
-                    }
-                }
-                
-                if (!req.scalarCmd.Scalars.empty()) {
-                    messageHandler.messageType = mhl::MessageTypes::ScalarCmd;
-
-                    json j = json::array({ messageHandler.handleClientRequest(req) });
-                    DEBUG_MSG(j);
-
-                    std::thread sendHandler(&Client::sendMessage, this, j, messageHandler.messageType);
-                    sendHandler.detach();
-                }
-                break; // Exit after finding ScalarCmd
+void Client::sendScalarActuators(DeviceHandle dev, const std::map<unsigned int, double>& actuatorValues, mhl::CommandCallback callback, std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock{deviceMx};
+    const DeviceFeatures* features = findFeatures(dev);
+    mhl::Requests req;
+    if (features) {
+        const std::vector<DeviceCmdAttr>& actuators = (*features)[CommandKind::Scalar];
+        req.scalarCmd.DeviceIndex = dev.deviceIndex;
+
+        // Use C++11 compatible map iteration
+        for (auto it = actuatorValues.begin(); it != actuatorValues.end(); ++it) {
+            unsigned int actuatorIdx = it->first;
+            double value = it->second;
+
+            // Check if this actuator index is valid
+            if (actuatorIdx < actuators.size()) {
+                Scalar sc;
+                sc.ActuatorType = actuators[actuatorIdx].ActuatorType;
+                sc.ScalarVal = value;
+                sc.Index = actuatorIdx;
+                req.scalarCmd.Scalars.push_back(sc);
             }
         }
     }
+    bool suppressed = features && dedupEnabled && suppressUnchanged(*features, mhl::MessageTypes::ScalarCmd, req);
+    unsigned int gap = features ? features->timingGap : 0;
+    lock.unlock();
+    // Abort the request if the device is gone or none of the actuators exist.
+    if (suppressed) completeRequest(callback, mhl::MessageTypes::ScalarCmd, mhl::CommandStatus::Ok);
+    else if (req.scalarCmd.Scalars.empty()) abortRequest(callback, mhl::MessageTypes::ScalarCmd);
+    else submitCommand(req, mhl::MessageTypes::ScalarCmd, gap, callback, timeout);
 }
 
 // Sends a LinearCmd to all linear actuators on a device
-void Client::sendLinear(DeviceClass dev, double duration, double position) {
-    std::lock_guard<std::mutex> lock{msgMx};
-    int idx = findDevice(dev);
-    if (idx > -1) {
-        mhl::Requests req;
-
-        for (auto& el1 : messageHandler.deviceList.Devices[idx].DeviceMessages) {
-            if (el1.CmdType == "LinearCmd") {
-                req.linearCmd.DeviceIndex = messageHandler.deviceList.Devices[idx].DeviceIndex;
-                req.linearCmd.Id = static_cast<unsigned int>(mhl::MessageTypes::LinearCmd);
-                int i = 0;
-                for (auto& el2 : el1.DeviceCmdAttributes) {
-                    Linear lin;
-                    lin.Duration = duration;
-                    lin.Position = position;
-                    lin.Index = i;
-                    req.linearCmd.Vectors.push_back(lin);
-                    i++;
-                }
-                
-                if (!req.linearCmd.Vectors.empty()) {
-                    messageHandler.messageType = mhl::MessageTypes::LinearCmd;
-
-                    json j = json::array({ messageHandler.handleClientRequest(req) });
-                    DEBUG_MSG(j);
+void Client::sendLinear(DeviceHandle dev, double duration, double position, mhl::CommandCallback callback, std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock{deviceMx};
+    const DeviceFeatures* features = findFeatures(dev);
+    // Abort the request if the device is gone or has no linear actuators.
+    if (!features || (*features)[CommandKind::Linear].empty()) {
+        abortRequest(callback, mhl::MessageTypes::LinearCmd);
+        return;
+    }
 
-                    std::thread sendHandler(&Client::sendMessage, this, j, messageHandler.messageType);
-                    sendHandler.detach();
-                }
-                break; // Exit after finding LinearCmd
-            }
-        }
+    mhl::Requests req;
+    req.linearCmd.DeviceIndex = dev.deviceIndex;
+    for (unsigned int i = 0; i < (*features)[CommandKind::Linear].size(); i++) {
+        Linear lin;
+        lin.Duration = duration;
+        lin.Position = position;
+        lin.Index = i;
+        req.linearCmd.Vectors.push_back(lin);
     }
+    unsigned int gap = features->timingGap;
+    lock.unlock();
+    submitCommand(req, mhl::MessageTypes::LinearCmd, gap, callback, timeout);
 }
 
 // Sends a LinearCmd to specific linear actuators on a device
-void Client::sendLinearActuators(DeviceClass dev, const std::map<unsigned int, std::pair<double, double>>& actuatorValues) {
-    std::lock_guard<std::mutex> lock{msgMx};
-    int idx = findDevice(dev);
-    if (idx > -1) {
-        mhl::Requests req;
-
-        for (auto& el1 : messageHandler.deviceList.Devices[idx].DeviceMessages) {
-            if (el1.CmdType == "LinearCmd") {
-                req.linearCmd.DeviceIndex = messageHandler.deviceList.Devices[idx].DeviceIndex;
-                req.linearCmd.Id = static_cast<unsigned int>(mhl::MessageTypes::LinearCmd);
-
-                for (auto it = actuatorValues.begin(); it != actuatorValues.end(); ++it) {
-                    unsigned int actuatorIdx = it->first;
-                    double duration = it->second.first;
-                    double position = it->second.second;
-
-                    if (actuatorIdx < el1.DeviceCmdAttributes.size()) {
-                        Linear lin;
-                        lin.Duration = duration;
-                        lin.Position = position;
-                        lin.Index = actuatorIdx;
-                        req.linearCmd.Vectors.push_back(lin);
-                    }
-                }
-
-                if (!req.linearCmd.Vectors.empty()) {
-                    messageHandler.messageType = mhl::MessageTypes::LinearCmd;
-
-                    json j = json::array({ messageHandler.handleClientRequest(req) });
-                    DEBUG_MSG(j);
-
-                    std::thread sendHandler(&Client::sendMessage, this, j, messageHandler.messageType);
-                    sendHandler.detach();
-                }
-                break; // Exit after finding LinearCmd
+void Client::sendLinearActuators(DeviceHandle dev, const std::map<unsigned int, std::pair<double, double>>& actuatorValues, mhl::CommandCallback callback, std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock{deviceMx};
+    const DeviceFeatures* features = findFeatures(dev);
+    mhl::Requests req;
+    if (features) {
+        req.linearCmd.DeviceIndex = dev.deviceIndex;
+
+        for (auto it = actuatorValues.begin(); it != actuatorValues.end(); ++it) {
+            unsigned int actuatorIdx = it->first;
+            double duration = it->second.first;
+            double position = it->second.second;
+
+            if (actuatorIdx < (*features)[CommandKind::Linear].size()) {
+                Linear lin;
+                lin.Duration = duration;
+                lin.Position = position;
+                lin.Index = actuatorIdx;
+                req.linearCmd.Vectors.push_back(lin);
             }
         }
     }
+    unsigned int gap = features ? features->timingGap : 0;
+    lock.unlock();
+    // Abort the request if the device is gone or none of the actuators exist.
+    if (req.linearCmd.Vectors.empty()) abortRequest(callback, mhl::MessageTypes::LinearCmd);
+    else submitCommand(req, mhl::MessageTypes::LinearCmd, gap, callback, timeout);
 }
 
 // Sends a RotateCmd to all rotational actuators on a device
-void Client::sendRotation(DeviceClass dev, double speed, bool clockwise) {
-    std::lock_guard<std::mutex> lock{msgMx};
-    int idx = findDevice(dev);
-    if (idx > -1) {
-        mhl::Requests req;
-
-        for (auto& el1 : messageHandler.deviceList.Devices[idx].DeviceMessages) {
-            if (el1.CmdType == "RotateCmd") {
-                req.rotateCmd.DeviceIndex = messageHandler.deviceList.Devices[idx].DeviceIndex;
-                req.rotateCmd.Id = static_cast<unsigned int>(mhl::MessageTypes::RotateCmd);
-                int i = 0;
-                for (auto& el2 : el1.DeviceCmdAttributes) {
-                    Rotate rot;
-                    rot.Speed = speed;
-                    rot.Clockwise = clockwise;
-                    rot.Index = i;
-                    req.rotateCmd.Rotations.push_back(rot);
-                    i++;
-                }
-                
-                if (!req.rotateCmd.Rotations.empty()) {
-                    messageHandler.messageType = mhl::MessageTypes::RotateCmd;
+void Client::sendRotation(DeviceHandle dev, double speed, bool clockwise, mhl::CommandCallback callback, std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock{deviceMx};
+    const DeviceFeatures* features = findFeatures(dev);
+    // Abort the request if the device is gone or has no rotational actuators.
+    if (!features || (*features)[CommandKind::Rotate].empty()) {
+        abortRequest(callback, mhl::MessageTypes::RotateCmd);
+        return;
+    }
 
-                    json j = json::array({ messageHandler.handleClientRequest(req) });
-                    DEBUG_MSG(j);
+    mhl::Requests req;
+    req.rotateCmd.DeviceIndex = dev.deviceIndex;
+    for (unsigned int i = 0; i < (*features)[CommandKind::Rotate].size(); i++) {
+        Rotate rot;
+        rot.Speed = speed;
+        rot.Clockwise = clockwise;
+        rot.Index = i;
+        req.rotateCmd.Rotations.push_back(rot);
+    }
+    bool suppressed = dedupEnabled && suppressUnchanged(*features, mhl::MessageTypes::RotateCmd, req);
+    unsigned int gap = features->timingGap;
+    lock.unlock();
+    if (suppressed) completeRequest(callback, mhl::MessageTypes::RotateCmd, mhl::CommandStatus::Ok);
+    else submitCommand(req, mhl::MessageTypes::RotateCmd, gap, callback, timeout);
+}
 
-                    std::thread sendHandler(&Client::sendMessage, this, j, messageHandler.messageType);
-                    sendHandler.detach();
-                }
-                break; // Exit after finding RotateCmd
+// Sends a RotateCmd to specific rotational actuators on a device
+void Client::sendRotationActuators(DeviceHandle dev, const std::map<unsigned int, std::pair<double, bool>>& actuatorValues, mhl::CommandCallback callback, std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock{deviceMx};
+    const DeviceFeatures* features = findFeatures(dev);
+    mhl::Requests req;
+    if (features) {
+        req.rotateCmd.DeviceIndex = dev.deviceIndex;
+
+        for (auto it = actuatorValues.begin(); it != actuatorValues.end(); ++it) {
+            unsigned int actuatorIdx = it->first;
+            double speed = it->second.first;
+            bool clockwise = it->second.second;
+
+            if (actuatorIdx < (*features)[CommandKind::Rotate].size()) {
+                Rotate rot;
+                rot.Speed = speed;
+                rot.Clockwise = clockwise;
+                rot.Index = actuatorIdx;
+                req.rotateCmd.Rotations.push_back(rot);
             }
         }
     }
+    bool suppressed = features && dedupEnabled && suppressUnchanged(*features, mhl::MessageTypes::RotateCmd, req);
+    unsigned int gap = features ? features->timingGap : 0;
+    lock.unlock();
+    // Abort the request if the device is gone or none of the actuators exist.
+    if (suppressed) completeRequest(callback, mhl::MessageTypes::RotateCmd, mhl::CommandStatus::Ok);
+    else if (req.rotateCmd.Rotations.empty()) abortRequest(callback, mhl::MessageTypes::RotateCmd);
+    else submitCommand(req, mhl::MessageTypes::RotateCmd, gap, callback, timeout);
 }
 
-// Sends a RotateCmd to specific rotational actuators on a device
-void Client::sendRotationActuators(DeviceClass dev, const std::map<unsigned int, std::pair<double, bool>>& actuatorValues) {
-    std::lock_guard<std::mutex> lock{msgMx};
-    int idx = findDevice(dev);
-    if (idx > -1) {
-        mhl::Requests req;
-
-        for (auto& el1 : messageHandler.deviceList.Devices[idx].DeviceMessages) {
-            if (el1.CmdType == "RotateCmd") {
-                req.rotateCmd.DeviceIndex = messageHandler.deviceList.Devices[idx].DeviceIndex;
-                req.rotateCmd.Id = static_cast<unsigned int>(mhl::MessageTypes::RotateCmd);
-
-                for (auto it = actuatorValues.begin(); it != actuatorValues.end(); ++it) {
-                    unsigned int actuatorIdx = it->first;
-                    double speed = it->second.first;
-                    bool clockwise = it->second.second;
-
-                    if (actuatorIdx < el1.DeviceCmdAttributes.size()) {
-                        Rotate rot;
-                        rot.Speed = speed;
-                        rot.Clockwise = clockwise;
-                        rot.Index = actuatorIdx;
-                        req.rotateCmd.Rotations.push_back(rot);
-                    }
-                }
+// Looks up the sensor a sensor request is for, nullptr if the device is gone or has no such sensor.
+// Called with deviceMx held.
+static const DeviceCmdAttr* findSensor(const DeviceFeatures* features, int senIndex) {
+	if (!features || senIndex < 0) return nullptr;
+	const std::vector<DeviceCmdAttr>& sensors = (*features)[CommandKind::Sensor];
+	if (static_cast<unsigned int>(senIndex) >= sensors.size()) return nullptr;
+	return &sensors[senIndex];
+}
 
-                if (!req.rotateCmd.Rotations.empty()) {
-                    messageHandler.messageType = mhl::MessageTypes::RotateCmd;
+void Client::sensorRead(DeviceHandle dev, int senIndex, mhl::CommandCallback callback, std::chrono::milliseconds timeout) {
+	std::unique_lock<std::mutex> lock{deviceMx};
+	const DeviceCmdAttr* sensor = findSensor(findFeatures(dev), senIndex);
+	// Abort the request if the device or the sensor was not found.
+	if (!sensor) {
+		abortRequest(callback, mhl::MessageTypes::SensorReadCmd);
+		return;
+	}
 
-                    json j = json::array({ messageHandler.handleClientRequest(req) });
-                    DEBUG_MSG(j);
+	mhl::Requests req;
+	req.sensorReadCmd.DeviceIndex = dev.deviceIndex;
+	req.sensorReadCmd.Id = allocateId();
+	req.sensorReadCmd.SensorIndex = senIndex;
+	req.sensorReadCmd.SensorType = sensor->SensorType;
+	lock.unlock();
 
-                    std::thread sendHandler(&Client::sendMessage, this, j, messageHandler.messageType);
-                    sendHandler.detach();
-                }
-                break; // Exit after finding RotateCmd
-            }
-        }
-    }
+	std::string& payload = requestBuffer();
+	mhl::Messages::writeClientRequest(mhl::MessageTypes::SensorReadCmd, req, payload);
+	DEBUG_MSG(payload);
+
+	queueMessage(payload, mhl::MessageTypes::SensorReadCmd, req.sensorReadCmd.Id, callback, timeout, dev.deviceIndex);
 }
 
-void Client::sensorRead(DeviceClass dev, int senIndex) {
-	std::lock_guard<std::mutex> lock{msgMx};
-	int idx = findDevice(dev);
-	if (idx > -1) {
-		mhl::Requests req;
-
-		for (auto& el1 : messageHandler.deviceList.Devices[idx].DeviceMessages) {
-			std::string testSensor = "SensorReadCmd";
-			if (!el1.CmdType.compare(testSensor)) {
-				req.sensorReadCmd.DeviceIndex = messageHandler.deviceList.Devices[idx].DeviceIndex;
-				req.sensorReadCmd.Id = static_cast<unsigned int>(mhl::MessageTypes::SensorReadCmd);
-				req.sensorReadCmd.SensorIndex = senIndex;
-				req.sensorReadCmd.SensorType = el1.DeviceCmdAttributes[senIndex].SensorType;
-				messageHandler.messageType = mhl::MessageTypes::SensorReadCmd;
-
-				json j = json::array({ messageHandler.handleClientRequest(req) });
-				DEBUG_MSG(j);
-
-				std::thread sendHandler(&Client::sendMessage, this, j, messageHandler.messageType);
-				sendHandler.detach();
-			}
-		}
+void Client::sensorSubscribe(DeviceHandle dev, int senIndex, mhl::CommandCallback callback, std::chrono::milliseconds timeout) {
+	std::unique_lock<std::mutex> lock{deviceMx};
+	const DeviceCmdAttr* sensor = findSensor(findFeatures(dev), senIndex);
+	// Abort the request if the device or the sensor was not found.
+	if (!sensor) {
+		abortRequest(callback, mhl::MessageTypes::SensorSubscribeCmd);
+		return;
 	}
+
+	mhl::Requests req;
+	req.sensorSubscribeCmd.DeviceIndex = dev.deviceIndex;
+	req.sensorSubscribeCmd.Id = allocateId();
+	req.sensorSubscribeCmd.SensorIndex = senIndex;
+	req.sensorSubscribeCmd.SensorType = sensor->SensorType;
+	lock.unlock();
+
+	std::string& payload = requestBuffer();
+	mhl::Messages::writeClientRequest(mhl::MessageTypes::SensorSubscribeCmd, req, payload);
+	DEBUG_MSG(payload);
+
+	queueMessage(payload, mhl::MessageTypes::SensorSubscribeCmd, req.sensorSubscribeCmd.Id, callback, timeout, dev.deviceIndex);
 }
 
-void Client::sensorSubscribe(DeviceClass dev, int senIndex) {
-	std::lock_guard<std::mutex> lock{msgMx};
-	int idx = findDevice(dev);
-	if (idx > -1) {
-		mhl::Requests req;
-
-		for (auto& el1 : messageHandler.deviceList.Devices[idx].DeviceMessages) {
-			std::string testSensor = "SensorReadCmd";
-			if (!el1.CmdType.compare(testSensor)) {
-				req.sensorSubscribeCmd.DeviceIndex = messageHandler.deviceList.Devices[idx].DeviceIndex;
-				req.sensorSubscribeCmd.Id = static_cast<unsigned int>(mhl::MessageTypes::SensorSubscribeCmd);
-				req.sensorSubscribeCmd.SensorIndex = senIndex;
-				req.sensorSubscribeCmd.SensorType = el1.DeviceCmdAttributes[senIndex].SensorType;
-				messageHandler.messageType = mhl::MessageTypes::SensorSubscribeCmd;
-
-				json j = json::array({ messageHandler.handleClientRequest(req) });
-				DEBUG_MSG(j);
-
-				std::thread sendHandler(&Client::sendMessage, this, j, messageHandler.messageType);
-				sendHandler.detach();
-			}
-		}
+void Client::sensorUnsubscribe(DeviceHandle dev, int senIndex, mhl::CommandCallback callback, std::chrono::milliseconds timeout) {
+	std::unique_lock<std::mutex> lock{deviceMx};
+	const DeviceCmdAttr* sensor = findSensor(findFeatures(dev), senIndex);
+	// Abort the request if the device or the sensor was not found.
+	if (!sensor) {
+		abortRequest(callback, mhl::MessageTypes::SensorUnsubscribeCmd);
+		return;
 	}
+
+	mhl::Requests req;
+	req.sensorUnsubscribeCmd.DeviceIndex = dev.deviceIndex;
+	req.sensorUnsubscribeCmd.Id = allocateId();
+	req.sensorUnsubscribeCmd.SensorIndex = senIndex;
+	req.sensorUnsubscribeCmd.SensorType = sensor->SensorType;
+	lock.unlock();
+
+	std::string& payload = requestBuffer();
+	mhl::Messages::writeClientRequest(mhl::MessageTypes::SensorUnsubscribeCmd, req, payload);
+	DEBUG_MSG(payload);
+
+	queueMessage(payload, mhl::MessageTypes::SensorUnsubscribeCmd, req.sensorUnsubscribeCmd.Id, callback, timeout, dev.deviceIndex);
 }
 
-void Client::sensorUnsubscribe(DeviceClass dev, int senIndex) {
-	std::lock_guard<std::mutex> lock{msgMx};
-	int idx = findDevice(dev);
-	if (idx > -1) {
-		mhl::Requests req;
-
-		for (auto& el1 : messageHandler.deviceList.Devices[idx].DeviceMessages) {
-			std::string testSensor = "SensorReadCmd";
-			if (!el1.CmdType.compare(testSensor)) {
-				req.sensorUnsubscribeCmd.DeviceIndex = messageHandler.deviceList.Devices[idx].DeviceIndex;
-				req.sensorUnsubscribeCmd.Id = static_cast<unsigned int>(mhl::MessageTypes::SensorUnsubscribeCmd);
-				req.sensorUnsubscribeCmd.SensorIndex = senIndex;
-				req.sensorUnsubscribeCmd.SensorType = el1.DeviceCmdAttributes[senIndex].SensorType;
-				messageHandler.messageType = mhl::MessageTypes::SensorUnsubscribeCmd;
-
-				json j = json::array({ messageHandler.handleClientRequest(req) });
-				DEBUG_MSG(j);
-
-				std::thread sendHandler(&Client::sendMessage, this, j, messageHandler.messageType);
-				sendHandler.detach();
-			}
-		}
-	}
+// Future based variants of the requests above. The future is resolved when the server answers the request.
+std::future<mhl::CommandResult> Client::startScanAsync(std::chrono::milliseconds timeout) {
+	std::future<mhl::CommandResult> future;
+	startScan(makePromiseCallback(future), timeout);
+	return future;
+}
+
+std::future<mhl::CommandResult> Client::stopScanAsync(std::chrono::milliseconds timeout) {
+	std::future<mhl::CommandResult> future;
+	stopScan(makePromiseCallback(future), timeout);
+	return future;
+}
+
+std::future<mhl::CommandResult> Client::requestDeviceListAsync(std::chrono::milliseconds timeout) {
+	std::future<mhl::CommandResult> future;
+	requestDeviceList(makePromiseCallback(future), timeout);
+	return future;
+}
+
+std::future<mhl::CommandResult> Client::stopDeviceAsync(DeviceHandle dev, std::chrono::milliseconds timeout) {
+	std::future<mhl::CommandResult> future;
+	stopDevice(dev, makePromiseCallback(future), timeout);
+	return future;
+}
+
+std::future<mhl::CommandResult> Client::stopAllDevicesAsync(std::chrono::milliseconds timeout) {
+	std::future<mhl::CommandResult> future;
+	stopAllDevices(makePromiseCallback(future), timeout);
+	return future;
+}
+
+std::future<mhl::CommandResult> Client::sendScalarAsync(DeviceHandle dev, double str, std::chrono::milliseconds timeout) {
+	std::future<mhl::CommandResult> future;
+	sendScalar(dev, str, makePromiseCallback(future), timeout);
+	return future;
+}
+
+std::future<mhl::CommandResult> Client::sendScalarActuatorsAsync(DeviceHandle dev, const std::map<unsigned int, double>& actuatorValues, std::chrono::milliseconds timeout) {
+	std::future<mhl::CommandResult> future;
+	sendScalarActuators(dev, actuatorValues, makePromiseCallback(future), timeout);
+	return future;
+}
+
+std::future<mhl::CommandResult> Client::sendLinearAsync(DeviceHandle dev, double duration, double position, std::chrono::milliseconds timeout) {
+	std::future<mhl::CommandResult> future;
+	sendLinear(dev, duration, position, makePromiseCallback(future), timeout);
+	return future;
+}
+
+std::future<mhl::CommandResult> Client::sendLinearActuatorsAsync(DeviceHandle dev, const std::map<unsigned int, std::pair<double, double>>& actuatorValues, std::chrono::milliseconds timeout) {
+	std::future<mhl::CommandResult> future;
+	sendLinearActuators(dev, actuatorValues, makePromiseCallback(future), timeout);
+	return future;
+}
+
+std::future<mhl::CommandResult> Client::sendRotationAsync(DeviceHandle dev, double speed, bool clockwise, std::chrono::milliseconds timeout) {
+	std::future<mhl::CommandResult> future;
+	sendRotation(dev, speed, clockwise, makePromiseCallback(future), timeout);
+	return future;
+}
+
+std::future<mhl::CommandResult> Client::sendRotationActuatorsAsync(DeviceHandle dev, const std::map<unsigned int, std::pair<double, bool>>& actuatorValues, std::chrono::milliseconds timeout) {
+	std::future<mhl::CommandResult> future;
+	sendRotationActuators(dev, actuatorValues, makePromiseCallback(future), timeout);
+	return future;
+}
+
+std::future<mhl::CommandResult> Client::sensorReadAsync(DeviceHandle dev, int senIndex, std::chrono::milliseconds timeout) {
+	std::future<mhl::CommandResult> future;
+	sensorRead(dev, senIndex, makePromiseCallback(future), timeout);
+	return future;
+}
+
+std::future<mhl::CommandResult> Client::sensorSubscribeAsync(DeviceHandle dev, int senIndex, std::chrono::milliseconds timeout) {
+	std::future<mhl::CommandResult> future;
+	sensorSubscribe(dev, senIndex, makePromiseCallback(future), timeout);
+	return future;
+}
+
+std::future<mhl::CommandResult> Client::sensorUnsubscribeAsync(DeviceHandle dev, int senIndex, std::chrono::milliseconds timeout) {
+	std::future<mhl::CommandResult> future;
+	sensorUnsubscribe(dev, senIndex, makePromiseCallback(future), timeout);
+	return future;
 }
 
 void Client::waitForEmptyConfirmQueue() {
 	// Wait until the queue is empty
-	std::unique_lock<std::mutex> lock{msgMx};
-	condQueue.wait(lock, [this]() { return messageHandler.q_sent.empty() && q.empty(); });
-	DEBUG_MSG("Queue is empty " << messageHandler.q_sent.size());
+	std::unique_lock<std::mutex> lock{pendingMx};
+	auto inboundEmpty = [this]() -> bool {
+		std::lock_guard<std::mutex> msgLock{msgMx};
+		return q.empty() && !frameInProgress;
+	};
+	condQueue.wait(lock, [this, &inboundEmpty]() { return pendingRequests.empty() && inboundEmpty() && !commandsScheduled(); });
+	DEBUG_MSG("Queue is empty " << pendingRequests.size());
 }
 
 // Message handling function.
 void Client::messageHandling() {
 	// Start infinite loop.
 	while (!stopRequested) {
-		std::unique_lock<std::mutex> lock{msgMx};
-
-		// A lambda that waits to receive messages in the queue.
-        cond.wait(
-            lock,
-            [this] {
-                // Add stopRequested check here
-                return !q.empty() || stopRequested;
-            }
-        );
+		// Wake up on the earliest request deadline as well, if there is one.
+		bool hasDeadline = false;
+		std::chrono::steady_clock::time_point deadline;
+		{
+			std::lock_guard<std::mutex> lock{pendingMx};
+			hasDeadline = !pendingDeadlines.empty();
+			if (hasDeadline) deadline = pendingDeadlines.top().first;
+		}
 
-		// Exit if stop was requested
-		if (stopRequested) {
-			return;
+		{
+			std::unique_lock<std::mutex> lock{msgMx};
+			// A lambda that waits to receive messages in the queue. Start over as well when a request
+			// with an earlier deadline is registered meanwhile.
+			auto ready = [this] { return !q.empty() || stopRequested || deadlinesChanged; };
+			if (hasDeadline) cond.wait_until(lock, deadline, ready);
+			else cond.wait(lock, ready);
+			deadlinesChanged = false;
+
+			// Exit if stop was requested
+			if (stopRequested) {
+				return;
+			}
+
+			// Take every received frame at once, the emptied batch becomes the new queue.
+			if (!q.empty()) {
+				inboundBatch.swap(q);
+				queuedReadings.clear();
+				controlEnd = 0;
+				frameInProgress = true;
+			}
 		}
 
-		// If received, grab the message and pop it out.
-		std::string value = q.front();
-		q.pop();
+		{
+			std::lock_guard<std::mutex> lock{pendingMx};
+			expireRequests();
+		}
+		if (inboundBatch.empty()) {
+			runCompletions();
+			continue;
+		}
 
-		// Handle the message.
-		json j = json::parse(value);
-		// Iterate through messages since server can send array.
-		for (auto& el : j.items()) {
-			// Pass the message to actual handler.
-			messageHandler.handleServerMessage(el.value());
+		for (auto& frame : inboundBatch) {
+			if (frame.superseded) continue;
+			frameTime = frame.received;
+			handleFrame(frame.text);
+			DEBUG_MSG("[subscriber] Received " << frame.text);
+		}
 
-			// If server info received, it means client is connected so set the connection atomic variables
-			// and notify all send threads that they are good to go.
-			if (messageHandler.messageType == mhl::MessageTypes::ServerInfo) {
-				isConnecting = 0;
-				clientConnected = 1;
-				condClient.notify_all();
-			}
-			// If a device updated message, make sure to update the devices for the user.
-			if (messageHandler.messageType == mhl::MessageTypes::DeviceAdded ||
-				messageHandler.messageType == mhl::MessageTypes::DeviceList  ||
-				messageHandler.messageType == mhl::MessageTypes::DeviceRemoved) updateDevices();
-
-			if (messageHandler.messageType == mhl::MessageTypes::SensorReading) sensorData = messageHandler.sensorReading;
-
-			// Log if logging is enabled.
-			if (logging)
-				logInfo.logReceivedMessage(el.value().begin().key(), static_cast<unsigned int>(el.value().begin().value().at("Id")));
-
-			std::string messageType = el.value().begin().key();
-			if (!messageType.compare("Ok") || !messageType.compare("DeviceList")) {
-				// If the message is an "Ok" message, you can extract the ID and do something with it.
-				// For example, you can log it or check if it exists in your queue.
-				unsigned int id = static_cast<unsigned int>(el.value().begin().value().at("Id"));
-
-				// Use find_if to search for the pair with matching ID
-				auto it = std::find_if(messageHandler.q_sent.begin(), messageHandler.q_sent.end(),
-					[id](const std::pair<std::string, unsigned int>& pair) {
-						return pair.second == id;
-					});
-
-				if (it != messageHandler.q_sent.end()) {
-					// Found a matching entry
-					logInfo.logOkMessage(it->first, it->second);
-					// Optionally remove the entry from the queue
-					messageHandler.q_sent.erase(it);
-				}
-				condQueue.notify_all();
-			}
-			else if (!messageType.compare("Error")) {
-				// If the message is an "Error" message, you can extract the ID and do something with it.
-				unsigned int id = static_cast<unsigned int>(el.value().begin().value().at("Id"));
-				std::cout << "Error ID: " << id << std::endl;
-
-				// Use find_if to search for the pair with matching ID
-				auto it = std::find_if(messageHandler.q_sent.begin(), messageHandler.q_sent.end(),
-					[id](const std::pair<std::string, unsigned int>& pair) {
-						return pair.second == id;
-					});
-
-				if (it != messageHandler.q_sent.end()) {
-					// Found a matching entry
-					logInfo.logErrorMessage(it->first, it->second, el.value().begin().value().at("ErrorMessage"));
-					// Optionally remove the entry from the queue
-					messageHandler.q_sent.erase(it);
-				}
-				else {
-					logInfo.logErrorMessage("Unknown", id, el.value().begin().value().at("ErrorMessage"));
-					messageHandler.q_sent.clear();
-				}
-				condQueue.notify_all();
+		{
+			std::lock_guard<std::mutex> lock{msgMx};
+			// Hand the strings back for the next frames, except for the odd huge one.
+			for (auto& frame : inboundBatch) {
+				if (inboundPool.size() < inboundPoolSize && frame.text.capacity() <= inboundBufferLimit)
+					inboundPool.push_back(std::move(frame.text));
 			}
+			inboundBatch.clear();
+			frameInProgress = false;
+			inboundBacklog = !q.empty();
+		}
+		{
+			std::lock_guard<std::mutex> lock{pendingMx};
+			condQueue.notify_all();
+		}
+
+		// Complete the requests answered by these messages, no lock is held so callbacks can send again.
+		runCompletions();
+	}
+}
 
-			// Callback function for the user.
-			messageCallback(messageHandler);
+// Decodes a frame and dispatches its messages. Message handler thread only.
+void Client::handleFrame(const std::string& value) {
+	// Anything the streaming decoder does not handle goes through the json parser.
+	if (decoder.decode(value)) {
+		for (std::size_t i = 0; i < decoder.size(); i++) {
+			messageHandler.applyServerMessage(decoder[i]);
+			dispatchServerMessage();
 		}
-		lock.unlock();
+		return;
+	}
+
+	json j = json::parse(value, nullptr, false);
+	if (j.is_discarded()) {
+		DEBUG_MSG("Skipping malformed frame " << value);
+		return;
+	}
+	// Iterate through messages since server can send array.
+	for (auto& el : j.items()) {
+		// Pass the message to actual handler.
+		try {
+			messageHandler.handleServerMessage(el.value());
+		}
+		catch (const json::exception& e) {
+			DEBUG_MSG("Skipping invalid message " << el.value().dump() << ": " << e.what());
+			continue;
+		}
+
+		// Skip messages this client does not know how to handle.
+		if (messageHandler.messageType == mhl::MessageTypes::Unknown) {
+			DEBUG_MSG("Skipping unknown message " << el.value().dump());
+			continue;
+		}
+		dispatchServerMessage();
+	}
+}
 
-		DEBUG_MSG("[subscriber] Received " << value);
+// Acts on the message just decoded into messageHandler: connection state, devices, pending requests and
+// the user callback. Called by the message handler thread without any lock held, so a slow user callback
+// does not keep other threads from sending.
+void Client::dispatchServerMessage() {
+	mhl::MessageTypes messageType = messageHandler.messageType;
+	unsigned int id = messageHandler.Id;
+
+	// If server info received, it means client is connected so set the connection atomic variables
+	// and notify all send threads that they are good to go.
+	if (messageType == mhl::MessageTypes::ServerInfo) {
+		std::lock_guard<std::mutex> lock{connMx};
+		isConnecting = 0;
+		clientConnected = 1;
+		condClient.notify_all();
 	}
+	// If a device updated message, make sure to update the devices for the user.
+	if (messageType == mhl::MessageTypes::DeviceAdded ||
+		messageType == mhl::MessageTypes::DeviceList  ||
+		messageType == mhl::MessageTypes::DeviceRemoved) updateDevices();
+
+	if (messageType == mhl::MessageTypes::SensorReading) {
+		// Reuse the snapshot replaced last time if no reader holds it any more. The fence pairs with the
+		// release of the last reader's reference, so its reads happen before the assignment below.
+		std::shared_ptr<SensorClass> snapshot;
+		if (spareSensorData && spareSensorData.use_count() == 1) {
+			std::atomic_thread_fence(std::memory_order_acquire);
+			snapshot.swap(spareSensorData);
+		}
+		else snapshot = std::make_shared<SensorClass>();
+		*snapshot = messageHandler.sensorReading;
+		SensorSnapshot replaced = std::atomic_exchange(&sensorData, SensorSnapshot(std::move(snapshot)));
+		spareSensorData = std::const_pointer_cast<SensorClass>(replaced);
+		sensorGeneration++;
+
+		const SensorClass& reading = messageHandler.sensorReading;
+		std::lock_guard<std::mutex> lock{sensorMx};
+		auto it = sensorBuffers.find(sensorKey(reading.DeviceIndex, reading.SensorIndex));
+		if (it == sensorBuffers.end())
+			it = sensorBuffers.insert(std::make_pair(sensorKey(reading.DeviceIndex, reading.SensorIndex), SensorBuffer(sensorBufferCapacity))).first;
+		it->second.push(frameTime, reading.Data);
+	}
+	// Readings of a removed device are dropped with it.
+	if (messageType == mhl::MessageTypes::DeviceRemoved) {
+		std::lock_guard<std::mutex> lock{sensorMx};
+		for (auto it = sensorBuffers.begin(); it != sensorBuffers.end();) {
+			if (it->first >> 32 == messageHandler.deviceRemoved.DeviceIndex) it = sensorBuffers.erase(it);
+			else ++it;
+		}
+	}
+
+	stats.received(messageType);
+	// Log if logging is enabled, with the device for messages about one.
+	if (logging) {
+		int deviceIndex = -1;
+		if (messageType == mhl::MessageTypes::DeviceAdded) deviceIndex = messageHandler.deviceAdded.device.DeviceIndex;
+		else if (messageType == mhl::MessageTypes::DeviceRemoved) deviceIndex = messageHandler.deviceRemoved.DeviceIndex;
+		else if (messageType == mhl::MessageTypes::SensorReading) deviceIndex = messageHandler.sensorReading.DeviceIndex;
+		logInfo.logReceivedMessage(messageType, id, deviceIndex);
+	}
+
+	// Replies carry the ID of the request they answer, so resolve it in the pending table.
+	// DeviceList, ServerInfo and SensorReading (with a non-zero ID) answer their request like an Ok does.
+	if (messageType == mhl::MessageTypes::Ok ||
+		messageType == mhl::MessageTypes::DeviceList ||
+		messageType == mhl::MessageTypes::ServerInfo ||
+		(messageType == mhl::MessageTypes::SensorReading && id != 0)) {
+		std::lock_guard<std::mutex> lock{pendingMx};
+		auto it = pendingRequests.find(id);
+		if (it != pendingRequests.end()) {
+			if (logging) logInfo.logOkMessage(it->second.messageType, it->first, it->second.deviceIndex, frameTime - it->second.timestamp);
+			finishRequest(it, mhl::CommandStatus::Ok);
+		}
+		condQueue.notify_all();
+	}
+	else if (messageType == mhl::MessageTypes::Error) {
+		std::cout << "Error ID: " << id << std::endl;
+
+		std::lock_guard<std::mutex> lock{pendingMx};
+		auto it = pendingRequests.find(id);
+		if (it != pendingRequests.end()) {
+			if (logging) logInfo.logErrorMessage(it->second.messageType, it->first, messageHandler.error.ErrorMessage, it->second.deviceIndex, frameTime - it->second.timestamp);
+			finishRequest(it, mhl::CommandStatus::Error);
+		}
+		else if (logging) {
+			logInfo.logErrorMessage(mhl::MessageTypes::Unknown, id, messageHandler.error.ErrorMessage);
+		}
+		condQueue.notify_all();
+	}
+
+	// Callback function for the user.
+	if (messageCallback) messageCallback(mhl::MessageEvent(messageType, id, messageHandler));
 }
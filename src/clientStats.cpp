@@ -0,0 +1,97 @@
+#include "../include/clientStats.h"
+#include <algorithm>
+
+void LatencyHistogram::record(std::chrono::nanoseconds value) {
+	long long ns = value.count() > 0 ? value.count() : 0;
+	buckets[bucketOf(ns)]++;
+	count++;
+	total += std::chrono::nanoseconds(ns);
+	if (ns > max.count()) max = std::chrono::nanoseconds(ns);
+}
+
+std::chrono::nanoseconds LatencyHistogram::mean() const {
+	return count > 0 ? std::chrono::nanoseconds(total.count() / static_cast<long long>(count)) : std::chrono::nanoseconds(0);
+}
+
+std::chrono::nanoseconds LatencyHistogram::percentile(double fraction) const {
+	if (count == 0) return std::chrono::nanoseconds(0);
+	unsigned long long target = static_cast<unsigned long long>(fraction * count);
+	if (target < 1) target = 1;
+	unsigned long long seen = 0;
+	for (std::size_t i = 0; i < bucketCount; i++) {
+		seen += buckets[i];
+		// The bucket bound may be above the longest latency seen, which is exact.
+		if (seen >= target) return std::min(std::chrono::nanoseconds(2LL << i), max);
+	}
+	return max;
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& other) {
+	for (std::size_t i = 0; i < bucketCount; i++) buckets[i] += other.buckets[i];
+	count += other.count;
+	total += other.total;
+	if (other.max > max) max = other.max;
+}
+
+std::size_t LatencyHistogram::bucketOf(long long ns) {
+	// Index of the highest set bit, so the bucket with 2^i <= ns < 2^(i+1).
+	std::size_t bucket = 0;
+	for (unsigned long long rest = static_cast<unsigned long long>(ns > 0 ? ns : 0) >> 1; rest != 0; rest >>= 1) bucket++;
+	return bucket < bucketCount ? bucket : bucketCount - 1;
+}
+
+LatencyHistogram ClientStats::requestLatency() const {
+	LatencyHistogram result;
+	for (auto& el : messageTypes) result.merge(el.latency);
+	return result;
+}
+
+StatsRecorder::StatsRecorder() {
+	for (auto& el : counters) clear(el);
+	clear(stops);
+}
+
+void StatsRecorder::clear(Counters& c) {
+	c.sent = 0;
+	c.received = 0;
+	c.errors = 0;
+	c.timeouts = 0;
+	for (auto& bucket : c.buckets) bucket = 0;
+	c.latencyCount = 0;
+	c.latencyTotal = 0;
+	c.latencyMax = 0;
+}
+
+void StatsRecorder::latency(mhl::MessageTypes type, std::chrono::nanoseconds value) {
+	record(counters[index(type)], value);
+}
+
+void StatsRecorder::record(Counters& c, std::chrono::nanoseconds value) {
+	long long ns = value.count() > 0 ? value.count() : 0;
+	c.buckets[LatencyHistogram::bucketOf(ns)].fetch_add(1, std::memory_order_relaxed);
+	c.latencyCount.fetch_add(1, std::memory_order_relaxed);
+	c.latencyTotal.fetch_add(ns, std::memory_order_relaxed);
+	long long currentMax = c.latencyMax.load(std::memory_order_relaxed);
+	while (ns > currentMax && !c.latencyMax.compare_exchange_weak(currentMax, ns, std::memory_order_relaxed)) {}
+}
+
+void StatsRecorder::copyTo(ClientStats& out) const {
+	for (std::size_t i = 0; i < mhl::messageTypeCount; i++) {
+		const Counters& c = counters[i];
+		MessageTypeStats& stats = out.messageTypes[i];
+		stats.sent = c.sent.load(std::memory_order_relaxed);
+		stats.received = c.received.load(std::memory_order_relaxed);
+		stats.errors = c.errors.load(std::memory_order_relaxed);
+		stats.timeouts = c.timeouts.load(std::memory_order_relaxed);
+		copyLatency(c, stats.latency);
+	}
+	copyLatency(stops, out.stopLatency);
+}
+
+void StatsRecorder::copyLatency(const Counters& c, LatencyHistogram& out) {
+	for (std::size_t i = 0; i < LatencyHistogram::bucketCount; i++)
+		out.buckets[i] = c.buckets[i].load(std::memory_order_relaxed);
+	out.count = c.latencyCount.load(std::memory_order_relaxed);
+	out.total = std::chrono::nanoseconds(c.latencyTotal.load(std::memory_order_relaxed));
+	out.max = std::chrono::nanoseconds(c.latencyMax.load(std::memory_order_relaxed));
+}
@@ -0,0 +1,294 @@
+#include "../include/funscriptPlayer.h"
+#include <algorithm>
+#include <fstream>
+
+// An action as it appears in the file, before inverted and range are known.
+class FunscriptAction {
+public:
+	unsigned int at;
+	float pos;
+};
+
+// SAX handler of nlohmann::json that collects the actions of a funscript and its inverted and range
+// settings, skipping everything else.
+class FunscriptSax {
+public:
+	std::vector<FunscriptAction> actions;
+	bool inverted = false;
+	double range = 100;
+	std::string error;
+
+	bool null() { return true; }
+	bool boolean(bool value) {
+		if (depth == 1 && currentKey == "inverted") inverted = value;
+		return true;
+	}
+	bool number_integer(json::number_integer_t value) { return number(static_cast<double>(value)); }
+	bool number_unsigned(json::number_unsigned_t value) { return number(static_cast<double>(value)); }
+	bool number_float(json::number_float_t value, const json::string_t&) { return number(value); }
+	bool string(json::string_t&) { return true; }
+	bool binary(json::binary_t&) { return true; }
+
+	bool start_object(std::size_t) {
+		depth++;
+		if (inActions && depth == actionsDepth + 1) {
+			hasAt = false;
+			hasPos = false;
+		}
+		return true;
+	}
+	bool end_object() {
+		if (inActions && depth == actionsDepth + 1 && hasAt && hasPos) actions.push_back(action);
+		depth--;
+		return true;
+	}
+	bool start_array(std::size_t) {
+		depth++;
+		if (depth == 2 && currentKey == "actions") {
+			inActions = true;
+			actionsDepth = depth;
+		}
+		return true;
+	}
+	bool end_array() {
+		if (inActions && depth == actionsDepth) inActions = false;
+		depth--;
+		return true;
+	}
+	bool key(json::string_t& value) {
+		// Only the keys of the script object and of its actions matter.
+		if (depth == 1 || (inActions && depth == actionsDepth + 1)) currentKey.swap(value);
+		return true;
+	}
+	bool parse_error(std::size_t position, const std::string&, const nlohmann::detail::exception& ex) {
+		error = "Parse error at byte " + std::to_string(position) + ": " + ex.what();
+		return false;
+	}
+private:
+	int depth = 0;
+	bool inActions = false;
+	int actionsDepth = 0;
+	std::string currentKey;
+	FunscriptAction action;
+	bool hasAt = false;
+	bool hasPos = false;
+
+	bool number(double value) {
+		if (depth == 1 && currentKey == "range") range = value;
+		else if (inActions && depth == actionsDepth + 1) {
+			if (currentKey == "at") {
+				action.at = value > 0 ? static_cast<unsigned int>(value) : 0;
+				hasAt = true;
+			}
+			else if (currentKey == "pos") {
+				action.pos = static_cast<float>(value);
+				hasPos = true;
+			}
+		}
+		return true;
+	}
+};
+
+bool Funscript::load(const std::string& path, std::string& error) {
+	std::ifstream in(path, std::ios::binary);
+	if (!in) {
+		error = "Could not open " + path;
+		return false;
+	}
+	return load(in, error);
+}
+
+bool Funscript::load(std::istream& in, std::string& error) {
+	FunscriptSax sax;
+	if (!json::sax_parse(in, &sax)) {
+		error = sax.error.empty() ? "Not a funscript" : sax.error;
+		return false;
+	}
+	if (sax.actions.empty()) {
+		error = "The script has no actions";
+		return false;
+	}
+
+	std::stable_sort(sax.actions.begin(), sax.actions.end(), [](const FunscriptAction& a, const FunscriptAction& b) { return a.at < b.at; });
+	double range = sax.range > 0 ? sax.range : 100;
+
+	std::vector<FunscriptSegment> built;
+	built.reserve(sax.actions.size());
+	unsigned int previous = 0;
+	for (auto& el : sax.actions) {
+		double position = std::min(std::max(el.pos / range, 0.0), 1.0);
+		if (sax.inverted) position = 1.0 - position;
+		// Actions at the same time leave nothing to move in, the last one wins.
+		if (!built.empty() && el.at == previous) {
+			built.back().position = static_cast<float>(position);
+			continue;
+		}
+
+		FunscriptSegment segment;
+		segment.start = previous;
+		segment.duration = el.at - previous;
+		segment.position = static_cast<float>(position);
+		built.push_back(segment);
+		previous = el.at;
+	}
+	segments.swap(built);
+	return true;
+}
+
+std::chrono::milliseconds Funscript::length() const {
+	return std::chrono::milliseconds(segments.empty() ? 0 : segments.back().end());
+}
+
+std::size_t Funscript::find(std::chrono::milliseconds t) const {
+	auto it = std::upper_bound(segments.begin(), segments.end(), t,
+		[](std::chrono::milliseconds time, const FunscriptSegment& segment) { return time.count() < segment.end(); });
+	return it - segments.begin();
+}
+
+FunscriptPlayer::FunscriptPlayer(Client& client, DeviceHandle dev) : client(client), dev(dev), wallBase(std::chrono::steady_clock::now()) {
+	thread = std::thread(&FunscriptPlayer::run, this);
+}
+
+FunscriptPlayer::~FunscriptPlayer() {
+	{
+		std::lock_guard<std::mutex> lock{mx};
+		running = false;
+	}
+	cond.notify_all();
+	thread.join();
+}
+
+void FunscriptPlayer::setScript(Funscript newScript) {
+	bool wasPlaying;
+	{
+		std::lock_guard<std::mutex> lock{mx};
+		script = std::move(newScript);
+		wasPlaying = playing;
+		playing = false;
+		scriptBase = std::chrono::nanoseconds(0);
+		wallBase = std::chrono::steady_clock::now();
+		next = 0;
+		changed = true;
+	}
+	cond.notify_all();
+	if (wasPlaying) client.stopDevice(dev);
+}
+
+void FunscriptPlayer::play() {
+	{
+		std::lock_guard<std::mutex> lock{mx};
+		if (playing) return;
+		rebase(std::chrono::steady_clock::now());
+		playing = true;
+	}
+	cond.notify_all();
+}
+
+void FunscriptPlayer::pause() {
+	{
+		std::lock_guard<std::mutex> lock{mx};
+		if (!playing) return;
+		rebase(std::chrono::steady_clock::now());
+		playing = false;
+	}
+	cond.notify_all();
+	client.stopDevice(dev);
+}
+
+void FunscriptPlayer::seek(std::chrono::milliseconds time) {
+	{
+		std::lock_guard<std::mutex> lock{mx};
+		rebase(std::chrono::steady_clock::now());
+		scriptBase = std::max(time, std::chrono::milliseconds(0));
+		next = script.find(std::chrono::duration_cast<std::chrono::milliseconds>(scriptBase));
+	}
+	cond.notify_all();
+}
+
+void FunscriptPlayer::setRate(double newRate) {
+	{
+		std::lock_guard<std::mutex> lock{mx};
+		rebase(std::chrono::steady_clock::now());
+		rate = std::max(newRate, 0.01);
+	}
+	cond.notify_all();
+}
+
+void FunscriptPlayer::setLatencyOffset(std::chrono::milliseconds offset) {
+	{
+		std::lock_guard<std::mutex> lock{mx};
+		latencyOffset = std::max(offset, std::chrono::milliseconds(0));
+		changed = true;
+	}
+	cond.notify_all();
+}
+
+std::chrono::milliseconds FunscriptPlayer::position() const {
+	std::lock_guard<std::mutex> lock{mx};
+	return std::chrono::duration_cast<std::chrono::milliseconds>(scriptTime(std::chrono::steady_clock::now()));
+}
+
+bool FunscriptPlayer::isPlaying() const {
+	std::lock_guard<std::mutex> lock{mx};
+	return playing;
+}
+
+FunscriptPlayerStats FunscriptPlayer::getStats() const {
+	std::lock_guard<std::mutex> lock{mx};
+	return stats;
+}
+
+// Script time at the given wall time. Called with mx held.
+std::chrono::nanoseconds FunscriptPlayer::scriptTime(std::chrono::steady_clock::time_point wall) const {
+	if (!playing) return scriptBase;
+	return scriptBase + std::chrono::nanoseconds(static_cast<long long>((wall - wallBase).count() * rate));
+}
+
+// Restarts the script clock from now and resends the segment playing, since the one sent before was timed
+// for the old clock. Called with mx held.
+void FunscriptPlayer::rebase(std::chrono::steady_clock::time_point now) {
+	scriptBase = scriptTime(now);
+	wallBase = now;
+	next = script.find(std::chrono::duration_cast<std::chrono::milliseconds>(scriptBase));
+	changed = true;
+}
+
+// Player thread. Sends every segment latencyOffset before the script clock reaches its start, with the
+// duration it has left on the device by then.
+void FunscriptPlayer::run() {
+	std::unique_lock<std::mutex> lock{mx};
+	while (running) {
+		changed = false;
+		if (!playing || next >= script.segments.size()) {
+			cond.wait(lock, [this]() { return !running || changed; });
+			continue;
+		}
+
+		const FunscriptSegment& segment = script.segments[next];
+		std::chrono::nanoseconds untilStart = std::chrono::milliseconds(segment.start) - scriptBase;
+		std::chrono::steady_clock::time_point due = wallBase
+			+ std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::nanoseconds(static_cast<long long>(untilStart.count() / rate)))
+			- latencyOffset;
+		// Segments joined after they were due, at the start of playback or after a seek, are not late.
+		bool onTime = due > std::chrono::steady_clock::now();
+		if (cond.wait_until(lock, due, [this]() { return !running || changed; })) continue;
+
+		auto now = std::chrono::steady_clock::now();
+		// Where the script will be when the command gets to the device.
+		std::chrono::nanoseconds arrival = scriptTime(now + latencyOffset);
+		std::chrono::nanoseconds left = std::chrono::milliseconds(segment.end()) - arrival;
+		next++;
+		if (left.count() <= 0 && segment.duration > 0) {
+			stats.segmentsSkipped++;
+			continue;
+		}
+		stats.segmentsSent++;
+		if (onTime) stats.lateness.record(now - due);
+
+		double duration = std::min(left, std::chrono::nanoseconds(std::chrono::milliseconds(segment.duration))).count() / 1e6 / rate;
+		double position = segment.position;
+		lock.unlock();
+		client.sendLinear(dev, std::max(duration, 0.0), position);
+		lock.lock();
+	}
+}
@@ -1,15 +1,114 @@
 #include "../include/log.h"
+#include <algorithm>
+#include <cstring>
 #include <iomanip>
 #include <sstream>
 
-Logger::Logger(const std::string baseFilename, size_t maxFileSize)
-    : baseFilename(baseFilename)
+// Appends the decimal digits of value to out.
+static void appendUnsigned(std::string& out, unsigned int value) {
+    char digits[10];
+    size_t count = 0;
+    do {
+        digits[count++] = static_cast<char>('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+    while (count > 0) out += digits[--count];
+}
+
+// Appends the lowest bytes of value to out, least significant first.
+static void appendLittleEndian(std::string& out, unsigned long long value, size_t bytes) {
+    for (size_t i = 0; i < bytes; i++) out += static_cast<char>((value >> (8 * i)) & 0xff);
+}
+
+// Labels of LogDirection values
+static const char* const directionLabels[] = { "SENT", "RECEIVED", "OK CONFIRMED", "ERROR", "DROPPED" };
+
+LogRing::LogRing(size_t capacity)
+    : mask(0)
+    , enqueuePos(0)
+    , dequeuePos(0)
+{
+    size_t size = 1;
+    while (size < capacity) size <<= 1;
+    cells.reset(new Cell[size]);
+    for (size_t i = 0; i < size; i++) cells[i].sequence.store(i, std::memory_order_relaxed);
+    mask = size - 1;
+}
+
+bool LogRing::tryPush(const LogEntry& entry) {
+    size_t pos = enqueuePos.load(std::memory_order_relaxed);
+    Cell* cell;
+    while (true) {
+        cell = &cells[pos & mask];
+        size_t sequence = cell->sequence.load(std::memory_order_acquire);
+        intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+        // The cell is free at this position, claim it
+        if (difference == 0) {
+            if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+        }
+        // The cell still holds the entry from one lap before
+        else if (difference < 0) {
+            return false;
+        }
+        // Another producer claimed the position first
+        else {
+            pos = enqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+    cell->entry = entry;
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+bool LogRing::tryPop(LogEntry& entry) {
+    size_t pos = dequeuePos.load(std::memory_order_relaxed);
+    Cell* cell;
+    while (true) {
+        cell = &cells[pos & mask];
+        size_t sequence = cell->sequence.load(std::memory_order_acquire);
+        intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos + 1);
+        if (difference == 0) {
+            if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+        }
+        else if (difference < 0) {
+            return false;
+        }
+        else {
+            pos = dequeuePos.load(std::memory_order_relaxed);
+        }
+    }
+    entry = cell->entry;
+    // Free the cell for the producer one lap later
+    cell->sequence.store(pos + mask + 1, std::memory_order_release);
+    return true;
+}
+
+bool LogRing::empty() const {
+    size_t pos = dequeuePos.load(std::memory_order_relaxed);
+    return cells[pos & mask].sequence.load(std::memory_order_acquire) != pos + 1;
+}
+
+Logger::Logger(const std::string baseFilename, size_t maxFileSize, size_t queueCapacity)
+    : logQueue(queueCapacity)
+    , overflowPolicy(LogOverflowPolicy::DropNewest)
+    , dropped(0)
+    , reportedDropped(0)
+    , writerSleeping(false)
+    , blockedProducers(0)
+    , baseFilename(baseFilename)
     , maxFileSize(maxFileSize)
     , currentFileSize(0)
     , fileCounter(0)
+    , format(LogFormat::Text)
+    , flushInterval(1000)
+    , flushBytes(64 * 1024)
+    , cachedSecond(-1)
+    , cachedTimeLength(0)
+    , unflushedBytes(0)
     , running(false)
     , startTime(std::chrono::system_clock::now())
 {
+    batch.reserve(logQueue.capacity());
 }
 
 Logger::~Logger() {
@@ -18,7 +117,8 @@ Logger::~Logger() {
 
 void Logger::start() {
     running = true;
-    logFile.open(generateFilename(), std::ios::out | std::ios::app);
+    openFile();
+    lastFlush = std::chrono::steady_clock::now();
     processingThread = std::thread(&Logger::processLogQueue, this);
 }
 
@@ -27,8 +127,18 @@ void Logger::start(const std::string& baseFilenameOverride) {
 	start();
 }
 
+void Logger::start(const std::string& baseFilenameOverride, LogFormat formatOverride) {
+    format = formatOverride;
+    if (format == LogFormat::Binary && maxFileSize < binaryLogFileSize) maxFileSize = binaryLogFileSize;
+    start(baseFilenameOverride);
+}
+
 void Logger::stop() {
-    running = false;
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        running = false;
+    }
+    spaceCondition.notify_all();
     if (processingThread.joinable()) {
 		queueCondition.notify_one();
         processingThread.join();
@@ -38,84 +148,143 @@ void Logger::stop() {
     }
 }
 
-void Logger::logSentMessage(const std::string& messageType, unsigned int messageId) {
-    LogEntry entry{
-        std::chrono::system_clock::now(),
-        messageType,
-        "SENT",
-        messageId
-    };
-    
+void Logger::setFlushPolicy(std::chrono::milliseconds interval, size_t bytes) {
     {
         std::lock_guard<std::mutex> lock(queueMutex);
-        logQueue.push(entry);
+        flushInterval = interval;
+        flushBytes = bytes;
     }
     queueCondition.notify_one();
 }
 
-void Logger::logReceivedMessage(const std::string& messageType, unsigned int messageId) {
-    LogEntry entry{
-        std::chrono::system_clock::now(),
-        messageType,
-        "RECEIVED",
-        messageId
-    };
-    
-    {
-        std::lock_guard<std::mutex> lock(queueMutex);
-        logQueue.push(entry);
-    }
-    queueCondition.notify_one();
+void Logger::setOverflowPolicy(LogOverflowPolicy policy) {
+    std::lock_guard<std::mutex> lock(queueMutex);
+    overflowPolicy = policy;
+    if (policy != LogOverflowPolicy::Block) spaceCondition.notify_all();
 }
 
-void Logger::logOkMessage(const std::string& messageType, unsigned int messageId) {
-    LogEntry entry{
-        std::chrono::system_clock::now(),
-        messageType,
-        "OK CONFIRMED",
-        messageId
-    };
-    
-    {
-        std::lock_guard<std::mutex> lock(queueMutex);
-        logQueue.push(entry);
-    }
-    queueCondition.notify_one();
+unsigned long long Logger::droppedEntries() const {
+    return dropped;
 }
 
-void Logger::logErrorMessage(const std::string& messageType, unsigned int messageId, const std::string& errorMessage) {
-    LogEntry entry{
-        std::chrono::system_clock::now(),
-        messageType,
-        "ERROR " + errorMessage,
-        messageId
-    };
-    
-    {
+void Logger::logSentMessage(mhl::MessageTypes messageType, unsigned int messageId, int deviceIndex) {
+    log(messageType, LogDirection::Sent, messageId, deviceIndex, std::chrono::nanoseconds(-1), nullptr);
+}
+
+void Logger::logReceivedMessage(mhl::MessageTypes messageType, unsigned int messageId, int deviceIndex) {
+    log(messageType, LogDirection::Received, messageId, deviceIndex, std::chrono::nanoseconds(-1), nullptr);
+}
+
+void Logger::logOkMessage(mhl::MessageTypes messageType, unsigned int messageId, int deviceIndex, std::chrono::nanoseconds latency) {
+    log(messageType, LogDirection::Ok, messageId, deviceIndex, latency, nullptr);
+}
+
+void Logger::logErrorMessage(mhl::MessageTypes messageType, unsigned int messageId, const std::string& errorMessage, int deviceIndex, std::chrono::nanoseconds latency) {
+    log(messageType, LogDirection::Error, messageId, deviceIndex, latency, &errorMessage);
+}
+
+void Logger::log(mhl::MessageTypes messageType, LogDirection direction, unsigned int messageId, int deviceIndex,
+    std::chrono::nanoseconds latency, const std::string* errorMessage) {
+    LogEntry entry;
+    entry.timestamp = std::chrono::system_clock::now();
+    entry.monotonic = std::chrono::steady_clock::now();
+    entry.messageType = messageType;
+    entry.direction = direction;
+    entry.messageId = messageId;
+    entry.deviceIndex = deviceIndex;
+    entry.latency = latency;
+    size_t length = errorMessage ? std::min(errorMessage->size(), sizeof(entry.errorMessage) - 1) : 0;
+    if (length > 0) std::memcpy(entry.errorMessage, errorMessage->data(), length);
+    entry.errorMessage[length] = '\0';
+    push(entry);
+}
+
+void Logger::push(const LogEntry& entry) {
+    while (!logQueue.tryPush(entry)) {
+        LogOverflowPolicy policy = overflowPolicy;
+        if (policy == LogOverflowPolicy::DropOldest) {
+            // Another thread may take the last entry meanwhile, then the next push has room anyway.
+            LogEntry oldest;
+            if (logQueue.tryPop(oldest)) dropped++;
+            continue;
+        }
+        if (policy == LogOverflowPolicy::Block && running) {
+            std::unique_lock<std::mutex> lock(queueMutex);
+            blockedProducers++;
+            // Pairs with the fence in processLogQueue, so either the push below sees the room the background
+            // thread made or the background thread sees this thread waiting and wakes it.
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            bool pushed = false;
+            spaceCondition.wait(lock, [this, &entry, &pushed]() {
+                pushed = logQueue.tryPush(entry);
+                return pushed || !running || overflowPolicy != LogOverflowPolicy::Block;
+            });
+            blockedProducers--;
+            if (pushed) break;
+            continue;
+        }
+        dropped++;
+        return;
+    }
+
+    // Pairs with the fence in processLogQueue, so either this thread sees the background thread
+    // sleeping or the background thread sees the new entry before it sleeps.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (writerSleeping.load(std::memory_order_relaxed)) {
         std::lock_guard<std::mutex> lock(queueMutex);
-        logQueue.push(entry);
+        queueCondition.notify_one();
     }
-    queueCondition.notify_one();
 }
 
 void Logger::processLogQueue() {
-    while (running) {
+    while (true) {
+        // Take every queued entry at once, up to the capacity of the queue.
         LogEntry entry;
+        while (batch.size() < logQueue.capacity() && logQueue.tryPop(entry)) batch.push_back(entry);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (blockedProducers.load(std::memory_order_relaxed) > 0 && !batch.empty()) {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            spaceCondition.notify_all();
+        }
+
+        std::chrono::milliseconds interval;
+        size_t bytes;
         {
             std::unique_lock<std::mutex> lock(queueMutex);
-            queueCondition.wait(lock, [this]() { 
-                return !logQueue.empty() || !running; 
-            });
-            
-            if (!running && logQueue.empty()) {
-                return;
+            interval = flushInterval;
+            bytes = flushBytes;
+
+            if (batch.empty()) {
+                if (!running) {
+                    return;
+                }
+
+                writerSleeping = true;
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                auto ready = [this]() {
+                    return !logQueue.empty() || !running;
+                };
+                // Wake up for the next flush as well while written entries are not flushed.
+                if (unflushedBytes > 0 && flushInterval.count() > 0) {
+                    queueCondition.wait_until(lock, lastFlush + flushInterval, ready);
+                }
+                else {
+                    queueCondition.wait(lock, ready);
+                }
+                writerSleeping = false;
             }
-            
-            entry = logQueue.front();
-            logQueue.pop();
         }
-        
-        writeEntryToFile(entry);
+
+        writeEntriesToFile(batch);
+        batch.clear();
+
+        auto now = std::chrono::steady_clock::now();
+        if (unflushedBytes > 0 && (unflushedBytes >= bytes || now - lastFlush >= interval)) {
+            std::lock_guard<std::mutex> lock(fileMutex);
+            logFile.flush();
+            unflushedBytes = 0;
+            lastFlush = now;
+        }
     }
 }
 
@@ -125,8 +294,28 @@ void Logger::checkAndRotateFile() {
             logFile.close();
         }
         fileCounter++;
-        logFile.open(generateFilename(), std::ios::out | std::ios::app);
-        currentFileSize = 0;
+        openFile();
+    }
+}
+
+void Logger::openFile() {
+    std::ios::openmode mode = std::ios::out | std::ios::app;
+    if (format == LogFormat::Binary) mode |= std::ios::binary;
+    logFile.open(generateFilename(), mode);
+    currentFileSize = 0;
+    unflushedBytes = 0;
+
+    if (format == LogFormat::Binary) {
+        std::string header(binaryLogMagic, sizeof(binaryLogMagic));
+        appendLittleEndian(header, std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count(), 8);
+        appendLittleEndian(header, std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count(), 8);
+        appendLittleEndian(header, binaryLogRecordSize, 4);
+        appendLittleEndian(header, 0, 4);
+        logFile.write(header.data(), header.size());
+        currentFileSize += header.size();
+        unflushedBytes += header.size();
     }
 }
 
@@ -136,33 +325,113 @@ std::string Logger::generateFilename() const {
     auto now_c = std::chrono::system_clock::to_time_t(now);
     ss << baseFilename << "_" 
        << std::put_time(std::localtime(&now_c), "%Y%m%d_%H%M%S")
-       << "_" << fileCounter << ".log";
+       << "_" << fileCounter << (format == LogFormat::Binary ? ".bplog" : ".log");
     return ss.str();
 }
 
-void Logger::writeEntryToFile(const LogEntry& entry) {
+void Logger::writeEntriesToFile(const std::vector<LogEntry>& entries) {
     std::lock_guard<std::mutex> lock(fileMutex);
-    
+
     if (!logFile.is_open()) {
-        logFile.open(generateFilename(), std::ios::out | std::ios::app);
+        openFile();
+    }
+
+    // Note the entries dropped since the last batch.
+    unsigned long long droppedNow = dropped;
+    if (droppedNow != reportedDropped) {
+        size_t before = lineBuffer.size();
+        if (format == LogFormat::Binary) {
+            LogEntry note;
+            note.monotonic = std::chrono::steady_clock::now();
+            note.messageType = mhl::MessageTypes::Unknown;
+            note.direction = LogDirection::Dropped;
+            note.messageId = static_cast<unsigned int>(std::min<unsigned long long>(droppedNow - reportedDropped, 0xffffffffu));
+            note.deviceIndex = -1;
+            note.latency = std::chrono::nanoseconds(-1);
+            encodeEntry(note);
+        }
+        else {
+            formatTimestamp(std::chrono::system_clock::now());
+            lineBuffer += " [DROPPED] ";
+            lineBuffer += std::to_string(droppedNow - reportedDropped);
+            lineBuffer += " entries\n";
+        }
+        currentFileSize += lineBuffer.size() - before;
+        reportedDropped = droppedNow;
+    }
+
+    for (const LogEntry& entry : entries) {
+        size_t before = lineBuffer.size();
+        if (format == LogFormat::Binary) encodeEntry(entry);
+        else formatEntry(entry);
+        currentFileSize += lineBuffer.size() - before;
+        if (currentFileSize >= maxFileSize) {
+            writeBuffer();
+            checkAndRotateFile();
+        }
+    }
+    writeBuffer();
+}
+
+void Logger::formatEntry(const LogEntry& entry) {
+    formatTimestamp(entry.timestamp);
+    lineBuffer += " [";
+    lineBuffer += directionLabels[static_cast<size_t>(entry.direction)];
+    if (entry.direction == LogDirection::Error) {
+        lineBuffer += ' ';
+        lineBuffer += entry.errorMessage;
+    }
+    lineBuffer += "] ";
+    lineBuffer += mhl::messageTypeName(entry.messageType);
+    lineBuffer += " (ID: ";
+    appendUnsigned(lineBuffer, entry.messageId);
+    lineBuffer += ")";
+    if (entry.deviceIndex >= 0) {
+        lineBuffer += " device ";
+        appendUnsigned(lineBuffer, static_cast<unsigned int>(entry.deviceIndex));
+    }
+    if (entry.latency.count() >= 0) {
+        lineBuffer += " latency ";
+        appendUnsigned(lineBuffer, static_cast<unsigned int>(std::chrono::duration_cast<std::chrono::microseconds>(entry.latency).count()));
+        lineBuffer += " us";
+    }
+    lineBuffer += '\n';
+}
+
+void Logger::encodeEntry(const LogEntry& entry) {
+    appendLittleEndian(lineBuffer, std::chrono::duration_cast<std::chrono::nanoseconds>(entry.monotonic.time_since_epoch()).count(), 8);
+    appendLittleEndian(lineBuffer, static_cast<unsigned long long>(entry.latency.count()), 8);
+    appendLittleEndian(lineBuffer, entry.messageId, 4);
+    appendLittleEndian(lineBuffer, static_cast<unsigned int>(entry.deviceIndex), 4);
+    appendLittleEndian(lineBuffer, static_cast<unsigned char>(entry.direction), 1);
+    appendLittleEndian(lineBuffer, static_cast<unsigned char>(entry.messageType), 1);
+    appendLittleEndian(lineBuffer, 0, 6);
+}
+
+void Logger::formatTimestamp(std::chrono::system_clock::time_point timestamp) {
+    auto timestamp_c = std::chrono::system_clock::to_time_t(timestamp);
+    if (timestamp_c != cachedSecond) {
+        cachedTimeLength = std::strftime(cachedTime, sizeof(cachedTime), "%Y-%m-%d %H:%M:%S", std::localtime(&timestamp_c));
+        cachedSecond = timestamp_c;
     }
 
     auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
-        entry.timestamp - startTime);
-    
-    std::stringstream ss;
-    auto timestamp_c = std::chrono::system_clock::to_time_t(entry.timestamp);
-    
-    ss << std::put_time(std::localtime(&timestamp_c), "%Y-%m-%d %H:%M:%S")
-       << "." << std::setfill('0') << std::setw(3) 
-       << duration.count() % 1000 << " [" 
-       << entry.direction << "] " 
-       << entry.messageType << " (ID: " 
-       << entry.messageId << ")\n";
-    
-    logFile << ss.str();
-    logFile.flush();
-    
-    currentFileSize += ss.str().length();
-    checkAndRotateFile();
-}
\ No newline at end of file
+        timestamp - startTime);
+    long long millis = duration.count() % 1000;
+    if (millis < 0) millis += 1000;
+    char millisDigits[3] = {
+        static_cast<char>('0' + millis / 100),
+        static_cast<char>('0' + millis / 10 % 10),
+        static_cast<char>('0' + millis % 10)
+    };
+
+    lineBuffer.append(cachedTime, cachedTimeLength);
+    lineBuffer += '.';
+    lineBuffer.append(millisDigits, 3);
+}
+
+void Logger::writeBuffer() {
+    logFile.write(lineBuffer.data(), lineBuffer.size());
+    unflushedBytes += lineBuffer.size();
+    lineBuffer.clear();
+}
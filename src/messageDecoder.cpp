@@ -0,0 +1,508 @@
+#include "../include/messageDecoder.h"
+#include <algorithm>
+#include <climits>
+#include <cstring>
+
+namespace mhl {
+	namespace {
+		bool isDigit(char c) {
+			return c >= '0' && c <= '9';
+		}
+
+		// Appends a code point as UTF-8.
+		void appendUtf8(std::string& out, unsigned int cp) {
+			if (cp < 0x80) {
+				out += static_cast<char>(cp);
+			}
+			else if (cp < 0x800) {
+				out += static_cast<char>(0xC0 | (cp >> 6));
+				out += static_cast<char>(0x80 | (cp & 0x3F));
+			}
+			else if (cp < 0x10000) {
+				out += static_cast<char>(0xE0 | (cp >> 12));
+				out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+				out += static_cast<char>(0x80 | (cp & 0x3F));
+			}
+			else {
+				out += static_cast<char>(0xF0 | (cp >> 18));
+				out += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+				out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+				out += static_cast<char>(0x80 | (cp & 0x3F));
+			}
+		}
+
+		bool isSpace(char c) {
+			return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+		}
+
+		// Reads an unsigned integer at pos, false if there is none or it does not fit.
+		bool scanUnsigned(const char*& pos, const char* end, unsigned int& out) {
+			if (pos == end || !isDigit(*pos)) return false;
+			unsigned long long value = 0;
+			while (pos != end && isDigit(*pos)) {
+				value = value * 10 + (*pos++ - '0');
+				if (value > UINT_MAX) return false;
+			}
+			out = static_cast<unsigned int>(value);
+			return true;
+		}
+
+		// Hands out the element at used, reusing one left from an earlier frame if there is one, so its
+		// strings and vectors keep their capacity.
+		template<typename T>
+		T& nextElement(std::vector<T>& out, std::size_t& used) {
+			if (used == out.size()) out.push_back(T());
+			return out[used++];
+		}
+
+		// Drops the elements of earlier frames that were not reused.
+		template<typename T>
+		void trimElements(std::vector<T>& out, std::size_t used) {
+			out.erase(out.begin() + used, out.end());
+		}
+
+		// Clears a device in place. Its commands are reused while they are read again.
+		void resetDevice(Device& device) {
+			device.DeviceName.clear();
+			device.DeviceIndex = 0;
+			device.DeviceMessageTimingGap = 0;
+			device.DeviceDisplayName.clear();
+		}
+
+		void resetAttr(DeviceCmdAttr& attr) {
+			attr.FeatureDescriptor.clear();
+			attr.StepCount = 0;
+			attr.ActuatorType.clear();
+			attr.SensorType.clear();
+			attr.SensorRange.clear();
+		}
+	}
+
+	// Reads an object, calling field() after each key with the key in this->key. field() reads the value.
+	template<typename F>
+	bool MessageDecoder::readObject(F field) {
+		if (!consume('{')) return false;
+		if (consume('}')) return true;
+		do {
+			if (!readKey() || !field()) return false;
+		} while (consume(','));
+		return consume('}');
+	}
+
+	// Reads an array, calling element() to read each element.
+	template<typename F>
+	bool MessageDecoder::readArray(F element) {
+		if (!consume('[')) return false;
+		if (consume(']')) return true;
+		do {
+			if (!element()) return false;
+		} while (consume(','));
+		return consume(']');
+	}
+
+	bool MessageDecoder::decode(const char* text, std::size_t length) {
+		pos = text;
+		end = text + length;
+		count = 0;
+
+		bool decoded = readArray([this] {
+			if (count == messages.size()) messages.push_back(ServerMessage());
+			return readMessage(messages[count++]);
+		});
+		skipWhitespace();
+
+		if (!decoded || pos != end) {
+			count = 0;
+			return false;
+		}
+		return true;
+	}
+
+	void MessageDecoder::skipWhitespace() {
+		while (pos != end && (*pos == ' ' || *pos == '\t' || *pos == '\n' || *pos == '\r')) ++pos;
+	}
+
+	bool MessageDecoder::consume(char c) {
+		skipWhitespace();
+		if (pos == end || *pos != c) return false;
+		++pos;
+		return true;
+	}
+
+	bool MessageDecoder::readKey() {
+		return readString(key) && consume(':');
+	}
+
+	bool MessageDecoder::readString(std::string& out) {
+		if (!consume('"')) return false;
+		out.clear();
+
+		while (true) {
+			// Copy runs of plain characters at once.
+			const char* run = pos;
+			while (pos != end && *pos != '"' && *pos != '\\' && static_cast<unsigned char>(*pos) >= 0x20) ++pos;
+			out.append(run, pos - run);
+
+			if (pos == end) return false;
+			char c = *pos++;
+			if (c == '"') return true;
+			// Unescaped control characters are not valid JSON.
+			if (c != '\\' || pos == end) return false;
+
+			switch (*pos++) {
+			case '"': out += '"'; break;
+			case '\\': out += '\\'; break;
+			case '/': out += '/'; break;
+			case 'b': out += '\b'; break;
+			case 'f': out += '\f'; break;
+			case 'n': out += '\n'; break;
+			case 'r': out += '\r'; break;
+			case 't': out += '\t'; break;
+			case 'u': {
+				unsigned int cp;
+				if (!readHex(cp)) return false;
+				// Code points outside the basic plane come as a surrogate pair.
+				if (cp >= 0xD800 && cp <= 0xDBFF) {
+					unsigned int low;
+					if (end - pos < 2 || pos[0] != '\\' || pos[1] != 'u') return false;
+					pos += 2;
+					if (!readHex(low) || low < 0xDC00 || low > 0xDFFF) return false;
+					cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+				}
+				else if (cp >= 0xDC00 && cp <= 0xDFFF) {
+					return false;
+				}
+				appendUtf8(out, cp);
+				break;
+			}
+			default:
+				return false;
+			}
+		}
+	}
+
+	bool MessageDecoder::readHex(unsigned int& out) {
+		if (end - pos < 4) return false;
+		out = 0;
+		for (int i = 0; i < 4; i++) {
+			char c = *pos++;
+			out <<= 4;
+			if (isDigit(c)) out |= c - '0';
+			else if (c >= 'a' && c <= 'f') out |= c - 'a' + 10;
+			else if (c >= 'A' && c <= 'F') out |= c - 'A' + 10;
+			else return false;
+		}
+		return true;
+	}
+
+	bool MessageDecoder::readUnsigned(unsigned int& out) {
+		skipWhitespace();
+		if (pos == end || !isDigit(*pos)) return false;
+
+		unsigned long long value = 0;
+		while (pos != end && isDigit(*pos)) {
+			value = value * 10 + (*pos++ - '0');
+			if (value > UINT_MAX) return false;
+		}
+		// Fractions and exponents are left to the json parser.
+		if (pos != end && (*pos == '.' || *pos == 'e' || *pos == 'E')) return false;
+
+		out = static_cast<unsigned int>(value);
+		return true;
+	}
+
+	bool MessageDecoder::readInt(int& out) {
+		skipWhitespace();
+		bool negative = pos != end && *pos == '-';
+		if (negative) ++pos;
+		if (pos == end || !isDigit(*pos)) return false;
+
+		long long value = 0;
+		while (pos != end && isDigit(*pos)) {
+			value = value * 10 + (*pos++ - '0');
+			if (value > static_cast<long long>(INT_MAX) + 1) return false;
+		}
+		if (pos != end && (*pos == '.' || *pos == 'e' || *pos == 'E')) return false;
+
+		if (negative) value = -value;
+		if (value > INT_MAX) return false;
+		out = static_cast<int>(value);
+		return true;
+	}
+
+	bool MessageDecoder::readIntArray(std::vector<int>& out) {
+		out.clear();
+		return readArray([this, &out] {
+			int value;
+			if (!readInt(value)) return false;
+			out.push_back(value);
+			return true;
+		});
+	}
+
+	bool MessageDecoder::skipString() {
+		if (!consume('"')) return false;
+		while (pos != end) {
+			char c = *pos++;
+			if (c == '"') return true;
+			if (c == '\\') {
+				if (pos == end) return false;
+				++pos;
+			}
+			else if (static_cast<unsigned char>(c) < 0x20) {
+				return false;
+			}
+		}
+		return false;
+	}
+
+	// Skips a value of a field this client does not use.
+	bool MessageDecoder::skipValue() {
+		skipWhitespace();
+		if (pos == end) return false;
+
+		switch (*pos) {
+		case '"':
+			return skipString();
+		case '{':
+			return readObject([this] { return skipValue(); });
+		case '[':
+			return readArray([this] { return skipValue(); });
+		case 't':
+			if (end - pos < 4 || std::memcmp(pos, "true", 4) != 0) return false;
+			pos += 4;
+			return true;
+		case 'f':
+			if (end - pos < 5 || std::memcmp(pos, "false", 5) != 0) return false;
+			pos += 5;
+			return true;
+		case 'n':
+			if (end - pos < 4 || std::memcmp(pos, "null", 4) != 0) return false;
+			pos += 4;
+			return true;
+		default: {
+			const char* start = pos;
+			while (pos != end && (isDigit(*pos) || *pos == '-' || *pos == '+' || *pos == '.' || *pos == 'e' || *pos == 'E')) ++pos;
+			return pos != start;
+		}
+		}
+	}
+
+	// Reads the Id of a message and notes that it has one.
+	bool MessageDecoder::readId(unsigned int& out) {
+		hasId = true;
+		return readUnsigned(out);
+	}
+
+	// Reads one message object, {"Type":{...}}.
+	bool MessageDecoder::readMessage(ServerMessage& m) {
+		if (!consume('{') || !readKey()) return false;
+
+		m.messageType = messageTypeFromString(key);
+		m.Id = 0;
+		hasId = false;
+
+		bool decoded = false;
+		switch (m.messageType) {
+		case MessageTypes::Ok:
+			decoded = readObject([this, &m] {
+				return key == "Id" ? readId(m.Id) : skipValue();
+			});
+			m.ok.Id = m.Id;
+			break;
+		case MessageTypes::Error:
+			m.error.ErrorMessage.clear();
+			m.error.ErrorCode = 0;
+			decoded = readObject([this, &m] {
+				if (key == "Id") return readId(m.Id);
+				if (key == "ErrorCode") return readInt(m.error.ErrorCode);
+				if (key == "ErrorMessage") return readString(m.error.ErrorMessage);
+				return skipValue();
+			});
+			m.error.Id = m.Id;
+			break;
+		case MessageTypes::ServerInfo:
+			m.serverInfo.ServerName.clear();
+			m.serverInfo.MessageVersion = 0;
+			m.serverInfo.MaxPingTime = 0;
+			decoded = readObject([this, &m] {
+				if (key == "Id") return readId(m.Id);
+				if (key == "ServerName") return readString(m.serverInfo.ServerName);
+				if (key == "MessageVersion") return readUnsigned(m.serverInfo.MessageVersion);
+				if (key == "MaxPingTime") return readUnsigned(m.serverInfo.MaxPingTime);
+				return skipValue();
+			});
+			m.serverInfo.Id = m.Id;
+			break;
+		case MessageTypes::ScanningFinished:
+			decoded = readObject([this, &m] {
+				return key == "Id" ? readId(m.Id) : skipValue();
+			});
+			break;
+		case MessageTypes::DeviceList:
+			decoded = readObject([this, &m] {
+				if (key == "Id") return readId(m.Id);
+				if (key != "Devices") return skipValue();
+				std::size_t devices = 0;
+				bool read = readArray([this, &m, &devices] {
+					Device& device = nextElement(m.deviceList.Devices, devices);
+					return readDevice(device, nullptr);
+				});
+				trimElements(m.deviceList.Devices, devices);
+				return read;
+			});
+			m.deviceList.Id = m.Id;
+			break;
+		case MessageTypes::DeviceAdded:
+			decoded = readDevice(m.deviceAdded.device, &m.Id);
+			m.deviceAdded.Id = m.Id;
+			break;
+		case MessageTypes::DeviceRemoved:
+			m.deviceRemoved.DeviceIndex = 0;
+			decoded = readObject([this, &m] {
+				if (key == "Id") return readId(m.Id);
+				if (key == "DeviceIndex") return readUnsigned(m.deviceRemoved.DeviceIndex);
+				return skipValue();
+			});
+			m.deviceRemoved.Id = m.Id;
+			break;
+		case MessageTypes::SensorReading:
+			m.sensorReading.DeviceIndex = 0;
+			m.sensorReading.SensorIndex = 0;
+			m.sensorReading.SensorType.clear();
+			m.sensorReading.Data.clear();
+			decoded = readObject([this, &m] {
+				if (key == "Id") return readId(m.Id);
+				if (key == "DeviceIndex") return readUnsigned(m.sensorReading.DeviceIndex);
+				if (key == "SensorIndex") return readUnsigned(m.sensorReading.SensorIndex);
+				if (key == "SensorType") return readString(m.sensorReading.SensorType);
+				if (key == "Data") return readIntArray(m.sensorReading.Data);
+				return skipValue();
+			});
+			m.sensorReading.Id = m.Id;
+			break;
+		default:
+			// Other message types are left to the json parser.
+			return false;
+		}
+
+		// A message object holds exactly one message. Every message has an Id, the json parser rejects ones
+		// without it as well.
+		return decoded && hasId && consume('}');
+	}
+
+	// Reads the value of one field of a device, after its key.
+	bool MessageDecoder::readDeviceField(Device& device) {
+		if (key == "DeviceName") return readString(device.DeviceName);
+		if (key == "DeviceIndex") return readUnsigned(device.DeviceIndex);
+		if (key == "DeviceMessageTimingGap") return readUnsigned(device.DeviceMessageTimingGap);
+		if (key == "DeviceDisplayName") return readString(device.DeviceDisplayName);
+		if (key == "DeviceMessages") return readDeviceMessages(device.DeviceMessages);
+		return skipValue();
+	}
+
+	// Reads a device object into device, reusing its strings and vectors. The message Id is read into id
+	// when the device object is the message itself.
+	bool MessageDecoder::readDevice(Device& device, unsigned int* id) {
+		resetDevice(device);
+		bool hasMessages = false;
+		bool read = readObject([this, &device, id, &hasMessages] {
+			if (id && key == "Id") return readId(*id);
+			if (key == "DeviceMessages") hasMessages = true;
+			return readDeviceField(device);
+		});
+		if (!hasMessages) device.DeviceMessages.clear();
+		return read;
+	}
+
+	bool MessageDecoder::readDeviceMessages(std::vector<DeviceCmd>& out) {
+		std::size_t commands = 0;
+		bool read = readObject([this, &out, &commands] {
+			// StopDeviceCmd has no attributes and is not stored.
+			if (key == "StopDeviceCmd") return skipValue();
+
+			DeviceCmd& cmd = nextElement(out, commands);
+			cmd.CmdType = key;
+			cmd.StopDeviceCmd.clear();
+			// Commands with attribute objects instead of an array (raw endpoints) go through the json parser.
+			std::size_t attrs = 0;
+			bool attrsRead = readArray([this, &cmd, &attrs] {
+				DeviceCmdAttr& attr = nextElement(cmd.DeviceCmdAttributes, attrs);
+				resetAttr(attr);
+				return readDeviceCmdAttr(attr);
+			});
+			trimElements(cmd.DeviceCmdAttributes, attrs);
+			return attrsRead;
+		});
+		trimElements(out, commands);
+
+		// Keep the commands ordered by name, as json objects iterate them.
+		std::sort(out.begin(), out.end(), [](const DeviceCmd& a, const DeviceCmd& b) { return a.CmdType < b.CmdType; });
+		return read;
+	}
+
+	bool MessageDecoder::readDeviceCmdAttr(DeviceCmdAttr& attr) {
+		return readObject([this, &attr] {
+			if (key == "FeatureDescriptor") return readString(attr.FeatureDescriptor);
+			if (key == "StepCount") return readUnsigned(attr.StepCount);
+			if (key == "ActuatorType") return readString(attr.ActuatorType);
+			if (key == "SensorType") return readString(attr.SensorType);
+			if (key != "SensorRange") return skipValue();
+
+			// Ranges are [min, max] pairs, stored flat.
+			return readArray([this, &attr] {
+				std::size_t first = attr.SensorRange.size();
+				bool read = readArray([this, &attr] {
+					int value;
+					if (!readInt(value)) return false;
+					attr.SensorRange.push_back(value);
+					return true;
+				});
+				return read && attr.SensorRange.size() == first + 2;
+			});
+		});
+	}
+
+	bool peekStreamedReading(const char* text, std::size_t length, unsigned int& deviceIndex, unsigned int& sensorIndex) {
+		static const char prefix[] = "{\"SensorReading\":{";
+		const char* pos = text;
+		const char* end = text + length;
+		while (pos != end && isSpace(*pos)) pos++;
+		if (pos == end || *pos++ != '[') return false;
+		while (pos != end && isSpace(*pos)) pos++;
+		if (static_cast<std::size_t>(end - pos) < sizeof(prefix) - 1 || std::memcmp(pos, prefix, sizeof(prefix) - 1) != 0) return false;
+		pos += sizeof(prefix) - 1;
+
+		// Depth 2 is the SensorReading object inside the message object. Only its keys are looked at,
+		// strings are skipped so braces in them do not count.
+		int depth = 2;
+		bool hasId = false, hasDevice = false, hasSensor = false;
+		unsigned int id = 0;
+		while (pos != end && depth > 0) {
+			char c = *pos++;
+			if (c == '"') {
+				const char* start = pos;
+				while (pos < end && *pos != '"') pos += *pos == '\\' ? 2 : 1;
+				if (pos >= end) return false;
+				std::size_t size = pos++ - start;
+				if (depth != 2) continue;
+				while (pos != end && isSpace(*pos)) pos++;
+				if (pos == end || *pos != ':') continue;
+				pos++;
+				while (pos != end && isSpace(*pos)) pos++;
+				if (size == 2 && std::memcmp(start, "Id", 2) == 0) hasId = scanUnsigned(pos, end, id);
+				else if (size == 11 && std::memcmp(start, "DeviceIndex", 11) == 0) hasDevice = scanUnsigned(pos, end, deviceIndex);
+				else if (size == 11 && std::memcmp(start, "SensorIndex", 11) == 0) hasSensor = scanUnsigned(pos, end, sensorIndex);
+			}
+			else if (c == '{' || c == '[') depth++;
+			else if (c == '}' || c == ']') depth--;
+		}
+		if (depth != 0) return false;
+
+		// Anything but the end of the array means more messages follow.
+		while (pos != end && isSpace(*pos)) pos++;
+		if (pos == end || *pos++ != ']') return false;
+		while (pos != end && isSpace(*pos)) pos++;
+		return pos == end && hasId && id == 0 && hasDevice && hasSensor;
+	}
+}
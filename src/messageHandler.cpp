@@ -1,49 +1,117 @@
 #include "../include/messageHandler.h"
+#include <cstring>
+#include <utility>
 
 namespace mhl {
+	// Hash slot to message type table, built once from messageTypeNames. Empty slots hold Unknown.
+	class MessageTypeSlots {
+	public:
+		MessageTypes slots[messageTypeHashSize];
+
+		MessageTypeSlots() {
+			for (std::size_t i = 0; i < messageTypeHashSize; i++)
+				slots[i] = MessageTypes::Unknown;
+			for (std::size_t i = 0; i < messageTypeCount; i++)
+				slots[messageTypeHash(messageTypeNames[i].name, messageTypeNames[i].length)] = static_cast<MessageTypes>(i);
+		}
+	};
+
+	MessageTypes messageTypeFromString(const char* name, std::size_t length) {
+		static const MessageTypeSlots table;
+
+		if (length < 2) return MessageTypes::Unknown;
+		// The hash only picks a candidate, the name still has to match exactly.
+		MessageTypes candidate = table.slots[messageTypeHash(name, length)];
+		const MessageTypeName& candidateName = messageTypeNames[static_cast<std::size_t>(candidate)];
+		if (candidateName.length != length || std::memcmp(candidateName.name, name, length) != 0)
+			return MessageTypes::Unknown;
+		return candidate;
+	}
+
+	MessageTypes messageTypeFromString(const std::string& name) {
+		return messageTypeFromString(name.data(), name.size());
+	}
+
 	// Function that handles messages received from server.
 	void Messages::handleServerMessage(json& msg) {
-		// Grab the string of message type and find it in the map.
-		auto msgType = msg.begin().key();
-		auto result = std::find_if(
-			messageMap.begin(),
-			messageMap.end(),
-			[msgType](std::pair<const mhl::MessageTypes, std::basic_string<char> > mo) {return mo.second == msgType; });
-		auto msgEnumType = result->first;
+		// Grab the string of message type and look it up.
+		if (!msg.is_object() || msg.empty()) {
+			messageType = mhl::MessageTypes::Unknown;
+			return;
+		}
+		ServerMessage m;
+		m.messageType = messageTypeFromString(msg.begin().key());
 
-		int i = 0;
 		// Switch that converts message to class.
-		switch (msgEnumType) {
+		switch (m.messageType) {
 		case mhl::MessageTypes::Ok:
-			messageType = mhl::MessageTypes::Ok;
-			ok = msg.get<msg::Ok>();
+			m.ok = msg.get<msg::Ok>();
+			m.Id = m.ok.Id;
 			break;
 		case mhl::MessageTypes::Error:
-			messageType = mhl::MessageTypes::Error;
-			error = msg.get<msg::Error>();
+			m.error = msg.get<msg::Error>();
+			m.Id = m.error.Id;
 			break;
 		case mhl::MessageTypes::ServerInfo:
-			// Set message type and convert to class from json.
+			// Convert to class from json.
 			DEBUG_MSG("Server info!");
-			messageType = mhl::MessageTypes::ServerInfo;
-			serverInfo = msg.get<msg::ServerInfo>();
+			m.serverInfo = msg.get<msg::ServerInfo>();
+			m.Id = m.serverInfo.Id;
 			break;
 		case mhl::MessageTypes::ScanningFinished:
+			m.Id = msg.begin().value().at("Id").get<unsigned int>();
 			break;
 		case mhl::MessageTypes::DeviceList:
 			DEBUG_MSG("Device list!");
-			messageType = mhl::MessageTypes::DeviceList;
-			deviceList = msg.get<msg::DeviceList>();
+			m.deviceList = msg.get<msg::DeviceList>();
+			m.Id = m.deviceList.Id;
 			break;
 		case mhl::MessageTypes::DeviceAdded:
-			deviceAdded = msg.get<msg::DeviceAdded>();
-			messageType = mhl::MessageTypes::DeviceAdded;
+			m.deviceAdded = msg.get<msg::DeviceAdded>();
+			m.Id = m.deviceAdded.Id;
+			break;
+		case mhl::MessageTypes::DeviceRemoved:
+			m.deviceRemoved = msg.get<msg::DeviceRemoved>();
+			m.Id = m.deviceRemoved.Id;
+			break;
+		case mhl::MessageTypes::SensorReading:
+			m.sensorReading = msg.get<msg::SensorReading>();
+			m.Id = m.sensorReading.Id;
+			break;
+		default:
+			// Unknown or client-only message types are not handled.
+			DEBUG_MSG("Unhandled message " << msg.begin().key());
+			m.messageType = mhl::MessageTypes::Unknown;
+			break;
+		}
+		applyServerMessage(m);
+	}
+
+	void Messages::applyServerMessage(ServerMessage& m) {
+		messageType = m.messageType;
+		Id = m.Id;
+
+		int i = 0;
+		switch (m.messageType) {
+		case mhl::MessageTypes::Ok:
+			ok = m.ok;
+			break;
+		case mhl::MessageTypes::Error:
+			std::swap(error, m.error);
+			break;
+		case mhl::MessageTypes::ServerInfo:
+			std::swap(serverInfo, m.serverInfo);
+			break;
+		case mhl::MessageTypes::DeviceList:
+			std::swap(deviceList, m.deviceList);
+			break;
+		case mhl::MessageTypes::DeviceAdded:
+			std::swap(deviceAdded, m.deviceAdded);
 			// Push back to message handler class device list the newly added device.
 			deviceList.Devices.push_back(deviceAdded.device);
 			break;
 		case mhl::MessageTypes::DeviceRemoved:
-			deviceRemoved = msg.get<msg::DeviceRemoved>();
-			messageType = mhl::MessageTypes::DeviceRemoved;
+			deviceRemoved = m.deviceRemoved;
 			// Erase device from message handler class device list.
 			for (auto& el : deviceList.Devices) {
 				if (deviceRemoved.DeviceIndex == el.DeviceIndex) {
@@ -54,16 +122,21 @@ namespace mhl {
 			}
 			break;
 		case mhl::MessageTypes::SensorReading:
-			sensorReading = msg.get<msg::SensorReading>();
-			messageType = mhl::MessageTypes::SensorReading;
+			std::swap(sensorReading, m.sensorReading);
+			break;
+		default:
 			break;
 		}
 	}
 
 	// Convert client request classes to json.
-	json Messages::handleClientRequest(Requests req) {
+	json Messages::handleClientRequest(const Requests& req) {
+		return handleClientRequest(messageType, req);
+	}
+
+	json Messages::handleClientRequest(MessageTypes type, const Requests& req) {
 		json j;
-		switch (messageType) {
+		switch (type) {
 		case mhl::MessageTypes::RequestServerInfo:
 			j = req.requestServerInfo;
 			break;
@@ -100,13 +173,34 @@ namespace mhl {
 		case mhl::MessageTypes::SensorUnsubscribeCmd:
 			j = req.sensorUnsubscribeCmd;
 			break;
+		default:
+			break;
 		}
 
-		std::cout << j.begin().key()<< std::endl;
-		if (j.begin().key().compare("RequestServerInfo")) {
-			q_sent.push_back(std::make_pair(j.begin().key(), j.begin().value().at("Id")));
-		}
+		DEBUG_MSG(j.begin().key());
 
 		return j;
 	}
+
+	// Serialize client requests, skipping the json object for the frequent actuator commands.
+	void Messages::writeClientRequest(const Requests& req, std::string& out) {
+		writeClientRequest(messageType, req, out);
+	}
+
+	void Messages::writeClientRequest(MessageTypes type, const Requests& req, std::string& out) {
+		switch (type) {
+		case mhl::MessageTypes::ScalarCmd:
+			msg::to_buffer(out, req.scalarCmd);
+			break;
+		case mhl::MessageTypes::LinearCmd:
+			msg::to_buffer(out, req.linearCmd);
+			break;
+		case mhl::MessageTypes::RotateCmd:
+			msg::to_buffer(out, req.rotateCmd);
+			break;
+		default:
+			out += handleClientRequest(type, req).dump();
+			break;
+		}
+	}
 }
\ No newline at end of file
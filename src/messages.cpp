@@ -1,4 +1,96 @@
 #include "../include/messages.h"
+#include "../include/grisu2.h"
+#include <cmath>
+#include <cstdio>
+
+// Helpers for the direct writers below. They write byte for byte what json::dump() emits for the same values.
+namespace {
+	void appendUnsigned(std::string& out, unsigned int value) {
+		char digits[10];
+		int n = 0;
+		do {
+			digits[n++] = static_cast<char>('0' + value % 10);
+			value /= 10;
+		} while (value);
+		while (n) out.push_back(digits[--n]);
+	}
+
+	// Shortest text that reads back to the same value, with the same Grisu2 digits and exponent format
+	// dump() uses. Non-finite numbers are null.
+	void appendDouble(std::string& out, double value) {
+		if (!std::isfinite(value)) {
+			out.append("null", 4);
+			return;
+		}
+		char buffer[64];
+		char* end = grisu2::to_chars(buffer, buffer + sizeof(buffer), value);
+		out.append(buffer, end);
+	}
+
+	// Length of the valid UTF-8 sequence at the start of text, 0 if it is not one.
+	std::size_t utf8Length(const unsigned char* text, std::size_t size) {
+		unsigned char c = text[0];
+		std::size_t length;
+		unsigned char low = 0x80, high = 0xBF;
+		if (c >= 0xC2 && c <= 0xDF) length = 2;
+		else if (c >= 0xE0 && c <= 0xEF) {
+			length = 3;
+			// No overlong forms and no surrogates.
+			if (c == 0xE0) low = 0xA0;
+			else if (c == 0xED) high = 0x9F;
+		}
+		else if (c >= 0xF0 && c <= 0xF4) {
+			length = 4;
+			if (c == 0xF0) low = 0x90;
+			else if (c == 0xF4) high = 0x8F;
+		}
+		else return 0;
+		if (size < length || text[1] < low || text[1] > high) return 0;
+		for (std::size_t i = 2; i < length; i++)
+			if (text[i] < 0x80 || text[i] > 0xBF) return 0;
+		return length;
+	}
+
+	void appendBool(std::string& out, bool value) {
+		if (value) out.append("true", 4);
+		else out.append("false", 5);
+	}
+
+	// Quotes and escapes a string the way json::dump() does with ensure_ascii off. Invalid UTF-8 bytes,
+	// on which dump() throws, are written as U+FFFD so the text stays valid JSON.
+	void appendString(std::string& out, const std::string& value) {
+		out.push_back('"');
+		for (std::size_t i = 0; i < value.size(); i++) {
+			char c = value[i];
+			if (static_cast<unsigned char>(c) >= 0x80) {
+				std::size_t length = utf8Length(reinterpret_cast<const unsigned char*>(value.data()) + i, value.size() - i);
+				if (length == 0) out.append("\xEF\xBF\xBD", 3);
+				else {
+					out.append(value, i, length);
+					i += length - 1;
+				}
+				continue;
+			}
+			switch (c) {
+			case '"': out.append("\\\"", 2); break;
+			case '\\': out.append("\\\\", 2); break;
+			case '\b': out.append("\\b", 2); break;
+			case '\f': out.append("\\f", 2); break;
+			case '\n': out.append("\\n", 2); break;
+			case '\r': out.append("\\r", 2); break;
+			case '\t': out.append("\\t", 2); break;
+			default:
+				if (static_cast<unsigned char>(c) <= 0x1F) {
+					char escaped[7];
+					std::snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned int>(static_cast<unsigned char>(c)));
+					out.append(escaped, 6);
+				}
+				else out.push_back(c);
+			}
+		}
+		out.push_back('"');
+	}
+}
 
 // Function definitions for json conversions.
 namespace msg {
@@ -64,6 +156,64 @@ namespace msg {
 		}
 	}
 
+	// Direct writers for the actuator commands. Keys are written in the sorted order json::dump() uses.
+	void to_buffer(std::string& out, const ScalarCmd& k) {
+		out.append("{\"ScalarCmd\":{\"DeviceIndex\":");
+		appendUnsigned(out, k.DeviceIndex);
+		out.append(",\"Id\":");
+		appendUnsigned(out, k.Id);
+		out.append(",\"Scalars\":[");
+		for (std::size_t i = 0; i < k.Scalars.size(); i++) {
+			if (i) out.push_back(',');
+			out.append("{\"ActuatorType\":");
+			appendString(out, k.Scalars[i].ActuatorType);
+			out.append(",\"Index\":");
+			appendUnsigned(out, k.Scalars[i].Index);
+			out.append(",\"Scalar\":");
+			appendDouble(out, k.Scalars[i].ScalarVal);
+			out.push_back('}');
+		}
+		out.append("]}}");
+	}
+
+	void to_buffer(std::string& out, const LinearCmd& k) {
+		out.append("{\"LinearCmd\":{\"DeviceIndex\":");
+		appendUnsigned(out, k.DeviceIndex);
+		out.append(",\"Id\":");
+		appendUnsigned(out, k.Id);
+		out.append(",\"Vectors\":[");
+		for (std::size_t i = 0; i < k.Vectors.size(); i++) {
+			if (i) out.push_back(',');
+			out.append("{\"Duration\":");
+			appendDouble(out, k.Vectors[i].Duration);
+			out.append(",\"Index\":");
+			appendUnsigned(out, k.Vectors[i].Index);
+			out.append(",\"Position\":");
+			appendDouble(out, k.Vectors[i].Position);
+			out.push_back('}');
+		}
+		out.append("]}}");
+	}
+
+	void to_buffer(std::string& out, const RotateCmd& k) {
+		out.append("{\"RotateCmd\":{\"DeviceIndex\":");
+		appendUnsigned(out, k.DeviceIndex);
+		out.append(",\"Id\":");
+		appendUnsigned(out, k.Id);
+		out.append(",\"Rotations\":[");
+		for (std::size_t i = 0; i < k.Rotations.size(); i++) {
+			if (i) out.push_back(',');
+			out.append("{\"Clockwise\":");
+			appendBool(out, k.Rotations[i].Clockwise);
+			out.append(",\"Index\":");
+			appendUnsigned(out, k.Rotations[i].Index);
+			out.append(",\"Speed\":");
+			appendDouble(out, k.Rotations[i].Speed);
+			out.push_back('}');
+		}
+		out.append("]}}");
+	}
+
 	void to_json(json& j, const SensorReadCmd& k) {
 		j["SensorReadCmd"] = { {"Id", k.Id}, {"DeviceIndex", k.DeviceIndex}, {"SensorIndex", k.SensorIndex}, {"SensorType", k.SensorType}};
 	}
@@ -122,7 +272,7 @@ namespace msg {
 
 				if (el.value().contains("DeviceMessageTimingGap")) tempD.DeviceMessageTimingGap = el.value()["DeviceMessageTimingGap"];
 
-				if (el.value().contains("DeviceDisplayName")) tempD.DeviceName = el.value()["DeviceDisplayName"];
+				if (el.value().contains("DeviceDisplayName")) tempD.DeviceDisplayName = el.value()["DeviceDisplayName"];
 
 				if (el.value().contains("DeviceMessages")) {
 					json jTemp2;
@@ -185,7 +335,7 @@ namespace msg {
 
 		if (jTemp.contains("DeviceMessageTimingGap")) k.device.DeviceMessageTimingGap = jTemp["DeviceMessageTimingGap"];
 
-		if (jTemp.contains("DeviceDisplayName")) k.device.DeviceName = jTemp["DeviceDisplayName"];
+		if (jTemp.contains("DeviceDisplayName")) k.device.DeviceDisplayName = jTemp["DeviceDisplayName"];
 
 		if (jTemp.contains("DeviceMessages")) {
 			json jTemp2;
@@ -0,0 +1,241 @@
+#include "../include/patternEngine.h"
+#include <algorithm>
+#include <cmath>
+
+static const double pi = 3.14159265358979323846;
+
+// Whether two handles may drive the same device. Generation 0 matches whichever device has the index.
+static bool sameActuator(const DeviceHandle& a, const DeviceHandle& b) {
+	return a.deviceIndex == b.deviceIndex && (a.generation == 0 || b.generation == 0 || a.generation == b.generation);
+}
+
+// Whether a track for other drives the device handle names, used to drop the tracks of a device that is gone.
+// A track with generation 0 is kept when only an older device with its index went away.
+static bool refersTo(const DeviceHandle& handle, const DeviceHandle& other) {
+	return handle.deviceIndex == other.deviceIndex && (handle.generation == 0 || handle.generation == other.generation);
+}
+
+Pattern Pattern::keyframes(std::vector<PatternKeyframe> frames, bool loop) {
+	Pattern pattern;
+	std::stable_sort(frames.begin(), frames.end(), [](const PatternKeyframe& a, const PatternKeyframe& b) { return a.time < b.time; });
+	pattern.frames = std::move(frames);
+	pattern.loop = loop;
+	return pattern;
+}
+
+Pattern Pattern::wave(WaveShape shape, std::chrono::milliseconds period, double low, double high, double duty) {
+	Pattern pattern;
+	pattern.isWave = true;
+	pattern.shape = shape;
+	pattern.period = std::max<std::chrono::nanoseconds>(period, std::chrono::milliseconds(1));
+	pattern.low = low;
+	pattern.high = high;
+	pattern.duty = std::min(std::max(duty, 0.0), 1.0);
+	return pattern;
+}
+
+double Pattern::valueAt(std::chrono::nanoseconds elapsed) const {
+	if (elapsed.count() < 0) elapsed = std::chrono::nanoseconds(0);
+
+	if (isWave) {
+		double phase = static_cast<double>(elapsed.count() % period.count()) / period.count();
+		double level = 0.0;
+		switch (shape) {
+		case WaveShape::Sine:
+			level = 0.5 - 0.5 * std::cos(2 * pi * phase);
+			break;
+		case WaveShape::Square:
+			level = phase < duty ? 1.0 : 0.0;
+			break;
+		case WaveShape::Ramp:
+			level = phase;
+			break;
+		case WaveShape::Pulse:
+			level = phase < duty ? 1.0 - phase / duty : 0.0;
+			break;
+		}
+		return low + (high - low) * level;
+	}
+
+	if (frames.empty()) return 0.0;
+	std::chrono::nanoseconds length = frames.back().time;
+	if (loop && length.count() > 0) elapsed = std::chrono::nanoseconds(elapsed.count() % length.count());
+	if (elapsed <= frames.front().time) return frames.front().value;
+	if (elapsed >= length) return frames.back().value;
+
+	// First keyframe after elapsed, the one before it is at or before elapsed.
+	auto next = std::upper_bound(frames.begin(), frames.end(), elapsed,
+		[](std::chrono::nanoseconds t, const PatternKeyframe& frame) { return t < frame.time; });
+	auto prev = next - 1;
+	double span = static_cast<double>(std::chrono::nanoseconds(next->time - prev->time).count());
+	double fraction = span > 0 ? (elapsed - prev->time).count() / span : 1.0;
+	return prev->value + (next->value - prev->value) * fraction;
+}
+
+bool Pattern::finished(std::chrono::nanoseconds elapsed) const {
+	if (isWave || loop) return false;
+	return frames.empty() || elapsed >= frames.back().time;
+}
+
+PatternEngine::PatternEngine(Client& client, std::chrono::microseconds tickInterval) :
+	client(client), tickInterval(std::max(tickInterval, std::chrono::microseconds(100))) {
+	thread = std::thread(&PatternEngine::run, this);
+}
+
+PatternEngine::~PatternEngine() {
+	{
+		std::lock_guard<std::mutex> lock{mx};
+		running = false;
+	}
+	cond.notify_all();
+	thread.join();
+}
+
+bool PatternEngine::play(DeviceHandle dev, CommandKind kind, unsigned int actuator, const Pattern& pattern) {
+	if (kind != CommandKind::Scalar && kind != CommandKind::Rotate) return false;
+	std::vector<DeviceCmdAttr> actuators = client.getDeviceCommandAttributes(dev, kind == CommandKind::Scalar ? "ScalarCmd" : "RotateCmd");
+	if (actuator >= actuators.size()) return false;
+
+	Track track;
+	track.dev = dev;
+	track.kind = kind;
+	track.actuator = actuator;
+	track.pattern = pattern;
+	track.start = std::chrono::steady_clock::now();
+	track.steps = actuators[actuator].StepCount > 0 ? actuators[actuator].StepCount : defaultSteps;
+	{
+		std::lock_guard<std::mutex> lock{mx};
+		auto it = std::find_if(tracks.begin(), tracks.end(), [&](const Track& el) {
+			return sameActuator(el.dev, dev) && el.kind == kind && el.actuator == actuator;
+		});
+		if (it != tracks.end()) {
+			// Keep the step sent last, the new pattern only sends once it moves away from it.
+			track.step = it->step;
+			track.sent = it->sent;
+			*it = std::move(track);
+		}
+		else tracks.push_back(std::move(track));
+	}
+	cond.notify_all();
+	return true;
+}
+
+void PatternEngine::stop(DeviceHandle dev, CommandKind kind, unsigned int actuator) {
+	std::lock_guard<std::mutex> lock{mx};
+	tracks.erase(std::remove_if(tracks.begin(), tracks.end(), [&](const Track& el) {
+		return sameActuator(el.dev, dev) && el.kind == kind && el.actuator == actuator;
+	}), tracks.end());
+}
+
+void PatternEngine::stopAll() {
+	std::lock_guard<std::mutex> lock{mx};
+	tracks.clear();
+}
+
+void PatternEngine::setTickInterval(std::chrono::microseconds interval) {
+	{
+		std::lock_guard<std::mutex> lock{mx};
+		tickInterval = std::max(interval, std::chrono::microseconds(100));
+		restart = true;
+	}
+	cond.notify_all();
+}
+
+PatternEngineStats PatternEngine::getStats() const {
+	std::lock_guard<std::mutex> lock{mx};
+	return stats;
+}
+
+// Engine thread. Tick n is due at start + n * tickInterval, so the time spent on a tick and late wakeups
+// do not shift the following ticks.
+void PatternEngine::run() {
+	std::vector<Command> commands;
+	std::chrono::steady_clock::time_point start;
+	long long tick = 0;
+
+	std::unique_lock<std::mutex> lock{mx};
+	while (running) {
+		// Sleep until there is something to play.
+		if (tracks.empty()) {
+			cond.wait(lock, [this]() { return !running || !tracks.empty(); });
+			restart = true;
+			continue;
+		}
+		if (restart) {
+			restart = false;
+			start = std::chrono::steady_clock::now();
+			tick = 0;
+		}
+
+		std::chrono::steady_clock::time_point due = start + tickInterval * tick;
+		if (cond.wait_until(lock, due, [this]() { return !running || restart || tracks.empty(); })) continue;
+
+		auto now = std::chrono::steady_clock::now();
+		stats.jitter.record(now - due);
+		stats.ticks++;
+		// Ticks that passed meanwhile are skipped rather than sent in a burst.
+		long long missed = std::max<long long>((now - due) / tickInterval, 0);
+		stats.missedTicks += missed;
+		tick += missed + 1;
+
+		evaluate(due + tickInterval * missed, commands);
+		if (commands.empty()) continue;
+		lock.unlock();
+		std::size_t sent = send(commands);
+		lock.lock();
+		stats.commandsSent += sent;
+	}
+}
+
+// Computes the value of every track at the given tick and collects the changed steps by device.
+// Called with mx held.
+void PatternEngine::evaluate(std::chrono::steady_clock::time_point now, std::vector<Command>& commands) {
+	commands.clear();
+	for (auto it = tracks.begin(); it != tracks.end();) {
+		Track& track = *it;
+		std::chrono::nanoseconds elapsed = now - track.start;
+		double value = track.pattern.valueAt(elapsed);
+		bool finished = track.pattern.finished(elapsed);
+
+		// Rotate steps are signed, the sign is the direction.
+		value = track.kind == CommandKind::Rotate ? std::min(std::max(value, -1.0), 1.0) : std::min(std::max(value, 0.0), 1.0);
+		long long step = std::llround(value * track.steps);
+		if (track.sent && step == track.step) stats.unchangedValues++;
+		else {
+			track.step = step;
+			track.sent = true;
+			auto command = std::find_if(commands.begin(), commands.end(), [&](const Command& el) {
+				return sameActuator(el.dev, track.dev) && el.kind == track.kind;
+			});
+			if (command == commands.end()) {
+				commands.push_back(Command());
+				command = commands.end() - 1;
+				command->dev = track.dev;
+				command->kind = track.kind;
+			}
+			double quantized = static_cast<double>(step) / track.steps;
+			if (track.kind == CommandKind::Rotate) command->rotations[track.actuator] = std::make_pair(std::fabs(quantized), step >= 0);
+			else command->scalars[track.actuator] = quantized;
+		}
+
+		if (finished) it = tracks.erase(it);
+		else ++it;
+	}
+}
+
+// Sends the commands of a tick, returns how many were sent. Called without mx held.
+std::size_t PatternEngine::send(std::vector<Command>& commands) {
+	std::size_t sent = 0;
+	for (auto& el : commands) {
+		// A device that is gone stops all its patterns.
+		if (!client.isDeviceConnected(el.dev)) {
+			std::lock_guard<std::mutex> lock{mx};
+			tracks.erase(std::remove_if(tracks.begin(), tracks.end(), [&](const Track& track) { return refersTo(el.dev, track.dev); }), tracks.end());
+			continue;
+		}
+		if (el.kind == CommandKind::Rotate) client.sendRotationActuators(el.dev, el.rotations);
+		else client.sendScalarActuators(el.dev, el.scalars);
+		sent++;
+	}
+	return sent;
+}
@@ -0,0 +1,62 @@
+#include "../include/sensorBuffer.h"
+#include <algorithm>
+
+SensorBuffer::SensorBuffer(std::size_t capacity) : capacity(std::max<std::size_t>(capacity, 1)), timestamps(this->capacity) {}
+
+void SensorBuffer::push(std::chrono::steady_clock::time_point time, const std::vector<int>& data) {
+	if (data.size() > width) widen(data.size());
+
+	// The oldest reading is overwritten once the buffer is full.
+	if (head >= capacity && head - capacity >= consumed) overflowed++;
+
+	std::size_t slot = head % capacity;
+	timestamps[slot] = time;
+	int* values = samples.data() + slot * width;
+	std::copy(data.begin(), data.end(), values);
+	std::fill(values + data.size(), values + width, 0);
+	head++;
+}
+
+std::size_t SensorBuffer::read(SensorCursor& cursor, SensorSamples& out) {
+	// Skip what was overwritten since the last read.
+	unsigned long long oldest = head > capacity ? head - capacity : 0;
+	if (cursor.next < oldest) {
+		cursor.missed += oldest - cursor.next;
+		cursor.next = oldest;
+	}
+	// A cursor from another buffer may be ahead, start over with what is there then.
+	if (cursor.next > head) cursor.next = oldest;
+
+	std::size_t count = static_cast<std::size_t>(head - cursor.next);
+	out.width = width;
+	out.timestamps.resize(count);
+	out.samples.resize(count * width);
+
+	// Copy in at most two pieces, up to the end of the ring and from its start.
+	std::size_t first = static_cast<std::size_t>(cursor.next % capacity);
+	std::size_t firstCount = std::min(count, capacity - first);
+	std::copy(timestamps.begin() + first, timestamps.begin() + first + firstCount, out.timestamps.begin());
+	std::copy(timestamps.begin(), timestamps.begin() + (count - firstCount), out.timestamps.begin() + firstCount);
+	std::copy(samples.begin() + first * width, samples.begin() + (first + firstCount) * width, out.samples.begin());
+	std::copy(samples.begin(), samples.begin() + (count - firstCount) * width, out.samples.begin() + firstCount * width);
+
+	cursor.next = head;
+	consumed = std::max(consumed, head);
+	return count;
+}
+
+SensorBufferStats SensorBuffer::stats() const {
+	SensorBufferStats result;
+	result.received = head;
+	result.overflowed = overflowed;
+	return result;
+}
+
+// Makes room for wider readings, the readings already stored are padded with zeros.
+void SensorBuffer::widen(std::size_t newWidth) {
+	std::vector<int> widened(capacity * newWidth, 0);
+	for (std::size_t i = 0; i < capacity; i++)
+		std::copy(samples.begin() + i * width, samples.begin() + (i + 1) * width, widened.begin() + i * newWidth);
+	samples.swap(widened);
+	width = newWidth;
+}
@@ -0,0 +1,164 @@
+// logDecoder.cpp : Converts binary traffic logs, written with LogFormat::Binary, to text or CSV and summarizes them.
+//
+// Usage: logDecoder [--csv | --summary] file...
+//   By default prints one text line per record followed by the summary.
+//   --csv prints one CSV row per record and no summary.
+//   --summary prints the summary only: the records per message type and direction, the latency of the
+//   confirmed requests of every type and the entries the client dropped.
+
+#include "log.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <map>
+
+// Labels of LogDirection values, as in text logs.
+static const char* const directionLabels[] = { "SENT", "RECEIVED", "OK CONFIRMED", "ERROR", "DROPPED" };
+static const size_t directionCount = sizeof(directionLabels) / sizeof(directionLabels[0]);
+
+// Decoded binary log record.
+struct Record {
+    // Wall clock time, from the steady clock time and the clocks in the file header
+    long long timeNs;
+    long long latencyNs;
+    unsigned int messageId;
+    int deviceIndex;
+    unsigned int direction;
+    unsigned int messageType;
+};
+
+// Counters and latencies of one message type.
+struct TypeSummary {
+    unsigned long long directions[directionCount] = {};
+    std::vector<long long> latencies;
+};
+
+static unsigned long long readLittleEndian(const unsigned char* data, size_t bytes) {
+    unsigned long long value = 0;
+    for (size_t i = 0; i < bytes; i++) value |= static_cast<unsigned long long>(data[i]) << (8 * i);
+    return value;
+}
+
+static const char* directionLabel(unsigned int direction) {
+    return direction < directionCount ? directionLabels[direction] : "?";
+}
+
+static void printText(const Record& record) {
+    std::time_t seconds = static_cast<std::time_t>(record.timeNs / 1000000000);
+    long long millis = record.timeNs / 1000000 % 1000;
+    std::cout << std::put_time(std::localtime(&seconds), "%Y-%m-%d %H:%M:%S") << "." << std::setfill('0') << std::setw(3) << millis
+              << std::setfill(' ') << " [" << directionLabel(record.direction) << "] ";
+    if (record.direction == static_cast<unsigned int>(LogDirection::Dropped)) {
+        std::cout << record.messageId << " entries\n";
+        return;
+    }
+    std::cout << mhl::messageTypeName(static_cast<mhl::MessageTypes>(record.messageType)) << " (ID: " << record.messageId << ")";
+    if (record.deviceIndex >= 0) std::cout << " device " << record.deviceIndex;
+    if (record.latencyNs >= 0) std::cout << " latency " << record.latencyNs / 1000 << " us";
+    std::cout << '\n';
+}
+
+static void printCsv(const Record& record) {
+    std::cout << record.timeNs << "," << directionLabel(record.direction) << ","
+              << mhl::messageTypeName(static_cast<mhl::MessageTypes>(record.messageType)) << "," << record.messageId << ","
+              << record.deviceIndex << "," << record.latencyNs << '\n';
+}
+
+static void printSummary(std::map<unsigned int, TypeSummary>& summaries, unsigned long long dropped) {
+    std::cout << '\n' << std::left << std::setw(22) << "type";
+    for (size_t i = 0; i + 1 < directionCount; i++) std::cout << std::right << std::setw(14) << directionLabels[i];
+    std::cout << std::setw(12) << "p50 us" << std::setw(12) << "p99 us" << std::setw(12) << "max us" << '\n';
+
+    for (auto& el : summaries) {
+        std::cout << std::left << std::setw(22) << mhl::messageTypeName(static_cast<mhl::MessageTypes>(el.first)) << std::right;
+        for (size_t i = 0; i + 1 < directionCount; i++) std::cout << std::setw(14) << el.second.directions[i];
+        std::vector<long long>& latencies = el.second.latencies;
+        if (latencies.empty()) {
+            std::cout << std::setw(12) << "-" << std::setw(12) << "-" << std::setw(12) << "-" << '\n';
+            continue;
+        }
+        std::sort(latencies.begin(), latencies.end());
+        std::cout << std::setw(12) << latencies[latencies.size() / 2] / 1000
+                  << std::setw(12) << latencies[latencies.size() * 99 / 100] / 1000
+                  << std::setw(12) << latencies.back() / 1000 << '\n';
+    }
+    std::cout << "dropped entries: " << dropped << '\n';
+}
+
+int main(int argc, char** argv) {
+    bool csv = false;
+    bool summaryOnly = false;
+    std::vector<std::string> files;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--csv") csv = true;
+        else if (arg == "--summary") summaryOnly = true;
+        else files.push_back(arg);
+    }
+    if (files.empty() || (csv && summaryOnly)) {
+        std::cerr << "Usage: logDecoder [--csv | --summary] file..." << std::endl;
+        return 2;
+    }
+
+    if (csv) std::cout << "time_ns,direction,type,id,device,latency_ns" << '\n';
+    std::map<unsigned int, TypeSummary> summaries;
+    unsigned long long dropped = 0;
+
+    for (auto& file : files) {
+        std::ifstream in(file, std::ios::in | std::ios::binary);
+        if (!in) {
+            std::cerr << "Could not open " << file << std::endl;
+            return 1;
+        }
+
+        // A file holds several headers when a client appended to it, each one sets the clocks of the
+        // records after it.
+        bool hasHeader = false;
+        long long wallStartNs = 0;
+        long long steadyStartNs = 0;
+        unsigned char data[binaryLogRecordSize];
+        static_assert(binaryLogHeaderSize == binaryLogRecordSize, "Headers and records are read in chunks of one size");
+        while (in.read(reinterpret_cast<char*>(data), sizeof(data))) {
+            if (std::memcmp(data, binaryLogMagic, sizeof(binaryLogMagic)) == 0) {
+                if (readLittleEndian(data + 24, 4) != binaryLogRecordSize) {
+                    std::cerr << file << " has records of an unknown size" << std::endl;
+                    return 1;
+                }
+                wallStartNs = static_cast<long long>(readLittleEndian(data + 8, 8));
+                steadyStartNs = static_cast<long long>(readLittleEndian(data + 16, 8));
+                hasHeader = true;
+                continue;
+            }
+            if (!hasHeader) {
+                std::cerr << file << " is not a binary log" << std::endl;
+                return 1;
+            }
+
+            Record record;
+            record.timeNs = wallStartNs + (static_cast<long long>(readLittleEndian(data, 8)) - steadyStartNs);
+            record.latencyNs = static_cast<long long>(readLittleEndian(data + 8, 8));
+            record.messageId = static_cast<unsigned int>(readLittleEndian(data + 16, 4));
+            record.deviceIndex = static_cast<int>(static_cast<unsigned int>(readLittleEndian(data + 20, 4)));
+            record.direction = static_cast<unsigned int>(data[24]);
+            record.messageType = static_cast<unsigned int>(data[25]);
+
+            if (csv) printCsv(record);
+            else if (!summaryOnly) printText(record);
+
+            if (record.direction == static_cast<unsigned int>(LogDirection::Dropped)) {
+                dropped += record.messageId;
+                continue;
+            }
+            TypeSummary& summary = summaries[record.messageType];
+            if (record.direction < directionCount) summary.directions[record.direction]++;
+            if (record.latencyNs >= 0) summary.latencies.push_back(record.latencyNs);
+        }
+    }
+
+    if (!csv) printSummary(summaries, dropped);
+    // Lines are not flushed one by one, decoding a large log is bound by output otherwise.
+    std::cout.flush();
+    return 0;
+}